@@ -73,6 +73,7 @@ Gif_Stream *	Gif_CopyStreamImages(Gif_Stream *);
 #define		Gif_ImageCount(gfs)		((gfs)->nimages)
 
 #define		GIF_UNOPTIMIZE_SIMPLEST_DISPOSAL	1
+#define		GIF_UNOPTIMIZE_CROP			2
 
 void		Gif_CalculateScreenSize(Gif_Stream *, int force);
 int		Gif_Unoptimize(Gif_Stream *);
@@ -101,6 +102,12 @@ struct Gif_Image {
     uint8_t **img;		/* img[y][x] == image byte (x,y) */
     uint8_t *image_data;
     void (*free_image_data)(void *);
+    void *image_data_owner;	/* if nonnull, free_image_data is passed
+				   this instead of image_data */
+    uint32_t stride;		/* if nonzero, img[y] == img[0] + y * stride */
+    uint8_t *index_map;		/* if nonnull, pixel (x,y) is
+				   index_map[img[y][x]]; see
+				   Gif_ApplyIndexMap */
 
     uint32_t compressed_len;
     uint8_t *compressed;
@@ -133,19 +140,35 @@ int		Gif_ImageNumber(Gif_Stream *gfs, Gif_Image *gfi);
 #define		Gif_ImageDelay(gfi)		((gfi)->delay)
 #define		Gif_ImageUserData(gfi)		((gfi)->userdata)
 #define		Gif_SetImageUserData(gfi, v)	((gfi)->userdata = v)
+#define		Gif_ImageContiguous(gfi)	((gfi)->img && (gfi)->stride)
+#define		Gif_ImageDense(gfi)		(Gif_ImageContiguous(gfi) \
+					 && (gfi)->stride == (gfi)->width)
+#define		Gif_ImagePixels(gfi)		((gfi)->img[0])
 
 typedef		void (*Gif_ReadErrorHandler)(int is_error,
 					     const char *error_text,
 					     int frame_number,
 					     void *user_data);
 
+/* A progress function is called as long operations move through frames,
+   with the name of the current phase, the number of frames done, and the
+   total. A nonzero return cancels the operation, which then fails. */
+typedef		int (*Gif_ProgressFunc)(const char *phase, int done, int total,
+					void *thunk);
+
 typedef struct {
     int flags;
-    void *padding[7];
+    int threads;
+    Gif_ProgressFunc progress;
+    void *progress_thunk;
+    void *padding[5];
 } Gif_CompressInfo;
 
 #define		Gif_UncompressImage(gfi)     Gif_FullUncompressImage((gfi),0,0)
 int		Gif_FullUncompressImage(Gif_Image *gfs,Gif_ReadErrorHandler,void*);
+int		Gif_UncompressImageInto(Gif_Image *gfi, uint8_t *data,
+					uint32_t stride,
+					Gif_ReadErrorHandler, void *);
 int		Gif_CompressImage(Gif_Stream *gfs, Gif_Image *gfi);
 int		Gif_FullCompressImage(Gif_Stream *gfs, Gif_Image *gfi,
 				      const Gif_CompressInfo *gcinfo);
@@ -157,6 +180,9 @@ int		Gif_CreateUncompressedImage(Gif_Image *gfi);
 
 int		Gif_ClipImage(Gif_Image *gfi, int l, int t, int w, int h);
 
+int		Gif_ComposeIndexMap(Gif_Image *gfi, const uint8_t *map);
+void		Gif_ApplyIndexMap(Gif_Image *gfi);
+
 void		Gif_InitCompressInfo(Gif_CompressInfo *gcinfo);
 
 
@@ -189,6 +215,7 @@ Gif_Colormap *	Gif_NewFullColormap(int count, int capacity);
 void		Gif_DeleteColormap(Gif_Colormap *);
 
 Gif_Colormap *	Gif_CopyColormap(Gif_Colormap *);
+uint32_t	Gif_ColormapHash(const Gif_Colormap *);
 
 int		Gif_ColorEq(Gif_Color *, Gif_Color *);
 #define		GIF_COLOREQ(c1, c2) \
@@ -222,6 +249,8 @@ struct Gif_Extension {
     uint8_t *data;
     uint32_t length;
     int position;
+    int packetized;		/* data holds GIF sub-blocks, without the
+				   terminating empty block */
 
     Gif_Stream *stream;
     Gif_Extension *next;
@@ -234,6 +263,7 @@ Gif_Extension *	Gif_NewExtension(int, const char *);
 void		Gif_DeleteExtension(Gif_Extension *);
 int		Gif_AddExtension(Gif_Stream *, Gif_Extension *, int);
 Gif_Extension * Gif_GetExtension(Gif_Stream *, int, Gif_Extension *);
+int		Gif_UnpacketizeExtension(Gif_Extension *);
 
 
 /** READING AND WRITING **/
@@ -247,10 +277,13 @@ struct Gif_Record {
 #define GIF_READ_UNCOMPRESSED		2
 #define GIF_READ_CONST_RECORD		4
 #define GIF_READ_TRAILING_GARBAGE_OK	8
+#define GIF_READ_SHARE_COLORMAPS	16
+#define GIF_READ_VERIFY			32	/* decode, but keep no pixels */
 #define GIF_WRITE_CAREFUL_MIN_CODE_SIZE	1
 #define GIF_WRITE_EAGER_CLEAR		2
 #define GIF_WRITE_OPTIMIZE		4
 #define GIF_WRITE_SHRINK		8
+#define GIF_WRITE_FLEXIBLE		16
 
 Gif_Stream *	Gif_ReadFile(FILE *);
 Gif_Stream *	Gif_FullReadFile(FILE *, int flags, Gif_ReadErrorHandler,
@@ -262,11 +295,63 @@ int		Gif_WriteFile(Gif_Stream *gfs, FILE *f);
 int		Gif_FullWriteFile(Gif_Stream *gfs,
 				  const Gif_CompressInfo *gcinfo, FILE *f);
 
+/* Limits on what a read may accept; 0 means no limit. A read that would
+   exceed a limit reports an error and returns null. */
+typedef struct {
+    unsigned long max_frame_pixels;	/* area of any frame or its screen */
+    unsigned long max_frames;
+    unsigned long max_total_pixels;	/* summed area of all frames */
+    unsigned long max_bytes;		/* image data kept in memory, both
+					   compressed and decoded */
+    unsigned long max_msec;		/* time spent reading */
+    void *padding[4];
+} Gif_ReadLimits;
+
+void		Gif_InitReadLimits(Gif_ReadLimits *limits);
+Gif_Stream *	Gif_LimitedReadFile(FILE *f, int read_flags,
+				    const Gif_ReadLimits *limits,
+				    Gif_ReadErrorHandler handler, void *thunk);
+Gif_Stream *	Gif_LimitedReadRecord(const Gif_Record *record, int read_flags,
+				      const Gif_ReadLimits *limits,
+				      Gif_ReadErrorHandler handler,
+				      void *thunk);
+
 #define	Gif_ReadFile(f)		Gif_FullReadFile((f),GIF_READ_UNCOMPRESSED,0,0)
 #define	Gif_ReadRecord(r)	Gif_FullReadRecord((r),GIF_READ_UNCOMPRESSED,0,0)
 #define Gif_CompressImage(s, i)	Gif_FullCompressImage((s),(i),0)
 #define Gif_WriteFile(s, f)	Gif_FullWriteFile((s),0,(f))
 
+Gif_Stream *	Gif_LimitedReadFrameCache(FILE *f,
+					  const Gif_ReadLimits *limits,
+					  Gif_ReadErrorHandler handler,
+					  void *thunk);
+#define	Gif_ReadFrameCache(f)	Gif_LimitedReadFrameCache((f),0,0,0)
+int		Gif_WriteFrameCache(Gif_Stream *gfs, FILE *f);
+
+typedef struct Gif_IncrementalWriter Gif_IncrementalWriter;
+Gif_IncrementalWriter *Gif_IncrementalWriteFileInit(Gif_Stream *gfs,
+				const Gif_CompressInfo *gcinfo, FILE *f);
+int		Gif_IncrementalWriteImage(Gif_IncrementalWriter *giw,
+					  Gif_Stream *gfs, Gif_Image *gfi);
+int		Gif_IncrementalWriteComplete(Gif_IncrementalWriter *giw,
+					     Gif_Stream *gfs, int complete);
+
+
+/** FRAME TASKS **/
+
+typedef int	(*Gif_FrameTaskFunc)(int frame, void *thunk);
+typedef struct Gif_FrameTask Gif_FrameTask;
+
+Gif_FrameTask *	Gif_NewFrameTask(int nframes, int nthreads, int window,
+				 Gif_FrameTaskFunc func, void *thunk);
+Gif_FrameTask *	Gif_NewFrameQueue(int nframes, int nthreads, int window,
+				  Gif_FrameTaskFunc func, void *thunk);
+void		Gif_SubmitFrameTask(Gif_FrameTask *gft, int frame);
+int		Gif_WaitFrameTask(Gif_FrameTask *gft, int frame);
+int		Gif_FinishFrameTask(Gif_FrameTask *gft);
+void		Gif_CancelFrameTask(Gif_FrameTask *gft);
+void		Gif_DeleteFrameTask(Gif_FrameTask *gft);
+
 
 /** HOOKS AND MISCELLANEOUS **/
 
@@ -280,6 +365,23 @@ typedef void	(*Gif_DeletionHookFunc)(int, void *, void *);
 int		Gif_AddDeletionHook(int, Gif_DeletionHookFunc, void *);
 void		Gif_RemoveDeletionHook(int, Gif_DeletionHookFunc, void *);
 
+/* Memory the library allocates goes through these functions, which the
+   default Gif_New and Gif_Delete macros call. Install an allocator before
+   allocating anything, since memory must be freed by the allocator that
+   allocated it; a null argument restores malloc, realloc, and free. The
+   functions may be called from frame task threads. */
+typedef struct {
+    void *(*allocate)(size_t size, void *thunk);
+    void *(*reallocate)(void *p, size_t size, void *thunk);
+    void (*deallocate)(void *p, void *thunk);
+    void *thunk;
+} Gif_Allocator;
+
+void		Gif_SetAllocator(const Gif_Allocator *allocator);
+void *		Gif_Malloc(size_t size);
+void *		Gif_Realloc(void *p, size_t size);
+void		Gif_Free(void *p);
+
 #ifdef GIF_DEBUGGING
 #define		GIF_DEBUG(x)			Gif_Debug x
 void		Gif_Debug(char *x, ...);
@@ -289,9 +391,9 @@ void		Gif_Debug(char *x, ...);
 
 #ifndef Gif_New
 # ifndef xmalloc
-#  define xmalloc		malloc
-#  define xrealloc		realloc
-#  define xfree			free
+#  define xmalloc		Gif_Malloc
+#  define xrealloc		Gif_Realloc
+#  define xfree			Gif_Free
 # endif
 # define Gif_New(t)		((t *)xmalloc(sizeof(t)))
 # define Gif_NewArray(t, n)	((t *)xmalloc(sizeof(t) * (n)))
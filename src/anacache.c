@@ -0,0 +1,287 @@
+/* anacache.c - Persistent cache for stream analysis results.
+   Copyright (C) 2026 Eddie Kohler, ekohler@gmail.com
+   This file is part of gifsicle.
+
+   Gifsicle is free software. It is distributed under the GNU Public License,
+   version 2; you can copy, distribute, or alter it at will, as long
+   as this notice is kept intact and this source code is made available. There
+   is no warranty, express or implied. */
+
+#include <config.h>
+#include "gifsicle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+/* Running the same input through gifsicle several times repeats the same
+   analysis: the color histogram, and the optimizer's per-frame difference
+   bounds and used colors. With --analysis-cache=DIR, these results are
+   stored in DIR, keyed by a digest of the stream they were computed from,
+   and later runs load them instead of recomputing.
+
+   Each cache file is a fixed 40-byte header followed by the payload. All
+   words are in native byte order; a file written on a machine of the other
+   byte order fails the magic check and is ignored. */
+
+const char *analysis_cache_dir;
+
+#define ANACACHE_MAGIC		0x47534143U	/* "GSAC" */
+#define ANACACHE_VERSION	1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t param;
+  uint32_t size;
+  uint64_t digest;
+  uint64_t checksum;
+  char kind[8];
+} anacache_header;
+
+
+/*****
+ * hashing
+ **/
+
+#define ROTL64(x, n)	(((x) << (n)) | ((x) >> (64 - (n))))
+
+static inline uint64_t
+hash_word(uint64_t h, uint64_t w)
+{
+  w *= 0x87C37B91114253D5ULL;
+  w = ROTL64(w, 31);
+  w *= 0x4CF5AD432745937FULL;
+  h ^= w;
+  return ROTL64(h, 27) * 5 + 0x52DCE729;
+}
+
+static uint64_t
+hash_bytes(uint64_t h, const uint8_t *data, uint32_t len)
+{
+  uint64_t w;
+  for (; len >= 8; data += 8, len -= 8) {
+    memcpy(&w, data, 8);
+    h = hash_word(h, w);
+  }
+  w = len;
+  while (len > 0)
+    w = (w << 8) | data[--len];
+  return hash_word(h, w);
+}
+
+static uint64_t
+hash_finish(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  return h ^ (h >> 33);
+}
+
+static uint64_t
+hash_colormap(uint64_t h, const Gif_Colormap *gfcm)
+{
+  int i;
+  if (!gfcm)
+    return hash_word(h, 0xFFFFFFFFU);
+  h = hash_word(h, gfcm->ncol);
+  for (i = 0; i < gfcm->ncol; i++)
+    h = hash_word(h, (gfcm->col[i].red << 16) | (gfcm->col[i].green << 8)
+		  | gfcm->col[i].blue);
+  return h;
+}
+
+/* Return a digest of everything in gfs that the cached analyses depend on:
+   the screen, colormaps, frame geometry, transparency, disposal, and pixels.
+   Frames held only in compressed form are hashed compressed, which is much
+   cheaper than decoding them; the same frames held uncompressed get a
+   different digest, so they just miss the cache. */
+uint64_t
+stream_digest(Gif_Stream *gfs)
+{
+  uint64_t h = ANACACHE_VERSION;
+  int i, y;
+
+  h = hash_word(h, gfs->screen_width | (gfs->screen_height << 16));
+  h = hash_word(h, gfs->background);
+  h = hash_colormap(h, gfs->global);
+  h = hash_word(h, gfs->nimages);
+
+  for (i = 0; i < gfs->nimages; i++) {
+    Gif_Image *gfi = gfs->images[i];
+    h = hash_word(h, gfi->left | (gfi->top << 16));
+    h = hash_word(h, gfi->width | (gfi->height << 16));
+    h = hash_word(h, (gfi->transparent & 0xFFFF) | (gfi->disposal << 16));
+    h = hash_colormap(h, gfi->local);
+    if (gfi->index_map)
+      h = hash_bytes(h, gfi->index_map, 256);
+    if (gfi->img) {
+      h = hash_word(h, 1);
+      if (Gif_ImageDense(gfi))
+	h = hash_bytes(h, Gif_ImagePixels(gfi),
+		       (uint32_t) gfi->width * gfi->height);
+      else
+	for (y = 0; y < gfi->height; y++)
+	  h = hash_bytes(h, gfi->img[y], gfi->width);
+    } else {
+      h = hash_word(h, 2);
+      h = hash_bytes(h, gfi->compressed, gfi->compressed_len);
+    }
+  }
+
+  return hash_finish(h);
+}
+
+
+/*****
+ * loading and storing
+ **/
+
+static void
+cache_filename(char *buf, uint64_t digest, const char *kind, uint32_t param)
+{
+  sprintf(buf, "%s/%08lx%08lx.%s%lu", analysis_cache_dir,
+	  (unsigned long) (digest >> 32), (unsigned long) (digest & 0xFFFFFFFFU),
+	  kind, (unsigned long) param);
+}
+
+/* Load the payload in file 'name' if it was stored for (digest, kind,
+   param). Returns a new array the caller must Gif_DeleteArray, and sets
+   *size_store to its length; or returns null if there is no valid entry. */
+static uint8_t *
+cache_file_load(const char *name, uint64_t digest, const char *kind,
+		uint32_t param, uint32_t *size_store)
+{
+  FILE *f;
+  anacache_header hdr;
+  uint8_t *data = 0;
+
+  f = fopen(name, "rb");
+  if (!f)
+    return 0;
+
+  if (fread(&hdr, sizeof(hdr), 1, f) == 1
+      && hdr.magic == ANACACHE_MAGIC && hdr.version == ANACACHE_VERSION
+      && hdr.param == param && hdr.digest == digest
+      && strncmp(hdr.kind, kind, sizeof(hdr.kind)) == 0) {
+    data = Gif_NewArray(uint8_t, hdr.size ? hdr.size : 1);
+    if (!data
+	|| fread(data, 1, hdr.size, f) != hdr.size || getc(f) != EOF
+	|| hash_finish(hash_bytes(digest, data, hdr.size)) != hdr.checksum) {
+      Gif_DeleteArray(data);
+      data = 0;
+    } else
+      *size_store = hdr.size;
+  }
+
+  fclose(f);
+  return data;
+}
+
+/* Store a payload for (digest, kind, param) in file 'name'. The payload is
+   written to a temporary file that then replaces 'name', so an interrupted
+   write leaves any old file alone. Returns 1 on success; otherwise sets
+   errno and returns 0. */
+static int
+cache_file_store(const char *name, uint64_t digest, const char *kind,
+		 uint32_t param, const uint8_t *data, uint32_t size)
+{
+  char *tmpname;
+  FILE *f;
+  anacache_header hdr;
+  size_t kind_len;
+  int ok, saved_errno;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = ANACACHE_MAGIC;
+  hdr.version = ANACACHE_VERSION;
+  hdr.param = param;
+  hdr.size = size;
+  hdr.digest = digest;
+  hdr.checksum = hash_finish(hash_bytes(digest, data, size));
+  kind_len = strlen(kind);
+  if (kind_len > sizeof(hdr.kind))
+    kind_len = sizeof(hdr.kind);
+  memcpy(hdr.kind, kind, kind_len);
+
+  tmpname = Gif_NewArray(char, strlen(name) + 5);
+  sprintf(tmpname, "%s.tmp", name);
+  f = fopen(tmpname, "wb");
+  ok = f && fwrite(&hdr, sizeof(hdr), 1, f) == 1
+    && fwrite(data, 1, size, f) == size;
+  if (f && fclose(f) != 0)
+    ok = 0;
+  if (ok && rename(tmpname, name) != 0)
+    ok = 0;
+  if (!ok) {
+    saved_errno = errno;
+    remove(tmpname);
+    errno = saved_errno;
+  }
+  Gif_DeleteArray(tmpname);
+  return ok;
+}
+
+/* Load the payload stored for (digest, kind, param). Returns a new array
+   the caller must Gif_DeleteArray, and sets *size_store to its length; or
+   returns null if there is no valid entry. */
+uint8_t *
+analysis_cache_load(uint64_t digest, const char *kind, uint32_t param,
+		    uint32_t *size_store)
+{
+  char *name;
+  uint8_t *data;
+  size_t namelen = strlen(analysis_cache_dir) + strlen(kind) + 32;
+
+  name = Gif_NewArray(char, namelen);
+  cache_filename(name, digest, kind, param);
+  data = cache_file_load(name, digest, kind, param, size_store);
+  Gif_DeleteArray(name);
+  return data;
+}
+
+/* Store a payload for (digest, kind, param), replacing any old entry. */
+void
+analysis_cache_store(uint64_t digest, const char *kind, uint32_t param,
+		     const uint8_t *data, uint32_t size)
+{
+  static int warned = 0;
+  char *name;
+  size_t namelen = strlen(analysis_cache_dir) + strlen(kind) + 32;
+
+  name = Gif_NewArray(char, namelen);
+  cache_filename(name, digest, kind, param);
+  if (!cache_file_store(name, digest, kind, param, data, size)) {
+    if (!warned)
+      warning(0, "can't write analysis cache %s: %s", name, strerror(errno));
+    warned = 1;
+  }
+  Gif_DeleteArray(name);
+}
+
+
+/*****
+ * checkpoints
+ **/
+
+/* A checkpoint file has the same format as a cache file, with kind
+   "ckpt". */
+
+const char *checkpoint_file;
+int checkpoint_resume;
+unsigned long checkpoint_interval = 60;
+
+uint8_t *
+checkpoint_load(uint64_t digest, uint32_t param, uint32_t *size_store)
+{
+  return cache_file_load(checkpoint_file, digest, "ckpt", param, size_store);
+}
+
+int
+checkpoint_store(uint64_t digest, uint32_t param, const uint8_t *data,
+		 uint32_t size)
+{
+  return cache_file_store(checkpoint_file, digest, "ckpt", param, data, size);
+}
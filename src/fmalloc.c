@@ -3,6 +3,7 @@
 #endif
 #include <stdlib.h>
 #include <stdio.h>
+#include <lcdfgif/gif.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -19,7 +20,7 @@ fail_die_malloc_die(size_t size, const char *file, int line)
 void *
 fail_die_malloc(size_t size, const char *file, int line)
 {
-  void *p = malloc(size);
+  void *p = Gif_Malloc(size);
   if (!p && size)
     fail_die_malloc_die(size, file, line);
   return p;
@@ -30,7 +31,7 @@ fail_die_realloc(void *p, size_t size, const char *file, int line)
 {
   if (!p)
     return fail_die_malloc(size, file, line);
-  p = realloc(p, size);
+  p = Gif_Realloc(p, size);
   if (!p && size)
     fail_die_malloc_die(size, file, line);
   return p;
@@ -0,0 +1,540 @@
+/* gifcache.c - Functions to store and map decoded GIF frames.
+   Copyright (C) 2026 Eddie Kohler, kohler@cs.ucla.edu
+   This file is part of the LCDF GIF library.
+
+   The LCDF GIF library is free software. It is distributed under the GNU
+   General Public License, version 2; you can copy, distribute, or alter it at
+   will, as long as this notice is kept intact and this source code is made
+   available. There is no warranty, express or implied. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#elif !defined(__cplusplus)
+/* Assume we don't have inline by default */
+# define inline
+#endif
+#include <lcdfgif/gif.h>
+#include <string.h>
+#if HAVE_PTHREAD
+# include <pthread.h>
+#endif
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+#endif
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A frame cache holds a stream's frames already decoded, so reading it
+   costs no LZW work at all. The layout, with little-endian integers:
+
+   0	8-byte magic, then version, alignment (uint32 each)
+   16	screen width, screen height, background, global colormap size
+	(uint16 each; a size of 0xFFFF means no global colormap)
+   24	loop count (int32, -1 for none), image count (uint32)
+   32	global colormap, 256 RGB triples
+   800	one 800-byte descriptor per image: plane offset (uint64); left,
+	top, width, height (uint16); transparent (int16); delay (uint16);
+	disposal, interlace (uint8); local colormap size (uint16); then
+	256 RGB triples and padding
+
+   Each image's pixels follow as a raw plane of width * height colormap
+   indexes in display order, starting at a multiple of the alignment. When
+   the system supports mmap, Gif_ReadFrameCache maps the file and points
+   each image's data straight into the mapping, so frames are paged in as
+   they are used and shared between processes reading the same file.
+   Names, comments, and extensions are not stored. */
+
+#define FRAME_CACHE_VERSION	1
+#define FRAME_CACHE_ALIGN	4096
+#define FRAME_CACHE_HEADER	800
+#define FRAME_CACHE_DESCRIPTOR	800
+
+static const uint8_t frame_cache_magic[8] = {
+  0x89, 'G', 'F', 'C', '\r', '\n', 0x1A, '\n'
+};
+
+
+static inline void
+put_16(uint8_t *p, unsigned v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static inline void
+put_32(uint8_t *p, uint32_t v)
+{
+  put_16(p, v);
+  put_16(p + 2, v >> 16);
+}
+
+static inline unsigned
+get_16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t
+get_32(const uint8_t *p)
+{
+  return get_16(p) | ((uint32_t) get_16(p + 2) << 16);
+}
+
+/* Store gfcm's size at 'size' and its colors at 'col'. */
+static void
+put_colormap(uint8_t *size, uint8_t *col, const Gif_Colormap *gfcm)
+{
+  int i;
+  put_16(size, gfcm ? gfcm->ncol : 0xFFFF);
+  for (i = 0; gfcm && i < gfcm->ncol && i < 256; i++, col += 3) {
+    col[0] = gfcm->col[i].red;
+    col[1] = gfcm->col[i].green;
+    col[2] = gfcm->col[i].blue;
+  }
+}
+
+static uint32_t
+align_offset(uint32_t off)
+{
+  return (off + FRAME_CACHE_ALIGN - 1) & ~(uint32_t) (FRAME_CACHE_ALIGN - 1);
+}
+
+
+/*****
+ * writing
+ **/
+
+static int
+write_zeros(uint32_t n, FILE *f)
+{
+  static const uint8_t zeros[256] = { 0 };
+  while (n > 0) {
+    uint32_t amt = n < 256 ? n : 256;
+    if (fwrite(zeros, 1, amt, f) != amt)
+      return 0;
+    n -= amt;
+  }
+  return 1;
+}
+
+static int
+write_plane(Gif_Image *gfi, uint8_t *row, FILE *f)
+{
+  int y, x;
+  for (y = 0; y < gfi->height; y++) {
+    const uint8_t *data = gfi->img[y];
+    if (gfi->index_map) {
+      for (x = 0; x < gfi->width; x++)
+	row[x] = gfi->index_map[data[x]];
+      data = row;
+    }
+    if (fwrite(data, 1, gfi->width, f) != gfi->width)
+      return 0;
+  }
+  return 1;
+}
+
+int
+Gif_WriteFrameCache(Gif_Stream *gfs, FILE *f)
+{
+  uint32_t header_size = FRAME_CACHE_HEADER
+    + FRAME_CACHE_DESCRIPTOR * gfs->nimages;
+  uint8_t *header = Gif_NewArray(uint8_t, header_size);
+  uint8_t *row = Gif_NewArray(uint8_t, gfs->screen_width + 1);
+  uint32_t off, pos;
+  int i, ok = header && row;
+
+  /* describe the stream and the placement of every plane */
+  if (ok) {
+    memset(header, 0, header_size);
+    memcpy(header, frame_cache_magic, 8);
+    put_32(header + 8, FRAME_CACHE_VERSION);
+    put_32(header + 12, FRAME_CACHE_ALIGN);
+    put_16(header + 16, gfs->screen_width);
+    put_16(header + 18, gfs->screen_height);
+    put_16(header + 20, gfs->background);
+    put_colormap(header + 22, header + 32, gfs->global);
+    put_32(header + 24, gfs->loopcount < 0 ? 0xFFFFFFFFU : gfs->loopcount);
+    put_32(header + 28, gfs->nimages);
+  }
+
+  off = align_offset(header_size);
+  for (i = 0; ok && i < gfs->nimages; i++) {
+    Gif_Image *gfi = gfs->images[i];
+    uint8_t *d = header + FRAME_CACHE_HEADER + FRAME_CACHE_DESCRIPTOR * i;
+    uint32_t plane_size = (uint32_t) gfi->width * gfi->height;
+    /* offsets are 64 bits wide, but this version writes only 32 */
+    if (off > 0xFFFFFFFFU - FRAME_CACHE_ALIGN - plane_size)
+      ok = 0;
+    put_32(d, off);
+    put_16(d + 8, gfi->left);
+    put_16(d + 10, gfi->top);
+    put_16(d + 12, gfi->width);
+    put_16(d + 14, gfi->height);
+    put_16(d + 16, gfi->transparent & 0xFFFF);
+    put_16(d + 18, gfi->delay);
+    d[20] = gfi->disposal;
+    d[21] = gfi->interlace;
+    put_colormap(d + 22, d + 24, gfi->local);
+    off = align_offset(off + plane_size);
+  }
+
+  ok = ok && fwrite(header, 1, header_size, f) == header_size;
+  pos = header_size;
+
+  /* write the planes */
+  for (i = 0; ok && i < gfs->nimages; i++) {
+    Gif_Image *gfi = gfs->images[i];
+    int was_compressed = (gfi->img == 0);
+    uint32_t data_off = get_32(header + FRAME_CACHE_HEADER
+			       + FRAME_CACHE_DESCRIPTOR * i);
+    ok = write_zeros(data_off - pos, f);
+    if (ok && was_compressed)
+      ok = Gif_UncompressImage(gfi);
+    if (ok && gfi->width > gfs->screen_width) {
+      Gif_ReArray(row, uint8_t, gfi->width);
+      ok = row != 0;
+    }
+    if (ok)
+      ok = write_plane(gfi, row, f);
+    if (was_compressed)
+      Gif_ReleaseUncompressedImage(gfi);
+    pos = data_off + (uint32_t) gfi->width * gfi->height;
+  }
+
+  Gif_DeleteArray(header);
+  Gif_DeleteArray(row);
+  return ok;
+}
+
+
+/*****
+ * reading
+ **/
+
+/* A cache read into memory. Every image whose data points into it holds a
+   reference and names the cache as its image_data_owner, so its
+   free_image_data releases the reference directly. Images from one cache
+   may be freed on different frame task threads. */
+
+typedef struct Gif_FrameCacheData {
+  uint8_t *base;
+  size_t size;
+  int mapped;
+  int refcount;
+#if HAVE_PTHREAD
+  pthread_mutex_t lock;
+#endif
+} Gif_FrameCacheData;
+
+static void
+release_frame_cache(void *owner)
+{
+  Gif_FrameCacheData *fcd = (Gif_FrameCacheData *) owner;
+  int refcount;
+#if HAVE_PTHREAD
+  pthread_mutex_lock(&fcd->lock);
+#endif
+  refcount = --fcd->refcount;
+#if HAVE_PTHREAD
+  pthread_mutex_unlock(&fcd->lock);
+#endif
+  if (refcount > 0)
+    return;
+#if HAVE_PTHREAD
+  pthread_mutex_destroy(&fcd->lock);
+#endif
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+  if (fcd->mapped)
+    munmap((void *) fcd->base, fcd->size);
+  else
+#endif
+    Gif_DeleteArray(fcd->base);
+  Gif_Delete(fcd);
+}
+
+/* Check the fixed header at 'p'. Returns 0 if it isn't a frame cache. */
+static int
+frame_cache_header_valid(const uint8_t *p)
+{
+  return memcmp(p, frame_cache_magic, 8) == 0
+    && get_32(p + 8) == FRAME_CACHE_VERSION
+    && (get_16(p + 22) <= 256 || get_16(p + 22) == 0xFFFF)
+    && get_32(p + 28) <= ((size_t) -1 - FRAME_CACHE_HEADER)
+			  / FRAME_CACHE_DESCRIPTOR;
+}
+
+/* Check the descriptors following the header at 'p' and store the size
+   the cache must have to hold every plane. Returns 0 if they are bad. */
+static int
+frame_cache_descriptors_valid(const uint8_t *p, size_t *size_store)
+{
+  uint32_t nimages = get_32(p + 28), i;
+  uint64_t size = FRAME_CACHE_HEADER
+    + (uint64_t) FRAME_CACHE_DESCRIPTOR * nimages;
+  for (i = 0; i < nimages; i++) {
+    const uint8_t *d = p + FRAME_CACHE_HEADER + FRAME_CACHE_DESCRIPTOR * i;
+    uint64_t end = get_32(d) + (uint64_t) get_16(d + 12) * get_16(d + 14);
+    int transparent = (int16_t) get_16(d + 16);
+    if (get_32(d + 4) != 0 || transparent < -1 || transparent > 255
+	|| d[20] > 7 || (get_16(d + 22) > 256 && get_16(d + 22) != 0xFFFF))
+      return 0;
+    if (end > size)
+      size = end;
+  }
+  if (size > (size_t) -1)
+    return 0;
+  *size_store = size;
+  return 1;
+}
+
+/* Report that the cache exceeds a read limit, as gifread.c does. */
+static int
+frame_cache_over_limit(Gif_ReadErrorHandler handler, void *thunk, int frame,
+		       const char *what, double value, unsigned long limit)
+{
+  char buf[128];
+  sprintf(buf, "%s %.0f exceeds read limit %lu", what, value, limit);
+  if (handler)
+    handler(1, buf, frame, thunk);
+  return 0;
+}
+
+/* Check the header at 'p' against the limits. */
+static int
+frame_cache_header_within_limits(const uint8_t *p, const Gif_ReadLimits *lim,
+				 Gif_ReadErrorHandler handler, void *thunk)
+{
+  uint32_t nimages = get_32(p + 28);
+  unsigned long screen_area = (unsigned long) get_16(p + 16) * get_16(p + 18);
+  if (lim->max_frames && nimages > lim->max_frames)
+    return frame_cache_over_limit(handler, thunk, 0, "frame count",
+				  nimages, lim->max_frames);
+  if (lim->max_frame_pixels && screen_area > lim->max_frame_pixels)
+    return frame_cache_over_limit(handler, thunk, 0, "screen area",
+				  screen_area, lim->max_frame_pixels);
+  return 1;
+}
+
+/* Check the descriptors after the header at 'p' against the limits. Every
+   plane is already decoded, so its pixels count toward max_bytes; max_msec
+   does not apply, since nothing is decoded. */
+static int
+frame_cache_frames_within_limits(const uint8_t *p, const Gif_ReadLimits *lim,
+				 Gif_ReadErrorHandler handler, void *thunk)
+{
+  uint32_t nimages = get_32(p + 28), i;
+  unsigned screen_width = get_16(p + 16), screen_height = get_16(p + 18);
+  double total_pixels = 0;
+
+  for (i = 0; i < nimages; i++) {
+    const uint8_t *d = p + FRAME_CACHE_HEADER + FRAME_CACHE_DESCRIPTOR * i;
+    unsigned long area = (unsigned long) get_16(d + 12) * get_16(d + 14);
+    unsigned sw = get_16(d + 8) + get_16(d + 12);
+    unsigned sh = get_16(d + 10) + get_16(d + 14);
+    double frame_screen_area;
+    if (sw < screen_width)
+      sw = screen_width;
+    if (sh < screen_height)
+      sh = screen_height;
+    frame_screen_area = (double) sw * sh;
+    if (lim->max_frame_pixels && frame_screen_area > lim->max_frame_pixels)
+      return frame_cache_over_limit(handler, thunk, i,
+				    area > lim->max_frame_pixels
+				    ? "frame area" : "screen area",
+				    area > lim->max_frame_pixels
+				    ? area : frame_screen_area,
+				    lim->max_frame_pixels);
+    total_pixels += area;
+    if (lim->max_total_pixels && total_pixels > lim->max_total_pixels)
+      return frame_cache_over_limit(handler, thunk, i, "total frame area",
+				    total_pixels, lim->max_total_pixels);
+    if (lim->max_bytes && total_pixels > lim->max_bytes)
+      return frame_cache_over_limit(handler, thunk, i, "image data size",
+				    total_pixels, lim->max_bytes);
+  }
+  return 1;
+}
+
+/* Read from 'f' until fcd holds 'size' bytes. Returns 0 on a short read. */
+static int
+read_frame_cache_to(Gif_FrameCacheData *fcd, size_t size, FILE *f)
+{
+  Gif_ReArray(fcd->base, uint8_t, size);
+  if (!fcd->base)
+    return 0;
+  while (fcd->size < size) {
+    size_t amt = fread(fcd->base + fcd->size, 1, size - fcd->size, f);
+    if (amt == 0)
+      return 0;
+    fcd->size += amt;
+  }
+  return 1;
+}
+
+/* Load and check a frame cache. A mapped file is checked in place. Other
+   input is read in three steps -- header, descriptors, planes -- and
+   checked after each, so a cache that breaks a limit is rejected before
+   its planes take any memory. */
+static Gif_FrameCacheData *
+load_frame_cache(FILE *f, const Gif_ReadLimits *limits,
+		 Gif_ReadErrorHandler handler, void *thunk)
+{
+  Gif_FrameCacheData *fcd = Gif_New(Gif_FrameCacheData);
+  size_t size = 0;
+  int ok;
+  if (!fcd)
+    return 0;
+  fcd->base = 0;
+  fcd->size = 0;
+  fcd->mapped = 0;
+  fcd->refcount = 1;
+
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+  /* map regular files read at their start */
+  {
+    struct stat st;
+    if (ftell(f) == 0 && fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode)
+	&& st.st_size >= FRAME_CACHE_HEADER
+	&& (off_t) (size_t) st.st_size == st.st_size) {
+      void *p = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		     fileno(f), 0);
+      if (p != MAP_FAILED) {
+	fcd->base = (uint8_t *) p;
+	fcd->size = st.st_size;
+	fcd->mapped = 1;
+	fseek(f, 0, SEEK_END);
+      }
+    }
+  }
+#endif
+
+  if (fcd->mapped)
+    ok = frame_cache_header_valid(fcd->base)
+      && (!limits || frame_cache_header_within_limits(fcd->base, limits,
+						       handler, thunk))
+      && get_32(fcd->base + 28)
+	 <= (fcd->size - FRAME_CACHE_HEADER) / FRAME_CACHE_DESCRIPTOR
+      && frame_cache_descriptors_valid(fcd->base, &size)
+      && size <= fcd->size;
+  else
+    ok = read_frame_cache_to(fcd, FRAME_CACHE_HEADER, f)
+      && frame_cache_header_valid(fcd->base)
+      && (!limits || frame_cache_header_within_limits(fcd->base, limits,
+						       handler, thunk))
+      && read_frame_cache_to(fcd, FRAME_CACHE_HEADER + FRAME_CACHE_DESCRIPTOR
+			     * (size_t) get_32(fcd->base + 28), f)
+      && frame_cache_descriptors_valid(fcd->base, &size);
+  ok = ok && (!limits || frame_cache_frames_within_limits(fcd->base, limits,
+							  handler, thunk));
+  if (ok && !fcd->mapped)
+    ok = read_frame_cache_to(fcd, size, f);
+
+  if (!ok) {
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+    if (fcd->mapped)
+      munmap((void *) fcd->base, fcd->size);
+    else
+#endif
+      Gif_DeleteArray(fcd->base);
+    Gif_Delete(fcd);
+    return 0;
+  }
+#if HAVE_PTHREAD
+  pthread_mutex_init(&fcd->lock, 0);
+#endif
+  return fcd;
+}
+
+static Gif_Colormap *
+get_colormap(const uint8_t *p, int ncol)
+{
+  Gif_Colormap *gfcm = Gif_NewFullColormap(ncol, 256);
+  int i;
+  if (!gfcm)
+    return 0;
+  for (i = 0; i < ncol; i++, p += 3) {
+    gfcm->col[i].red = p[0];
+    gfcm->col[i].green = p[1];
+    gfcm->col[i].blue = p[2];
+    gfcm->col[i].haspixel = 0;
+  }
+  gfcm->refcount++;
+  return gfcm;
+}
+
+/* Read a frame cache. If 'limits' is nonnull, a cache that exceeds them is
+   reported to 'handler' and rejected, like an oversized GIF. */
+Gif_Stream *
+Gif_LimitedReadFrameCache(FILE *f, const Gif_ReadLimits *limits,
+			  Gif_ReadErrorHandler handler, void *thunk)
+{
+  Gif_FrameCacheData *fcd;
+  Gif_Stream *gfs = 0;
+  const uint8_t *p;
+  uint32_t nimages, i;
+  int ok;
+
+  if (!f || !(fcd = load_frame_cache(f, limits, handler, thunk)))
+    return 0;
+  p = fcd->base;
+  ok = (gfs = Gif_NewStream()) != 0;
+
+  if (ok) {
+    uint32_t loopcount = get_32(p + 24);
+    gfs->screen_width = get_16(p + 16);
+    gfs->screen_height = get_16(p + 18);
+    gfs->background = get_16(p + 20);
+    gfs->loopcount = (loopcount == 0xFFFFFFFFU ? -1 : (long) loopcount);
+    if (get_16(p + 22) != 0xFFFF)
+      ok = (gfs->global = get_colormap(p + 32, get_16(p + 22))) != 0;
+  }
+
+  nimages = ok ? get_32(p + 28) : 0;
+  for (i = 0; ok && i < nimages; i++) {
+    const uint8_t *d = p + FRAME_CACHE_HEADER + FRAME_CACHE_DESCRIPTOR * i;
+    Gif_Image *gfi = Gif_NewImage();
+    if (!gfi || !Gif_AddImage(gfs, gfi)) {
+      Gif_DeleteImage(gfi);
+      ok = 0;
+      break;
+    }
+    gfi->left = get_16(d + 8);
+    gfi->top = get_16(d + 10);
+    gfi->width = get_16(d + 12);
+    gfi->height = get_16(d + 14);
+    gfi->transparent = (int16_t) get_16(d + 16);
+    gfi->delay = get_16(d + 18);
+    gfi->disposal = d[20];
+    gfi->interlace = d[21];
+    if (get_16(d + 22) != 0xFFFF
+	&& !(gfi->local = get_colormap(d + 24, get_16(d + 22))))
+      ok = 0;
+    /* planes with no pixels get their own storage, so every pointer into
+       the cache lies strictly inside it */
+    else if (gfi->width == 0 || gfi->height == 0)
+      ok = Gif_SetUncompressedImage(gfi, Gif_NewArray(uint8_t, 1),
+				    Gif_DeleteArrayFunc, 0);
+    else if (Gif_SetUncompressedImage(gfi, fcd->base + get_32(d),
+				      release_frame_cache, 0)) {
+      gfi->image_data_owner = fcd;
+      fcd->refcount++;
+    } else
+      ok = 0;
+  }
+
+  if (!ok) {
+    Gif_DeleteStream(gfs);
+    gfs = 0;
+  }
+  release_frame_cache(fcd);
+  return gfs;
+}
+
+
+#ifdef __cplusplus
+}
+#endif
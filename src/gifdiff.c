@@ -131,6 +131,7 @@ apply_image(int is_second, Gif_Stream *gfs, int imageno, uint16_t background)
 
   /* uncompress and clip */
   Gif_UncompressImage(gfi);
+  Gif_ApplyIndexMap(gfi);
   Gif_ClipImage(gfi, 0, 0, screen_width, screen_height);
 
   any_change = imageno == 0;
@@ -56,6 +56,9 @@ Gif_NewImage(void)
   gfi->img = 0;
   gfi->image_data = 0;
   gfi->free_image_data = Gif_DeleteArrayFunc;
+  gfi->image_data_owner = 0;
+  gfi->stride = 0;
+  gfi->index_map = 0;
   gfi->compressed_len = 0;
   gfi->compressed = 0;
   gfi->free_compressed = 0;
@@ -124,7 +127,9 @@ Gif_NewExtension(int kind, const char *app_name)
   gfex->kind = app_name ? 255 : kind;
   gfex->application = Gif_CopyString(app_name);
   gfex->data = 0;
+  gfex->length = 0;
   gfex->position = 0;
+  gfex->packetized = 0;
   gfex->stream = 0;
   gfex->next = 0;
   gfex->free_data = 0;
@@ -337,6 +342,22 @@ Gif_CopyColormap(Gif_Colormap *src)
   return dest;
 }
 
+/* Hash a colormap's colors (FNV-1a). Equal colormaps hash equal. */
+uint32_t
+Gif_ColormapHash(const Gif_Colormap *gfcm)
+{
+  uint32_t hash = 2166136261U;
+  const Gif_Color *c = gfcm->col;
+  int i;
+  for (i = 0; i < gfcm->ncol; i++, c++) {
+    hash = (hash ^ c->red) * 16777619U;
+    hash = (hash ^ c->green) * 16777619U;
+    hash = (hash ^ c->blue) * 16777619U;
+  }
+  return hash;
+}
+
+
 
 Gif_Image *
 Gif_CopyImage(Gif_Image *src)
@@ -384,11 +405,18 @@ Gif_CopyImage(Gif_Image *src)
     if (!dest->img || !dest->image_data)
       goto failure;
     for (i = 0, data = dest->image_data; i < dest->height; i++) {
-      memcpy(data, src->img[i], dest->width);
+      if (src->index_map) {
+	const uint8_t *srcdata = src->img[i];
+	int x;
+	for (x = 0; x < dest->width; x++)
+	  data[x] = src->index_map[srcdata[x]];
+      } else
+	memcpy(data, src->img[i], dest->width);
       dest->img[i] = data;
       data += dest->width;
     }
     dest->img[dest->height] = 0;
+    dest->stride = dest->width;
   }
   if (src->compressed) {
     if (src->free_compressed == 0)
@@ -466,8 +494,10 @@ Gif_DeleteImage(Gif_Image *gfi)
   Gif_DeleteComment(gfi->comment);
   Gif_DeleteColormap(gfi->local);
   if (gfi->image_data && gfi->free_image_data)
-    (*gfi->free_image_data)((void *)gfi->image_data);
+    (*gfi->free_image_data)(gfi->image_data_owner ? gfi->image_data_owner
+			    : (void *)gfi->image_data);
   Gif_DeleteArray(gfi->img);
+  Gif_DeleteArray(gfi->index_map);
   if (gfi->compressed && gfi->free_compressed)
     (*gfi->free_compressed)((void *)gfi->compressed);
   if (gfi->user_data && gfi->free_user_data)
@@ -567,6 +597,68 @@ Gif_RemoveDeletionHook(int kind, void (*func)(int, void *, void *), void *cb)
 }
 
 
+/** ALLOCATOR **/
+
+static void *
+default_allocate(size_t size, void *thunk)
+{
+  (void) thunk;
+  return malloc(size);
+}
+
+static void *
+default_reallocate(void *p, size_t size, void *thunk)
+{
+  (void) thunk;
+  return realloc(p, size);
+}
+
+static void
+default_deallocate(void *p, void *thunk)
+{
+  (void) thunk;
+  free(p);
+}
+
+static Gif_Allocator allocator = {
+  default_allocate, default_reallocate, default_deallocate, 0
+};
+
+void
+Gif_SetAllocator(const Gif_Allocator *a)
+{
+  if (a)
+    allocator = *a;
+  else {
+    allocator.allocate = default_allocate;
+    allocator.reallocate = default_reallocate;
+    allocator.deallocate = default_deallocate;
+    allocator.thunk = 0;
+  }
+}
+
+void *
+Gif_Malloc(size_t size)
+{
+  return (*allocator.allocate)(size, allocator.thunk);
+}
+
+void *
+Gif_Realloc(void *p, size_t size)
+{
+  if (!p)
+    return (*allocator.allocate)(size, allocator.thunk);
+  return (*allocator.reallocate)(p, size, allocator.thunk);
+}
+
+void
+Gif_Free(void *p)
+{
+  if (p)
+    (*allocator.deallocate)(p, allocator.thunk);
+}
+
+
 int
 Gif_ColorEq(Gif_Color *c1, Gif_Color *c2)
 {
@@ -647,6 +739,34 @@ Gif_GetExtension(Gif_Stream *gfs, int id, Gif_Extension *search_from)
 }
 
 
+/* Turn a packetized extension's data into a plain copy of its payload, with
+   a terminating null byte. Returns 0 on allocation failure. */
+int
+Gif_UnpacketizeExtension(Gif_Extension *gfex)
+{
+  uint32_t pos, len = 0;
+  uint8_t *data;
+  if (!gfex->packetized)
+    return 1;
+  for (pos = 0; pos < gfex->length; pos += gfex->data[pos] + 1)
+    len += gfex->data[pos];
+  if (!(data = Gif_NewArray(uint8_t, len + 1)))
+    return 0;
+  for (pos = 0, len = 0; pos < gfex->length; pos += gfex->data[pos] + 1) {
+    memcpy(data + len, gfex->data + pos + 1, gfex->data[pos]);
+    len += gfex->data[pos];
+  }
+  data[len] = 0;
+  if (gfex->data && gfex->free_data)
+    (*gfex->free_data)(gfex->data);
+  gfex->data = data;
+  gfex->length = len;
+  gfex->packetized = 0;
+  gfex->free_data = Gif_DeleteArrayFunc;
+  return 1;
+}
+
+
 void
 Gif_ReleaseCompressedImage(Gif_Image *gfi)
 {
@@ -662,10 +782,15 @@ Gif_ReleaseUncompressedImage(Gif_Image *gfi)
 {
   Gif_DeleteArray(gfi->img);
   if (gfi->image_data && gfi->free_image_data)
-    (*gfi->free_image_data)(gfi->image_data);
+    (*gfi->free_image_data)(gfi->image_data_owner ? gfi->image_data_owner
+			    : (void *)gfi->image_data);
+  Gif_DeleteArray(gfi->index_map);
   gfi->img = 0;
   gfi->image_data = 0;
   gfi->free_image_data = 0;
+  gfi->image_data_owner = 0;
+  gfi->stride = 0;
+  gfi->index_map = 0;
 }
 
 
@@ -673,6 +798,7 @@ int
 Gif_ClipImage(Gif_Image *gfi, int left, int top, int width, int height)
 {
   int new_width = gfi->width, new_height = gfi->height;
+  int old_left = gfi->left, old_top = gfi->top;
   int y;
 
   if (!gfi->img)
@@ -688,7 +814,7 @@ Gif_ClipImage(Gif_Image *gfi, int left, int top, int width, int height)
 
   if (gfi->top < top) {
     int shift = top - gfi->top;
-    for (y = gfi->height - 1; y >= shift; y++)
+    for (y = shift; y < gfi->height; y++)
       gfi->img[y - shift] = gfi->img[y];
     gfi->top += shift;
     new_height -= shift;
@@ -704,12 +830,63 @@ Gif_ClipImage(Gif_Image *gfi, int left, int top, int width, int height)
     new_width = 0;
   if (new_height < 0)
     new_height = 0;
+  /* compressed data no longer matches a clipped image */
+  if (gfi->compressed && (gfi->left != old_left || gfi->top != old_top
+			  || gfi->width != new_width
+			  || gfi->height != new_height))
+    Gif_ReleaseCompressedImage(gfi);
   gfi->width = new_width;
   gfi->height = new_height;
   return 1;
 }
 
 
+int
+Gif_ComposeIndexMap(Gif_Image *gfi, const uint8_t *map)
+{
+  /* Record that every pixel value p should become map[p], without touching
+     the pixels. Consumers that understand index_map fuse it into their own
+     pass; Gif_ApplyIndexMap performs it outright. Every library function
+     that reads pixels does one or the other, so only code that reads
+     'img' itself must call Gif_ApplyIndexMap first. Returns 0 if the image
+     has no pixels or there's no memory for the map. */
+  int i;
+  if (!gfi->img)
+    return 0;
+  if (!gfi->index_map) {
+    gfi->index_map = Gif_NewArray(uint8_t, 256);
+    if (!gfi->index_map)
+      return 0;
+    memcpy(gfi->index_map, map, 256);
+  } else
+    for (i = 0; i < 256; i++)
+      gfi->index_map[i] = map[gfi->index_map[i]];
+  return 1;
+}
+
+void
+Gif_ApplyIndexMap(Gif_Image *gfi)
+{
+  const uint8_t *map = gfi->index_map;
+  int x, y;
+  if (!map)
+    return;
+  if (Gif_ImageDense(gfi)) {
+    uint8_t *data = Gif_ImagePixels(gfi);
+    uint8_t *end = data + gfi->width * gfi->height;
+    for (; data != end; data++)
+      *data = map[*data];
+  } else
+    for (y = 0; y < gfi->height; y++) {
+      uint8_t *data = gfi->img[y];
+      for (x = 0; x < gfi->width; x++, data++)
+	*data = map[*data];
+    }
+  Gif_DeleteArray(gfi->index_map);
+  gfi->index_map = 0;
+}
+
+
 int
 Gif_InterlaceLine(int line, int height)
 {
@@ -743,6 +920,7 @@ Gif_SetUncompressedImage(Gif_Image *gfi, uint8_t *image_data,
   if (!img)
     return 0;
 
+  /* Interlaced data is left where it is, so the image isn't contiguous. */
   if (data_interlaced)
     for (i = 0; i < height; i++)
       img[ Gif_InterlaceLine(i, height) ] = image_data + width * i;
@@ -754,6 +932,8 @@ Gif_SetUncompressedImage(Gif_Image *gfi, uint8_t *image_data,
   gfi->img = img;
   gfi->image_data = image_data;
   gfi->free_image_data = free_data;
+  gfi->image_data_owner = 0;
+  gfi->stride = data_interlaced ? 0 : width;
   return 1;
 }
 
@@ -761,14 +941,27 @@ int
 Gif_CreateUncompressedImage(Gif_Image *gfi)
 {
   uint8_t *data = Gif_NewArray(uint8_t, gfi->width * gfi->height);
-  return Gif_SetUncompressedImage(gfi, data, Gif_DeleteArrayFunc,
-				  gfi->interlace);
+  return Gif_SetUncompressedImage(gfi, data, Gif_DeleteArrayFunc, 0);
 }
 
 void
 Gif_InitCompressInfo(Gif_CompressInfo *gcinfo)
 {
     gcinfo->flags = 0;
+    gcinfo->threads = 1;
+    gcinfo->progress = 0;
+    gcinfo->progress_thunk = 0;
+}
+
+
+void
+Gif_InitReadLimits(Gif_ReadLimits *limits)
+{
+    limits->max_frame_pixels = 0;
+    limits->max_frames = 0;
+    limits->max_total_pixels = 0;
+    limits->max_bytes = 0;
+    limits->max_msec = 0;
 }
 
 
@@ -17,6 +17,12 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <string.h>
+#include <stdio.h>
+#if HAVE_GETTIMEOFDAY && HAVE_SYS_TIME_H
+# include <sys/time.h>
+#else
+# include <time.h>
+#endif
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -32,14 +38,25 @@ typedef struct {
   uint16_t width;
   uint16_t height;
 
-  uint8_t *image;
-  uint8_t *maximage;
-
+  uint8_t *image;		/* null if only verifying */
   unsigned decodepos;
+  unsigned decodemax;
 
   Gif_ReadErrorHandler handler;
   void *handler_thunk;
 
+  int read_flags;
+  Gif_Colormap **cmaps;		/* hash table of distinct colormaps, used */
+  uint32_t *cmap_hashes;	/* with GIF_READ_SHARE_COLORMAPS */
+  int ncmaps;
+  int cmapscap;
+
+  const Gif_ReadLimits *limits;	/* null if unlimited */
+  int over_limit;
+  unsigned long total_pixels;
+  unsigned long bytes;
+  unsigned long start_msec;
+
 } Gif_Context;
 
 
@@ -161,6 +178,113 @@ gif_read_error(Gif_Context *gfc, int is_error, const char *text)
 }
 
 
+/*****
+ * read limits
+ **/
+
+static unsigned long
+gif_read_msec(void)
+{
+#if HAVE_GETTIMEOFDAY && HAVE_SYS_TIME_H
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return (unsigned long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#else
+  return (unsigned long) (clock() / (CLOCKS_PER_SEC / 1000.));
+#endif
+}
+
+/* Report that the input exceeds a read limit. The read is abandoned and
+   returns no stream. */
+static int
+gif_read_over_limit(Gif_Context *gfc, const char *what,
+		    double value, unsigned long limit)
+{
+  char buf[128];
+  sprintf(buf, "%s %.0f exceeds read limit %lu", what, value, limit);
+  gif_read_error(gfc, 1, buf);
+  gfc->over_limit = 1;
+  return 0;
+}
+
+/* Account for 'n' more bytes of image data. Returns 0 if that is too
+   many. */
+static int
+check_bytes_limit(Gif_Context *gfc, unsigned long n)
+{
+  const Gif_ReadLimits *lim = gfc->limits;
+  if (lim->max_bytes && n > lim->max_bytes - gfc->bytes)
+    return gif_read_over_limit(gfc, "image data size",
+			       (double) gfc->bytes + n,
+			       lim->max_bytes);
+  gfc->bytes += n;
+  return 1;
+}
+
+static int
+check_time_limit(Gif_Context *gfc)
+{
+  const Gif_ReadLimits *lim = gfc->limits;
+  unsigned long elapsed;
+  if (!lim->max_msec)
+    return 1;
+  elapsed = gif_read_msec() - gfc->start_msec;
+  if (elapsed > lim->max_msec)
+    return gif_read_over_limit(gfc, "read time (ms)", elapsed, lim->max_msec);
+  return 1;
+}
+
+/* Check the screen against the limits. Returns 0 if it is too large. */
+static int
+check_screen_limits(Gif_Context *gfc)
+{
+  const Gif_ReadLimits *lim = gfc->limits;
+  /* at most 65535 * 65535, which fits in 32 bits */
+  unsigned long area = (unsigned long) gfc->stream->screen_width
+    * gfc->stream->screen_height;
+  if (lim->max_frame_pixels && area > lim->max_frame_pixels)
+    return gif_read_over_limit(gfc, "screen area", area,
+			       lim->max_frame_pixels);
+  return 1;
+}
+
+/* Check a new image against the limits before any of its data is read.
+   Returns 0 if it is too large. */
+static int
+check_image_limits(Gif_Context *gfc, const Gif_Image *gfi, int read_flags)
+{
+  const Gif_ReadLimits *lim = gfc->limits;
+  Gif_Stream *gfs = gfc->stream;
+  unsigned long area = (unsigned long) gfi->width * gfi->height;
+  /* every frame is eventually drawn on a screen large enough to hold it;
+     that screen can be up to 131070 pixels on a side */
+  unsigned sw = gfi->left + gfi->width, sh = gfi->top + gfi->height;
+  double screen_area;
+  if (sw < gfs->screen_width)
+    sw = gfs->screen_width;
+  if (sh < gfs->screen_height)
+    sh = gfs->screen_height;
+  screen_area = (double) sw * sh;
+
+  if (lim->max_frames && (unsigned long) gfs->nimages >= lim->max_frames)
+    return gif_read_over_limit(gfc, "frame count", gfs->nimages + 1,
+			       lim->max_frames);
+  if (lim->max_frame_pixels && screen_area > lim->max_frame_pixels)
+    return gif_read_over_limit(gfc, area > lim->max_frame_pixels
+			       ? "frame area" : "screen area",
+			       area > lim->max_frame_pixels ? area : screen_area,
+			       lim->max_frame_pixels);
+  if (lim->max_total_pixels && area > lim->max_total_pixels - gfc->total_pixels)
+    return gif_read_over_limit(gfc, "total frame area",
+			       (double) gfc->total_pixels + area,
+			       lim->max_total_pixels);
+  gfc->total_pixels += area;
+  /* frames kept compressed are decoded later, so their pixels count too */
+  if (read_flags & (GIF_READ_COMPRESSED | GIF_READ_UNCOMPRESSED))
+    return check_bytes_limit(gfc, area);
+  return 1;
+}
+
 static uint8_t
 one_code(Gif_Context *gfc, Gif_Code code)
 {
@@ -171,16 +295,18 @@ one_code(Gif_Context *gfc, Gif_Code code)
   uint16_t codelength = gfc->length[code];
 
   gfc->decodepos += codelength;
-  ptr = gfc->image + gfc->decodepos;
-  if (ptr > gfc->maximage || !codelength) {
+  if (gfc->decodepos > gfc->decodemax || !codelength) {
     gif_read_error(gfc, 1, (!codelength ? "bad code" : "too much image data"));
     /* 5/26/98 It's not good enough simply to count an error, because in the
        read_image_data function, if code == next_code, we will store a byte in
        gfc->image[gfc->decodepos-1]. Thus, fix decodepos so it's w/in the
        image. */
-    gfc->decodepos = gfc->maximage - gfc->image;
+    gfc->decodepos = gfc->decodemax;
     return 0;
   }
+  if (!gfc->image)		/* verifying: just count pixels */
+    return 0;
+  ptr = gfc->image + gfc->decodepos;
 
   /* codelength will always be greater than 0. */
   do {
@@ -346,7 +472,7 @@ read_image_data(Gif_Context *gfc, Gif_Reader *grr)
 
     /* Special processing if code == next_code: we didn't know code's final
        suffix when we called one_code, but we do now. */
-    if (code == next_code)
+    if (code == next_code && gfc->image)
       gfc->image[gfc->decodepos - 1] = gfc->suffix[next_code];
 
     /* Increment next_code except for the 'clear_code' special case (that's
@@ -375,15 +501,93 @@ read_image_data(Gif_Context *gfc, Gif_Reader *grr)
   /* zero-length block reached. */
  zero_length_block:
 
-  if (gfc->image + gfc->decodepos < gfc->maximage)
+  if (gfc->decodepos < gfc->decodemax)
     gif_read_error(gfc, 1, "not enough image data for image size");
-  else if (gfc->image + gfc->decodepos > gfc->maximage)
+  else if (gfc->decodepos > gfc->decodemax)
     gif_read_error(gfc, 1, "too much image data for image size");
 }
 
 
+static int
+color_table_eq(const Gif_Colormap *a, const Gif_Colormap *b)
+{
+  int i;
+  if (a->ncol != b->ncol)
+    return 0;
+  for (i = 0; i < a->ncol; i++)
+    if (!GIF_COLOREQ(&a->col[i], &b->col[i]))
+      return 0;
+  return 1;
+}
+
+static int
+grow_color_tables(Gif_Context *gfc)
+{
+  int ncap = gfc->cmapscap ? gfc->cmapscap * 2 : 16;
+  Gif_Colormap **ncmaps = Gif_NewArray(Gif_Colormap *, ncap);
+  uint32_t *nhashes = Gif_NewArray(uint32_t, ncap);
+  int i, j;
+  if (!ncmaps || !nhashes) {
+    Gif_DeleteArray(ncmaps);
+    Gif_DeleteArray(nhashes);
+    return 0;
+  }
+  for (j = 0; j < ncap; j++)
+    ncmaps[j] = 0;
+  for (i = 0; i < gfc->cmapscap; i++)
+    if (gfc->cmaps[i]) {
+      for (j = gfc->cmap_hashes[i] & (ncap - 1); ncmaps[j];
+	   j = (j + 1) & (ncap - 1))
+	/* nada */;
+      ncmaps[j] = gfc->cmaps[i];
+      nhashes[j] = gfc->cmap_hashes[i];
+    }
+  Gif_DeleteArray(gfc->cmaps);
+  Gif_DeleteArray(gfc->cmap_hashes);
+  gfc->cmaps = ncmaps;
+  gfc->cmap_hashes = nhashes;
+  gfc->cmapscap = ncap;
+  return 1;
+}
+
 static Gif_Colormap *
-read_color_table(int size, Gif_Reader *grr)
+share_color_table(Gif_Context *gfc, Gif_Colormap *gfcm)
+     /* returns a previously read colormap equal to gfcm, deleting gfcm; or
+	remembers and returns gfcm */
+{
+  uint32_t hash = Gif_ColormapHash(gfcm);
+  int i;
+
+  if (gfc->ncmaps * 2 >= gfc->cmapscap && !grow_color_tables(gfc))
+    return gfcm;
+
+  for (i = hash & (gfc->cmapscap - 1); gfc->cmaps[i];
+       i = (i + 1) & (gfc->cmapscap - 1))
+    if (gfc->cmap_hashes[i] == hash && color_table_eq(gfc->cmaps[i], gfcm)) {
+      Gif_DeleteColormap(gfcm);
+      return gfc->cmaps[i];
+    }
+
+  gfc->cmaps[i] = gfcm;
+  gfc->cmap_hashes[i] = hash;
+  gfc->ncmaps++;
+  gfcm->refcount++;
+  return gfcm;
+}
+
+static void
+release_color_tables(Gif_Context *gfc)
+{
+  int i;
+  for (i = 0; i < gfc->cmapscap; i++)
+    Gif_DeleteColormap(gfc->cmaps[i]);
+  Gif_DeleteArray(gfc->cmaps);
+  Gif_DeleteArray(gfc->cmap_hashes);
+}
+
+static Gif_Colormap *
+read_color_table(int size, Gif_Context *gfc, Gif_Reader *grr)
+     /* returned colormap's refcount is not yet incremented for the caller */
 {
   Gif_Colormap *gfcm = Gif_NewFullColormap(size, size);
   Gif_Color *c;
@@ -397,12 +601,15 @@ read_color_table(int size, Gif_Reader *grr)
     c->haspixel = 0;
   }
 
+  if (gfc->read_flags & GIF_READ_SHARE_COLORMAPS)
+    gfcm = share_color_table(gfc, gfcm);
   return gfcm;
 }
 
 
 static int
-read_logical_screen_descriptor(Gif_Stream *gfs, Gif_Reader *grr)
+read_logical_screen_descriptor(Gif_Stream *gfs, Gif_Context *gfc,
+			       Gif_Reader *grr)
      /* returns 0 on memory error */
 {
   uint8_t packed;
@@ -410,6 +617,8 @@ read_logical_screen_descriptor(Gif_Stream *gfs, Gif_Reader *grr)
   /* we don't care about logical screen width or height */
   gfs->screen_width = gifgetunsigned(grr);
   gfs->screen_height = gifgetunsigned(grr);
+  if (gfc->limits && !check_screen_limits(gfc))
+    return 0;
 
   packed = gifgetbyte(grr);
   gfs->background = gifgetbyte(grr);
@@ -419,9 +628,9 @@ read_logical_screen_descriptor(Gif_Stream *gfs, Gif_Reader *grr)
 
   if (packed & 0x80) { /* have a global color table */
     int ncol = 1 << ((packed & 0x07) + 1);
-    gfs->global = read_color_table(ncol, grr);
+    gfs->global = read_color_table(ncol, gfc, grr);
     if (!gfs->global) return 0;
-    gfs->global->refcount = 1;
+    gfs->global->refcount++;
   }
 
   return 1;
@@ -497,36 +706,101 @@ read_compressed_image(Gif_Image *gfi, Gif_Reader *grr, int read_flags)
 }
 
 
+/* Move the rows of freshly decoded interlaced data into display order. */
 static int
-uncompress_image(Gif_Context *gfc, Gif_Image *gfi, Gif_Reader *grr)
+deinterlace_rows(uint8_t *data, int width, int height)
 {
-  if (!Gif_CreateUncompressedImage(gfi)) return 0;
+  /* Move stored row i to display row Gif_InterlaceLine(i, height), in
+     place, following each cycle of the permutation with one carry row. */
+  uint8_t *carry = Gif_NewArray(uint8_t, width + height);
+  uint8_t *done, *row, t;
+  int i, j, x;
+  if (!carry)
+    return 0;
+  done = carry + width;
+  memset(done, 0, height);
+
+  for (i = 0; i < height; i++)
+    if (!done[i]) {
+      memcpy(carry, data + width * i, width);
+      j = i;
+      do {
+	j = Gif_InterlaceLine(j, height);
+	row = data + width * j;
+	for (x = 0; x < width; x++)
+	  t = row[x], row[x] = carry[x], carry[x] = t;
+	done[j] = 1;
+      } while (j != i);
+    }
+
+  Gif_DeleteArray(carry);
+  return 1;
+}
+
+/* Spread the dense rows of gfi's pixels out to 'stride' bytes apart, in
+   place. Rows move down, so go from the bottom up. */
+static void
+spread_rows(Gif_Image *gfi, uint32_t stride)
+{
+  uint8_t *data = gfi->image_data;
+  int y;
+  for (y = gfi->height - 1; y > 0; y--) {
+    memmove(data + y * stride, data + y * gfi->width, gfi->width);
+    gfi->img[y] = data + y * stride;
+  }
+  gfi->stride = stride;
+}
+
+/* Decode into 'data', or into a new array if 'data' is null. */
+static int
+uncompress_image(Gif_Context *gfc, Gif_Image *gfi, uint8_t *data,
+		 uint32_t stride, Gif_Reader *grr)
+{
+  int own = !data;
+  if (own && !(data = Gif_NewArray(uint8_t, gfi->width * gfi->height)))
+    return 0;
   gfc->width = gfi->width;
   gfc->height = gfi->height;
-  gfc->image = gfi->image_data;
-  gfc->maximage = gfi->image_data + gfi->width * gfi->height;
+  gfc->image = data;
+  gfc->decodemax = (unsigned) gfi->width * gfi->height;
   read_image_data(gfc, grr);
+  /* decoded rows arrive in file order; keep pixels contiguous by putting
+     them in display order here */
+  if ((gfi->interlace && !deinterlace_rows(data, gfi->width, gfi->height))
+      || !Gif_SetUncompressedImage(gfi, data, own ? Gif_DeleteArrayFunc : 0,
+				   0)) {
+    if (own)
+      Gif_DeleteArray(data);
+    return 0;
+  }
+  if (stride > gfi->width)
+    spread_rows(gfi, stride);
   return 1;
 }
 
 
-int
-Gif_FullUncompressImage(Gif_Image *gfi, Gif_ReadErrorHandler h, void *hthunk)
+/* Run the decoder over an image without storing its pixels, to report any
+   errors in its data. */
+static void
+verify_image(Gif_Context *gfc, Gif_Image *gfi, Gif_Reader *grr)
+{
+  gfc->width = gfi->width;
+  gfc->height = gfi->height;
+  gfc->image = 0;
+  gfc->decodemax = (unsigned) gfi->width * gfi->height;
+  read_image_data(gfc, grr);
+}
+
+
+static int
+full_uncompress_image(Gif_Image *gfi, uint8_t *data, uint32_t stride,
+		      Gif_ReadErrorHandler h, void *hthunk)
 {
   Gif_Context gfc;
   Gif_Stream fake_gfs;
   Gif_Reader grr;
   int ok = 0;
 
-  /* return right away if image is already uncompressed. this might screw over
-     people who expect re-uncompressing to restore the compressed version. */
-  if (gfi->img)
-    return 2;
-  if (gfi->image_data)
-    /* we have uncompressed data, but not an 'img' array;
-       this shouldn't happen */
-    return 0;
-
   fake_gfs.errors = 0;
   gfc.stream = &fake_gfs;
   gfc.prefix = Gif_NewArray(Gif_Code, GIF_MAX_CODE);
@@ -534,10 +808,15 @@ Gif_FullUncompressImage(Gif_Image *gfi, Gif_ReadErrorHandler h, void *hthunk)
   gfc.length = Gif_NewArray(uint16_t, GIF_MAX_CODE);
   gfc.handler = h;
   gfc.handler_thunk = hthunk;
+  gfc.read_flags = 0;
+  gfc.cmaps = 0;
+  gfc.cmap_hashes = 0;
+  gfc.ncmaps = gfc.cmapscap = 0;
+  gfc.limits = 0;
 
   if (gfi && gfc.prefix && gfc.suffix && gfc.length && gfi->compressed) {
     make_data_reader(&grr, gfi->compressed, gfi->compressed_len);
-    ok = uncompress_image(&gfc, gfi, &grr);
+    ok = uncompress_image(&gfc, gfi, data, stride, &grr);
   }
 
   Gif_DeleteArray(gfc.prefix);
@@ -546,6 +825,59 @@ Gif_FullUncompressImage(Gif_Image *gfi, Gif_ReadErrorHandler h, void *hthunk)
   return ok && !fake_gfs.errors;
 }
 
+int
+Gif_FullUncompressImage(Gif_Image *gfi, Gif_ReadErrorHandler h, void *hthunk)
+{
+  /* return right away if image is already uncompressed. this might screw over
+     people who expect re-uncompressing to restore the compressed version. */
+  if (gfi->img)
+    return 2;
+  if (gfi->image_data)
+    /* we have uncompressed data, but not an 'img' array;
+       this shouldn't happen */
+    return 0;
+  return full_uncompress_image(gfi, 0, 0, h, hthunk);
+}
+
+/* Put gfi's pixels in the caller's buffer, row y at data + y * stride, and
+   point gfi at them; the caller keeps ownership of the buffer, which must
+   hold stride * (height - 1) + width bytes. A zero stride means the image
+   width. Bytes between rows may be overwritten. Pixels come from gfi's
+   uncompressed image if it has one, and are decoded from its compressed
+   data otherwise. */
+int
+Gif_UncompressImageInto(Gif_Image *gfi, uint8_t *data, uint32_t stride,
+			Gif_ReadErrorHandler h, void *hthunk)
+{
+  if (!stride)
+    stride = gfi->width;
+  if (!data || stride < gfi->width)
+    return 0;
+
+  /* copy existing pixels, applying any pending index map, since
+     Gif_SetUncompressedImage drops the map */
+  if (gfi->img) {
+    int x, y;
+    for (y = 0; y < gfi->height; y++)
+      if (gfi->index_map) {
+	const uint8_t *src = gfi->img[y];
+	uint8_t *dst = data + y * gfi->width;
+	for (x = 0; x < gfi->width; x++)
+	  dst[x] = gfi->index_map[src[x]];
+      } else
+	memcpy(data + y * gfi->width, gfi->img[y], gfi->width);
+    if (!Gif_SetUncompressedImage(gfi, data, 0, 0))
+      return 0;
+    if (stride > gfi->width)
+      spread_rows(gfi, stride);
+    return 1;
+  }
+
+  if (gfi->image_data)
+    return 0;
+  return full_uncompress_image(gfi, data, stride, h, hthunk);
+}
+
 
 static int
 read_image(Gif_Reader *grr, Gif_Context *gfc, Gif_Image *gfi, int read_flags)
@@ -559,31 +891,41 @@ read_image(Gif_Reader *grr, Gif_Context *gfc, Gif_Image *gfi, int read_flags)
   gfi->height = gifgetunsigned(grr);
   packed = gifgetbyte(grr);
   GIF_DEBUG(("<%ux%u>", gfi->width, gfi->height));
+  if (gfc->limits && !check_image_limits(gfc, gfi, read_flags))
+    return 0;
 
   if (packed & 0x80) { /* have a local color table */
     int ncol = 1 << ((packed & 0x07) + 1);
-    gfi->local = read_color_table(ncol, grr);
+    gfi->local = read_color_table(ncol, gfc, grr);
     if (!gfi->local) return 0;
-    gfi->local->refcount = 1;
+    gfi->local->refcount++;
   }
 
   gfi->interlace = (packed & 0x40) != 0;
 
   /* Keep the compressed data if asked */
   if (read_flags & GIF_READ_COMPRESSED) {
-    if (!read_compressed_image(gfi, grr, read_flags))
+    if (!read_compressed_image(gfi, grr, read_flags)
+	|| (gfc->limits && !check_bytes_limit(gfc, gfi->compressed_len)))
       return 0;
     if (read_flags & GIF_READ_UNCOMPRESSED) {
       Gif_Reader new_grr;
       make_data_reader(&new_grr, gfi->compressed, gfi->compressed_len);
-      if (!uncompress_image(gfc, gfi, &new_grr))
+      if (!uncompress_image(gfc, gfi, 0, 0, &new_grr))
 	return 0;
+    } else if (read_flags & GIF_READ_VERIFY) {
+      Gif_Reader new_grr;
+      make_data_reader(&new_grr, gfi->compressed, gfi->compressed_len);
+      verify_image(gfc, gfi, &new_grr);
     }
 
   } else if (read_flags & GIF_READ_UNCOMPRESSED) {
-    if (!uncompress_image(gfc, gfi, grr))
+    if (!uncompress_image(gfc, gfi, 0, 0, grr))
       return 0;
 
+  } else if (read_flags & GIF_READ_VERIFY) {
+    verify_image(gfc, gfi, grr);
+
   } else {
     /* skip over the image */
     uint8_t buffer[GIF_MAX_BLOCK];
@@ -634,64 +976,132 @@ read_graphic_control_extension(Gif_Context *gfc, Gif_Image *gfi,
 static char *last_name;
 
 
-static char *
-suck_data(char *data, int *store_len, Gif_Reader *grr)
+/* Scan the data sub-blocks at the reader's position without moving it.
+   Returns the number of bytes the sub-blocks occupy, including the
+   terminating zero-length block, and stores the total payload length in
+   *payload_store. Returns 0 if the record ends before the terminator. */
+static uint32_t
+scan_subblocks(const Gif_Reader *grr, uint32_t *payload_store)
 {
-  uint8_t len = gifgetbyte(grr);
-  int total_len = 0;
+  uint32_t pos = 0, payload = 0;
+  while (pos < grr->w) {
+    uint8_t amt = grr->v[pos];
+    pos += amt + 1;
+    if (amt == 0) {
+      *payload_store = payload;
+      return pos;
+    }
+    payload += amt;
+  }
+  *payload_store = payload;
+  return 0;
+}
 
+static void
+skip_subblocks(uint8_t len, Gif_Reader *grr)
+{
+  uint8_t buffer[GIF_MAX_BLOCK];
   while (len > 0) {
-    Gif_ReArray(data, char, total_len + len + 1);
-    if (!data) return 0;
-    gifgetblock((uint8_t *)data, len, grr);
+    gifgetblock(buffer, len, grr);
+    len = gifgetbyte(grr);
+  }
+}
 
-    total_len += len;
-    data[total_len] = 0;
+/* Read data sub-blocks into one buffer, reallocating 'data', and add a
+   terminating null byte. A record reader sizes the buffer once from the
+   sub-block lengths; a file reader grows it geometrically. Returns the
+   buffer, or 0 on allocation failure. If there is no data, returns 'data'
+   unchanged and stores 0. */
+static uint8_t *
+read_subblocks(uint8_t *data, uint32_t *store_len, Gif_Reader *grr)
+{
+  uint32_t len = 0, cap = 0, payload = 0;
+  uint8_t block_len;
 
-    len = gifgetbyte(grr);
+  if (grr->is_record)
+    scan_subblocks(grr, &payload);
+  block_len = gifgetbyte(grr);
+  if (payload > 0) {
+    Gif_ReArray(data, uint8_t, payload + 1);
+    if (!data) goto fail;
+    cap = payload + 1;
   }
 
-  if (store_len) *store_len = total_len;
+  while (block_len > 0) {
+    if (len + block_len + 1 > cap) {
+      cap = (cap ? cap * 2 : 256);
+      if (cap < len + block_len + 1)
+	cap = len + block_len + 1;
+      Gif_ReArray(data, uint8_t, cap);
+      if (!data) goto fail;
+    }
+    gifgetblock(data + len, block_len, grr);
+    len += block_len;
+    block_len = gifgetbyte(grr);
+  }
+
+  if (len > 0)
+    data[len] = 0;
+  *store_len = len;
   return data;
+
+ fail:
+  skip_subblocks(block_len, grr);
+  *store_len = 0;
+  return 0;
 }
 
 
+static char *
+suck_data(char *data, int *store_len, Gif_Reader *grr)
+{
+  uint32_t len;
+  data = (char *) read_subblocks((uint8_t *) data, &len, grr);
+  if (store_len) *store_len = len;
+  return data;
+}
+
+
+/* With GIF_READ_CONST_RECORD, an extension's payload stays in the record:
+   gfex->data points at its sub-blocks, length bytes and all, and
+   gfex->packetized is set. Writers copy the sub-blocks as they are;
+   Gif_UnpacketizeExtension makes a plain copy when one is needed. */
 static int
-read_unknown_extension(Gif_Stream *gfs, int kind, char *app_name, int position,
-		       Gif_Reader *grr)
+read_unknown_extension(Gif_Context *gfc, int kind, char *app_name,
+		       int position, Gif_Reader *grr)
 {
-  uint8_t block_len = gifgetbyte(grr);
+  Gif_Extension *gfex;
   uint8_t *data = 0;
-  uint8_t data_len = 0;
-  Gif_Extension *gfex = 0;
-
-  while (block_len > 0) {
-    if (data) Gif_ReArray(data, uint8_t, data_len + block_len + 1);
-    else data = Gif_NewArray(uint8_t, block_len + 1);
-    if (!data) goto done;
-    gifgetblock(data + data_len, block_len, grr);
-    data_len += block_len;
-    block_len = gifgetbyte(grr);
-  }
+  uint32_t data_len = 0, packet_len = 0;
 
-  if (data)
+  if (grr->is_record && (gfc->read_flags & GIF_READ_CONST_RECORD))
+    packet_len = scan_subblocks(grr, &data_len);
+  if (packet_len > 1) {
     gfex = Gif_NewExtension(kind, app_name);
-  if (gfex) {
-    gfex->data = data;
-    gfex->free_data = Gif_DeleteArrayFunc;
-    gfex->length = data_len;
-    data[data_len] = 0;
-    Gif_AddExtension(gfs, gfex, position);
+    if (gfex) {
+      gfex->data = (uint8_t *) grr->v;
+      gfex->length = packet_len - 1;
+      gfex->packetized = 1;
+      Gif_AddExtension(gfc->stream, gfex, position);
+    }
+    grr->v += packet_len;
+    grr->w -= packet_len;
+    return gfex != 0;
   }
 
- done:
-  if (!gfex) Gif_DeleteArray(data);
-  while (block_len > 0) {
-    uint8_t buffer[GIF_MAX_BLOCK];
-    gifgetblock(buffer, block_len, grr);
-    block_len = gifgetbyte(grr);
+  data = read_subblocks(0, &data_len, grr);
+  if (!data)
+    return 0;
+  gfex = Gif_NewExtension(kind, app_name);
+  if (!gfex) {
+    Gif_DeleteArray(data);
+    return 0;
   }
-  return gfex != 0;
+  gfex->data = data;
+  gfex->free_data = Gif_DeleteArrayFunc;
+  gfex->length = data_len;
+  Gif_AddExtension(gfc->stream, gfex, position);
+  return 1;
 }
 
 
@@ -724,7 +1134,7 @@ read_application_extension(Gif_Context *gfc, int position, Gif_Reader *grr)
 
   } else {
     buffer[len] = 0;
-    return read_unknown_extension(gfs, 0xFF, (char *)buffer, position, grr);
+    return read_unknown_extension(gfc, 0xFF, (char *)buffer, position, grr);
   }
 }
 
@@ -746,7 +1156,7 @@ read_comment_extension(Gif_Image *gfi, Gif_Reader *grr)
 
 
 static Gif_Stream *
-read_gif(Gif_Reader *grr, int read_flags,
+read_gif(Gif_Reader *grr, int read_flags, const Gif_ReadLimits *limits,
 	 Gif_ReadErrorHandler handler, void *handler_thunk)
 {
   Gif_Stream *gfs;
@@ -773,18 +1183,30 @@ read_gif(Gif_Reader *grr, int read_flags,
   gfc.length = Gif_NewArray(uint16_t, GIF_MAX_CODE);
   gfc.handler = handler;
   gfc.handler_thunk = handler_thunk;
+  gfc.read_flags = read_flags;
+  gfc.cmaps = 0;
+  gfc.cmap_hashes = 0;
+  gfc.ncmaps = gfc.cmapscap = 0;
+  gfc.limits = limits;
+  gfc.over_limit = 0;
+  gfc.total_pixels = gfc.bytes = 0;
+  gfc.start_msec = limits && limits->max_msec ? gif_read_msec() : 0;
 
   if (!gfs || !gfi || !gfc.prefix || !gfc.suffix || !gfc.length)
     goto done;
 
   GIF_DEBUG(("\nGIF"));
-  if (!read_logical_screen_descriptor(gfs, grr))
+  if (!read_logical_screen_descriptor(gfs, &gfc, grr))
     goto done;
   GIF_DEBUG(("logscrdesc"));
 
   while (!gifeof(grr)) {
 
-    uint8_t block = gifgetbyte(grr);
+    uint8_t block;
+    if (limits && !check_time_limit(&gfc))
+      goto done;
+
+    block = gifgetbyte(grr);
 
     switch (block) {
 
@@ -796,6 +1218,7 @@ read_gif(Gif_Reader *grr, int read_flags,
       if (!read_image(grr, &gfc, gfi, read_flags)
 	  || !Gif_AddImage(gfs, gfi)) {
 	Gif_DeleteImage(gfi);
+	gfi = 0;
 	goto done;
       }
 
@@ -832,7 +1255,7 @@ read_gif(Gif_Reader *grr, int read_flags,
 	break;
 
        default:
-	read_unknown_extension(gfs, block, 0, extension_position, grr);
+	read_unknown_extension(&gfc, block, 0, extension_position, grr);
 	break;
 
       }
@@ -864,6 +1287,13 @@ read_gif(Gif_Reader *grr, int read_flags,
   Gif_DeleteArray(gfc.prefix);
   Gif_DeleteArray(gfc.suffix);
   Gif_DeleteArray(gfc.length);
+  release_color_tables(&gfc);
+
+  /* inputs over a limit are rejected outright */
+  if (gfc.over_limit) {
+    Gif_DeleteStream(gfs);
+    return 0;
+  }
 
   if (gfs && gfs->errors == 0 && !(read_flags & GIF_READ_TRAILING_GARBAGE_OK) && !grr->eofer(grr)) {
     gif_read_error(&gfc, 0, "trailing garbage after GIF ignored");
@@ -876,8 +1306,8 @@ read_gif(Gif_Reader *grr, int read_flags,
 
 
 Gif_Stream *
-Gif_FullReadFile(FILE *f, int read_flags,
-		 Gif_ReadErrorHandler h, void *hthunk)
+Gif_LimitedReadFile(FILE *f, int read_flags, const Gif_ReadLimits *limits,
+		    Gif_ReadErrorHandler h, void *hthunk)
 {
   Gif_Reader grr;
   if (!f) return 0;
@@ -887,19 +1317,34 @@ Gif_FullReadFile(FILE *f, int read_flags,
   grr.block_getter = file_block_getter;
   grr.offseter = file_offseter;
   grr.eofer = file_eofer;
-  return read_gif(&grr, read_flags, h, hthunk);
+  return read_gif(&grr, read_flags, limits, h, hthunk);
 }
 
 Gif_Stream *
-Gif_FullReadRecord(const Gif_Record *gifrec, int read_flags,
-		   Gif_ReadErrorHandler h, void *hthunk)
+Gif_LimitedReadRecord(const Gif_Record *gifrec, int read_flags,
+		      const Gif_ReadLimits *limits,
+		      Gif_ReadErrorHandler h, void *hthunk)
 {
   Gif_Reader grr;
   if (!gifrec) return 0;
   make_data_reader(&grr, gifrec->data, gifrec->length);
   if (read_flags & GIF_READ_CONST_RECORD)
     read_flags |= GIF_READ_COMPRESSED;
-  return read_gif(&grr, read_flags, h, hthunk);
+  return read_gif(&grr, read_flags, limits, h, hthunk);
+}
+
+Gif_Stream *
+Gif_FullReadFile(FILE *f, int read_flags,
+		 Gif_ReadErrorHandler h, void *hthunk)
+{
+  return Gif_LimitedReadFile(f, read_flags, 0, h, hthunk);
+}
+
+Gif_Stream *
+Gif_FullReadRecord(const Gif_Record *gifrec, int read_flags,
+		   Gif_ReadErrorHandler h, void *hthunk)
+{
+  return Gif_LimitedReadRecord(gifrec, read_flags, 0, h, hthunk);
 }
 
 
@@ -16,6 +16,9 @@
 #include <ctype.h>
 #include <assert.h>
 #include <errno.h>
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
 
 /* Need _setmode under MS-DOS, to set stdin/stdout to binary mode */
 /* Need _fsetmode under OS/2 for the same reason */
@@ -38,6 +41,7 @@ const char *input_name = 0;
 static int unoptimizing = 0;
 
 static int gif_read_flags = 0;
+static Gif_ReadLimits gif_read_limits;
 static int nextfile = 0;
 Gif_CompressInfo gif_write_info;
 
@@ -109,10 +113,13 @@ static int any_output_successful = 0;
 #define CH_COLOR_TRANSFORM	9
 #define CH_RESIZE		10
 #define CH_MEMORY		11
+#define CH_FRAME_CACHE		12
+#define CH_PROGRESSIVE		13
 static const char *output_option_types[] = {
   "loopcount", "logical screen", "optimization", "output file",
   "colormap size", "dither", "colormap", "colormap method",
-  "background", "color transformation", "resize", "memory conservation"
+  "background", "color transformation", "resize", "memory conservation",
+  "frame cache", "progressive output"
 };
 
 
@@ -182,6 +189,19 @@ static const char *output_option_types[] = {
 #define RESIZE_FIT_WIDTH_OPT	365
 #define RESIZE_FIT_HEIGHT_OPT	366
 #define SIZE_INFO_OPT		367
+#define ANALYSIS_CACHE_OPT	368
+#define FRAME_CACHE_OPT		369
+#define THREADS_OPT		370
+#define MAX_FRAME_PIXELS_OPT	371
+#define MAX_FRAMES_OPT		372
+#define MAX_PIXELS_OPT		373
+#define MAX_BYTES_OPT		374
+#define MAX_READ_TIME_OPT	375
+#define TIME_BUDGET_OPT		376
+#define PROGRESSIVE_OPT		377
+#define CHECKPOINT_OPT		378
+#define CHECKPOINT_INTERVAL_OPT	379
+#define RESUME_OPT		380
 
 #define LOOP_TYPE		(Clp_ValFirstUser)
 #define DISPOSAL_TYPE		(Clp_ValFirstUser + 1)
@@ -194,9 +214,11 @@ static const char *output_option_types[] = {
 #define COLORMAP_ALG_TYPE	(Clp_ValFirstUser + 8)
 #define SCALE_FACTOR_TYPE	(Clp_ValFirstUser + 9)
 #define OPTIMIZE_TYPE		(Clp_ValFirstUser + 10)
+#define DITHER_TYPE		(Clp_ValFirstUser + 11)
 
 const Clp_Option options[] = {
 
+  { "analysis-cache", 0, ANALYSIS_CACHE_OPT, Clp_ValString, Clp_Negate },
   { "append", 0, APPEND_OPT, 0, 0 },
   { "app-extension", 'x', APP_EXTENSION_OPT, Clp_ValString, 0 },
 
@@ -206,6 +228,8 @@ const Clp_Option options[] = {
 
   { "careful", 0, CAREFUL_OPT, 0, Clp_Negate },
   { "change-color", 0, CHANGE_COLOR_OPT, TWO_COLORS_TYPE, Clp_Negate },
+  { "checkpoint", 0, CHECKPOINT_OPT, Clp_ValString, Clp_Negate },
+  { "checkpoint-interval", 0, CHECKPOINT_INTERVAL_OPT, Clp_ValUnsigned, 0 },
   { "cinfo", 0, COLOR_INFO_OPT, 0, Clp_Negate },
   { "clip", 0, CROP_OPT, RECTANGLE_TYPE, Clp_Negate },
   { "colors", 'k', COLORMAP_OPT, Clp_ValInt, Clp_Negate },
@@ -220,7 +244,7 @@ const Clp_Option options[] = {
   { "delay", 'd', 'd', Clp_ValInt, Clp_Negate },
   { "delete", 0, DELETE_OPT, 0, 0 },
   { "disposal", 'D', DISPOSAL_OPT, DISPOSAL_TYPE, Clp_Negate },
-  { "dither", 'f', DITHER_OPT, 0, Clp_Negate },
+  { "dither", 'f', DITHER_OPT, DITHER_TYPE, Clp_Negate | Clp_Optional },
   { "done", 0, ALTER_DONE_OPT, 0, 0 },
 
   { "explode", 'e', 'e', 0, 0 },
@@ -232,6 +256,7 @@ const Clp_Option options[] = {
   { "flip-horizontal", 0, FLIP_HORIZ_OPT, 0, Clp_Negate },
   { "flip-vertical", 0, FLIP_VERT_OPT, 0, Clp_Negate },
   { "no-flip", 0, NO_FLIP_OPT, 0, 0 },
+  { "frame-cache", 0, FRAME_CACHE_OPT, 0, Clp_Negate },
 
   { "help", 'h', HELP_OPT, 0, 0 },
 
@@ -242,6 +267,11 @@ const Clp_Option options[] = {
   { "logical-screen", 'S', LOGICAL_SCREEN_OPT, DIMENSIONS_TYPE, Clp_Negate },
   { "loopcount", 'l', 'l', LOOP_TYPE, Clp_Optional | Clp_Negate },
 
+  { "max-bytes", 0, MAX_BYTES_OPT, Clp_ValUnsigned, Clp_Negate },
+  { "max-frame-pixels", 0, MAX_FRAME_PIXELS_OPT, Clp_ValUnsigned, Clp_Negate },
+  { "max-frames", 0, MAX_FRAMES_OPT, Clp_ValUnsigned, Clp_Negate },
+  { "max-pixels", 0, MAX_PIXELS_OPT, Clp_ValUnsigned, Clp_Negate },
+  { "max-read-time", 0, MAX_READ_TIME_OPT, Clp_ValUnsigned, Clp_Negate },
   { "merge", 'm', 'm', 0, 0 },
   { "method", 0, COLORMAP_ALGORITHM_OPT, COLORMAP_ALG_TYPE, 0 },
   { "multifile", 0, MULTIFILE_OPT, 0, Clp_Negate },
@@ -254,6 +284,7 @@ const Clp_Option options[] = {
   { "output", 'o', OUTPUT_OPT, Clp_ValStringNotOption, 0 },
 
   { "position", 'p', POSITION_OPT, POSITION_TYPE, Clp_Negate },
+  { "progressive", 0, PROGRESSIVE_OPT, 0, Clp_Negate },
 
   { "replace", 0, REPLACE_OPT, FRAME_SPEC_TYPE, 0 },
   { "resize", 0, RESIZE_OPT, DIMENSIONS_TYPE, Clp_Negate },
@@ -267,6 +298,7 @@ const Clp_Option options[] = {
   { "resize-fit-height", 0, RESIZE_FIT_HEIGHT_OPT, Clp_ValUnsigned, Clp_Negate },
   { "resize-fi", 0, RESIZE_FIT_OPT, DIMENSIONS_TYPE, Clp_Negate },
   { "resize-f", 0, RESIZE_FIT_OPT, DIMENSIONS_TYPE, Clp_Negate },
+  { "resume", 0, RESUME_OPT, 0, Clp_Negate },
   { "rotate-90", 0, ROTATE_90_OPT, 0, 0 },
   { "rotate-180", 0, ROTATE_180_OPT, 0, 0 },
   { "rotate-270", 0, ROTATE_270_OPT, 0, 0 },
@@ -292,6 +324,8 @@ const Clp_Option options[] = {
   { "sinfo", 0, SIZE_INFO_OPT, 0, Clp_Negate },
   { "size-info", 0, SIZE_INFO_OPT, 0, Clp_Negate },
 
+  { "threads", 'j', THREADS_OPT, Clp_ValUnsigned, Clp_Optional | Clp_Negate },
+  { "time-budget", 0, TIME_BUDGET_OPT, Clp_ValUnsigned, Clp_Negate },
   { "transform-colormap", 0, COLOR_TRANSFORM_OPT, Clp_ValStringNotOption,
     Clp_Negate },
   { "transparent", 't', 't', COLOR_TYPE, Clp_Negate },
@@ -460,7 +494,6 @@ gifread_error(int is_error, const char *message, int which_image, void *thunk)
     different_error_count = 0;
   }
 
-  gifread_error_count++;
   if (last_message[0] && different_error_count <= 10
       && (last_which_image != which_image || message == 0
 	  || strcmp(message, last_message) != 0)) {
@@ -474,7 +507,9 @@ gifread_error(int is_error, const char *message, int which_image, void *thunk)
     last_message[0] = 0;
   }
 
+  /* count only real messages; a null message just flushes the last one */
   if (message) {
+    gifread_error_count++;
     if (last_message[0] == 0)
       different_error_count++;
     same_error_count++;
@@ -627,12 +662,19 @@ input_stream(const char *name)
 
   /* read file */
   gifread_error_count = 0;
-  gfs = Gif_FullReadFile(f, gif_read_flags | GIF_READ_COMPRESSED,
-			 gifread_error, (void *)name);
+  if (i == 0x89 && componentno == 1)
+    gfs = Gif_LimitedReadFrameCache(f, &gif_read_limits, gifread_error,
+				    (void *)name);
+  else
+    gfs = Gif_LimitedReadFile(f, gif_read_flags | GIF_READ_COMPRESSED
+			      | GIF_READ_SHARE_COLORMAPS, &gif_read_limits,
+			      gifread_error, (void *)name);
   gifread_error(-1, 0, -1, (void *)name); /* print out last error message */
 
   if (!gfs || (Gif_ImageCount(gfs) == 0 && gfs->errors > 0)) {
-    if (componentno == 1)
+    if (!gfs && gifread_error_count > 0)
+      /* rejected by a read limit; the reason was reported above */;
+    else if (componentno == 1)
       error(0, "%s: file not in GIF format", name);
     else
       error(0, "%s: trailing garbage ignored", main_name);
@@ -712,7 +754,8 @@ input_stream(const char *name)
       static int context = 0;
       warning(1, "GIF too complex to unoptimize", name);
       if (!context) {
-	warncontext(1, "(The reason was local color tables or complex transparency.");
+	warncontext(1, "(The reason was a frame needing more than 256 colors, or");
+	warncontext(1, "complex transparency.");
 	warncontext(1, "Try running the GIF through 'gifsicle --colors=255' first.)");
       }
       context = 1;
@@ -784,7 +827,9 @@ static void
 do_set_colormap(Gif_Stream *gfs, Gif_Colormap *gfcm)
 {
   colormap_image_func image_func;
-  if (active_output_data.colormap_dither)
+  if (active_output_data.colormap_dither == DITHER_INCREMENTAL)
+    image_func = colormap_image_floyd_steinberg_incremental;
+  else if (active_output_data.colormap_dither)
     image_func = colormap_image_floyd_steinberg;
   else
     image_func = colormap_image_posterize;
@@ -797,7 +842,7 @@ do_colormap_change(Gif_Stream *gfs)
   if (active_output_data.colormap_fixed)
     do_set_colormap(gfs, active_output_data.colormap_fixed);
 
-  if (active_output_data.colormap_size > 0) {
+  if (active_output_data.colormap_size > 0 && !processing_canceled) {
     int nhist;
     Gif_Color *hist;
     Gif_Colormap *(*adapt_func)(Gif_Color *, int, int);
@@ -848,8 +893,8 @@ do_colormap_change(Gif_Stream *gfs)
  * output GIF images
  **/
 
-static void
-write_stream(const char *output_name, Gif_Stream *gfs)
+static FILE *
+open_output(const char *output_name)
 {
   FILE *f;
 
@@ -860,7 +905,7 @@ write_stream(const char *output_name, Gif_Stream *gfs)
     extern int isatty(int);
     if (isatty(fileno(stdout))) {
       error(0, "<stdout>: is a terminal");
-      return;
+      return 0;
     }
 #endif
 #if defined(_MSDOS) || defined(_WIN32)
@@ -871,44 +916,71 @@ write_stream(const char *output_name, Gif_Stream *gfs)
     _fsetmode(stdout, "b");
 #endif
     f = stdout;
-    output_name = "<stdout>";
   }
 
+  if (!f)
+    error(0, "%s: %s", output_name, strerror(errno));
+  return f;
+}
+
+/* Write 'gfs' to 'f', or to a newly opened output if 'f' is null. */
+static void
+write_stream(const char *output_name, Gif_Stream *gfs, FILE *f)
+{
+  if (!f)
+    f = open_output(output_name);
+  if (!output_name)
+    output_name = "<stdout>";
+
   if (f) {
-    Gif_FullWriteFile(gfs, &gif_write_info, f);
+    if (active_output_data.frame_cache) {
+      if (!Gif_WriteFrameCache(gfs, f))
+	error(0, "%s: can't write frame cache", output_name);
+    } else if (!Gif_FullWriteFile(gfs, &gif_write_info, f)) {
+      if (processing_canceled)
+	error(0, "%s: output canceled, file is incomplete", output_name);
+    } else if (checkpoint_file && !processing_canceled)
+      /* the checkpoint isn't needed once the output is written */
+      remove(checkpoint_file);
     fclose(f);
     any_output_successful = 1;
-  } else
-    error(0, "%s: %s", output_name, strerror(errno));
+  }
 }
 
-static void
-merge_and_write_frames(const char *outfile, int f1, int f2)
+/* Merge frames f1 through f2 into a new output stream and transform it.
+   Returns 0 if there is nothing to write. If 'may_compress' is 0, merged
+   frames keep their pixels and are compressed when written. If
+   'progressive' is nonnull, the optimizer may write the stream there as it
+   goes, and then 0 is returned too. */
+static Gif_Stream *
+merge_output_frames(const char *outfile, int f1, int f2, int may_compress,
+		    FILE *progressive)
 {
   Gif_Stream *out;
   int compress_immediately;
   int colormap_change;
   int huge_stream;
   assert(!nested_mode);
-  if (verbosing)
-    verbose_open('[', outfile ? outfile : "#stdout#");
-  active_output_data.active_output_name = outfile;
 
   colormap_change = active_output_data.colormap_size > 0
     || active_output_data.colormap_fixed;
   warn_local_colormaps = !colormap_change;
 
-  compress_immediately = 1;
+  compress_immediately = may_compress;
   if (!active_output_data.conserve_memory
       && (active_output_data.scaling
 	  || (active_output_data.optimizing & GT_OPT_MASK)
 	  || colormap_change))
     compress_immediately = 0;
+  /* frame caches store uncompressed pixels */
+  if (active_output_data.frame_cache)
+    compress_immediately = 0;
 
   out = merge_frame_interval(frames, f1, f2, &active_output_data,
 			     compress_immediately, &huge_stream);
 
   if (out) {
+    processing_canceled = 0;
     if (active_output_data.scaling == GT_SCALING_RESIZE)
       resize_stream(out, active_output_data.resize_width,
 		    active_output_data.resize_height, 0);
@@ -918,20 +990,180 @@ merge_and_write_frames(const char *outfile, int f1, int f2)
     else if (active_output_data.scaling == GT_SCALING_RESIZE_FIT)
       resize_stream(out, active_output_data.resize_width,
 		    active_output_data.resize_height, 1);
-    if (colormap_change)
+    if (colormap_change && !processing_canceled)
       do_colormap_change(out);
-    if (output_transforms)
+    if (output_transforms && !processing_canceled)
       apply_color_transforms(output_transforms, out);
-    if (active_output_data.optimizing & GT_OPT_MASK)
-      optimize_fragments(out, active_output_data.optimizing, huge_stream);
-    write_stream(outfile, out);
+    if ((active_output_data.optimizing & GT_OPT_MASK) && !processing_canceled) {
+      if (time_budget && time_budget_left() <= 0)
+	warning(1, "time budget spent, output not optimized");
+      else if (optimize_fragments(out, active_output_data.optimizing,
+				  huge_stream, progressive)) {
+	Gif_DeleteStream(out);
+	return 0;
+      }
+    }
+    /* a canceled stream is half transformed; don't write it */
+    if (processing_canceled) {
+      error(0, progressive ? "%s: output canceled, file is incomplete"
+	    : "%s: output canceled", outfile ? outfile : "<stdout>");
+      Gif_DeleteStream(out);
+      out = 0;
+    }
+  }
+
+  return out;
+}
+
+static void
+merge_and_write_frames(const char *outfile, int f1, int f2)
+{
+  Gif_Stream *out;
+  FILE *progressive = 0;
+  if (verbosing)
+    verbose_open('[', outfile ? outfile : "#stdout#");
+  active_output_data.active_output_name = outfile;
+
+  /* --progressive: open the output now, so the optimizer can write frames
+     as it finishes them */
+  if (active_output_data.progressive
+      && (active_output_data.optimizing & GT_OPT_MASK)
+      && !active_output_data.frame_cache && !checkpoint_file
+      && !(progressive = open_output(outfile)))
+    goto done;
+
+  out = merge_output_frames(outfile, f1, f2, 1, progressive);
+  if (out) {
+    write_stream(outfile, out, progressive);
     Gif_DeleteStream(out);
+  } else if (progressive) {
+    fclose(progressive);
+    if (!processing_canceled)
+      any_output_successful = 1;
   }
 
+ done:
   if (verbosing) verbose_close(']');
   active_output_data.active_output_name = 0;
 }
 
+
+/* Exploding on several threads is a pipeline. A frame task decodes input
+   frames ahead of the merge; frames are merged and transformed one at a
+   time, in order, on this thread; and a frame queue compresses and writes
+   each finished output. Each stage runs at most 'window' frames ahead, so
+   only that many outputs are in memory at once. Workers touch only their
+   own output stream, and report back through a Gt_ExplodeOutput. */
+
+typedef struct {
+  char *filename;
+  Gif_Stream *stream;
+  int frame_cache;
+  int open_errno;
+} Gt_ExplodeOutput;
+
+static Gif_CompressInfo explode_write_info;
+
+static int
+explode_write_task(int i, void *thunk)
+{
+  Gt_ExplodeOutput *eo = (Gt_ExplodeOutput *) thunk + i;
+  FILE *f;
+  int ok;
+  if (!eo->stream)
+    return 1;
+  if (!(f = fopen(eo->filename, "wb"))) {
+    eo->open_errno = errno;
+    return 0;
+  }
+  if (eo->frame_cache)
+    ok = Gif_WriteFrameCache(eo->stream, f);
+  else
+    ok = Gif_FullWriteFile(eo->stream, &explode_write_info, f);
+  fclose(f);
+  return ok;
+}
+
+static void
+finish_explode_output(Gif_FrameTask *write_task, Gt_ExplodeOutput *eo, int i)
+{
+  eo += i;
+  if (!Gif_WaitFrameTask(write_task, i) && eo->stream) {
+    if (eo->open_errno)
+      error(0, "%s: %s", eo->filename, strerror(eo->open_errno));
+    else if (eo->frame_cache)
+      error(0, "%s: can't write frame cache", eo->filename);
+  }
+  if (eo->stream && !eo->open_errno)
+    any_output_successful = 1;
+  Gif_DeleteStream(eo->stream);
+  Gif_DeleteArray(eo->filename);
+}
+
+static void
+explode_frames_threaded(const char *outfile, int max_nimages)
+{
+  int i, n = frames->count;
+  int window = 2 * gif_write_info.threads;
+  Gt_ExplodeOutput *eo = Gif_NewArray(Gt_ExplodeOutput, n);
+  Gif_Image **decode = Gif_NewArray(Gif_Image *, n);
+  Gif_FrameTask *decode_task, *write_task;
+
+  for (i = 0; i < n; i++) {
+    Gif_Image *gfi = FRAME(frames, i).image;
+    /* as in merge_frame_interval, skip images used by several frames */
+    if (!gfi->img && gfi->compressed && gfi->refcount == 2)
+      decode[i] = gfi;
+    else
+      decode[i] = 0;
+    eo[i].filename = 0;
+    eo[i].stream = 0;
+    eo[i].frame_cache = active_output_data.frame_cache;
+    eo[i].open_errno = 0;
+  }
+
+  /* workers compress one stream each and report nothing themselves */
+  explode_write_info = gif_write_info;
+  explode_write_info.threads = 1;
+  explode_write_info.progress = 0;
+
+  decode_task = Gif_NewFrameTask(n, gif_write_info.threads, window,
+				 uncompress_frame_task, decode);
+  write_task = Gif_NewFrameQueue(n, gif_write_info.threads, 0,
+				 explode_write_task, eo);
+
+  for (i = 0; i < n; i++) {
+    Gt_Frame *fr = &FRAME(frames, i);
+    int imagenumber = Gif_ImageNumber(fr->stream, fr->image);
+    const char *imagename = 0;
+    if (fr->explode_by_name)
+      imagename = fr->name ? fr->name : fr->image->identifier;
+    eo[i].filename = Gif_CopyString(explode_filename(outfile, imagenumber,
+						     imagename, max_nimages));
+
+    if (i >= window)
+      finish_explode_output(write_task, eo, i - window);
+    Gif_WaitFrameTask(decode_task, i);
+
+    if (verbosing)
+      verbose_open('[', eo[i].filename);
+    active_output_data.active_output_name = eo[i].filename;
+    eo[i].stream = merge_output_frames(eo[i].filename, i, i, 0, 0);
+    if (verbosing)
+      verbose_close(']');
+    active_output_data.active_output_name = 0;
+
+    Gif_SubmitFrameTask(write_task, i);
+  }
+
+  for (i = (n > window ? n - window : 0); i < n; i++)
+    finish_explode_output(write_task, eo, i);
+  Gif_DeleteFrameTask(write_task);
+  Gif_DeleteFrameTask(decode_task);
+  Gif_DeleteArray(decode);
+  Gif_DeleteArray(eo);
+}
+
 static void
 output_information(const char *outfile)
 {
@@ -1010,6 +1242,12 @@ output_frames(void)
        if (!outfile) /* Watch out! */
 	 outfile = "-";
 
+       if (gif_write_info.threads > 1 && frames->count > 1
+	   && !active_output_data.conserve_memory) {
+	 explode_frames_threaded(outfile, max_nimages);
+	 break;
+       }
+
        for (i = 0; i < frames->count; i++) {
 	 Gt_Frame *fr = &FRAME(frames, i);
 	 int imagenumber = Gif_ImageNumber(fr->stream, fr->image);
@@ -1151,6 +1389,8 @@ initialize_def_frame(void)
   def_output_data.scaling = GT_SCALING_NONE;
 
   def_output_data.conserve_memory = 0;
+  def_output_data.frame_cache = 0;
+  def_output_data.progressive = 0;
 
   active_output_data = def_output_data;
 }
@@ -1198,6 +1438,8 @@ combine_output_options(void)
   }
 
   COMBINE_ONE_OUTPUT_OPTION(CH_MEMORY, conserve_memory);
+  COMBINE_ONE_OUTPUT_OPTION(CH_FRAME_CACHE, frame_cache);
+  COMBINE_ONE_OUTPUT_OPTION(CH_PROGRESSIVE, progressive);
 
   def_output_data.colormap_fixed = 0;
   def_output_data.output_name = 0;
@@ -1247,6 +1489,17 @@ copy_crop(Gt_Crop *oc)
   return nc;
 }
 
+static int
+processor_count(void)
+{
+#if defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n > 0)
+    return n < 64 ? n : 64;
+#endif
+  return 2;
+}
+
 
 /*****
  * main
@@ -1283,12 +1536,20 @@ main(int argc, char *argv[])
      "blend-diversity", COLORMAP_BLEND_DIVERSITY,
      "median-cut", COLORMAP_MEDIAN_CUT,
      (const char*) 0);
+  Clp_AddStringListType
+    (clp, DITHER_TYPE, 0,
+     "floyd-steinberg", DITHER_FLOYD_STEINBERG,
+     "fs", DITHER_FLOYD_STEINBERG,
+     "incremental", DITHER_INCREMENTAL,
+     (const char*) 0);
   Clp_AddStringListType
     (clp, OPTIMIZE_TYPE, Clp_AllowNumbers,
      "keep-empty", GT_OPT_KEEPEMPTY + 1,
      "no-keep-empty", GT_OPT_KEEPEMPTY,
      "drop-empty", GT_OPT_KEEPEMPTY,
      "no-drop-empty", GT_OPT_KEEPEMPTY + 1,
+     "fold-loops", GT_OPT_FOLDLOOPS + 1,
+     "no-fold-loops", GT_OPT_FOLDLOOPS,
      (const char*) 0);
   Clp_AddType(clp, DIMENSIONS_TYPE, 0, parse_dimensions, 0);
   Clp_AddType(clp, POSITION_TYPE, 0, parse_position, 0);
@@ -1304,7 +1565,10 @@ main(int argc, char *argv[])
 
   frames = new_frameset(16);
   initialize_def_frame();
+  start_time_budget();
   Gif_InitCompressInfo(&gif_write_info);
+  gif_write_info.progress = gifsicle_progress;
+  Gif_InitReadLimits(&gif_read_limits);
 
 #ifdef DMALLOC
   dmalloc_verbose("fudge");
@@ -1717,7 +1981,11 @@ main(int argc, char *argv[])
 
      case DITHER_OPT:
       MARK_CH(output, CH_DITHER);
-      def_output_data.colormap_dither = !clp->negated;
+      if (clp->negated)
+	def_output_data.colormap_dither = DITHER_NONE;
+      else
+	def_output_data.colormap_dither =
+	  (clp->have_val ? clp->val.i : DITHER_FLOYD_STEINBERG);
       break;
 
     case RESIZE_OPT:
@@ -1781,11 +2049,71 @@ main(int argc, char *argv[])
       no_warnings = clp->negated;
       break;
 
+     case THREADS_OPT:
+      if (clp->negated)
+	gif_write_info.threads = 1;
+      else if (clp->have_val)
+	gif_write_info.threads = (clp->val.u < 1 ? 1
+				  : (clp->val.u > 64 ? 64 : clp->val.u));
+      else
+	gif_write_info.threads = processor_count();
+      break;
+
+     case MAX_FRAME_PIXELS_OPT:
+      gif_read_limits.max_frame_pixels = clp->negated ? 0 : clp->val.u;
+      break;
+
+     case MAX_FRAMES_OPT:
+      gif_read_limits.max_frames = clp->negated ? 0 : clp->val.u;
+      break;
+
+     case MAX_PIXELS_OPT:
+      gif_read_limits.max_total_pixels = clp->negated ? 0 : clp->val.u;
+      break;
+
+     case MAX_BYTES_OPT:
+      gif_read_limits.max_bytes = clp->negated ? 0 : clp->val.u;
+      break;
+
+     case MAX_READ_TIME_OPT:
+      gif_read_limits.max_msec = clp->negated ? 0 : clp->val.u;
+      break;
+
+     case TIME_BUDGET_OPT:
+      time_budget = clp->negated ? 0 : clp->val.u;
+      break;
+
+     case ANALYSIS_CACHE_OPT:
+      analysis_cache_dir = clp->negated ? 0 : clp->vstr;
+      break;
+
+     case CHECKPOINT_OPT:
+      checkpoint_file = clp->negated ? 0 : clp->vstr;
+      break;
+
+     case CHECKPOINT_INTERVAL_OPT:
+      checkpoint_interval = clp->val.u;
+      break;
+
+     case RESUME_OPT:
+      checkpoint_resume = !clp->negated;
+      break;
+
      case CONSERVE_MEMORY_OPT:
       MARK_CH(output, CH_MEMORY);
       def_output_data.conserve_memory = !clp->negated;
       break;
 
+     case FRAME_CACHE_OPT:
+      MARK_CH(output, CH_FRAME_CACHE);
+      def_output_data.frame_cache = !clp->negated;
+      break;
+
+     case PROGRESSIVE_OPT:
+      MARK_CH(output, CH_PROGRESSIVE);
+      def_output_data.progressive = !clp->negated;
+      break;
+
      case MULTIFILE_OPT:
       if (clp->negated)
 	gif_read_flags &= ~GIF_READ_TRAILING_GARBAGE_OK;
@@ -1858,6 +2186,8 @@ particular purpose.\n");
 
   if (next_output)
     combine_output_options();
+  if (checkpoint_resume && !checkpoint_file)
+    warning(0, "'--resume' has no effect without '--checkpoint'");
   if (!files_given)
     input_stream(0);
 
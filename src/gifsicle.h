@@ -116,6 +116,8 @@ typedef struct {
   double scale_y;
 
   int conserve_memory;
+  int frame_cache;
+  int progressive;
 
 } Gt_OutputData;
 
@@ -128,6 +130,7 @@ extern Gt_OutputData active_output_data;
 
 #define GT_OPT_MASK		0xFFFF
 #define GT_OPT_KEEPEMPTY	0x10000
+#define GT_OPT_FOLDLOOPS	0x20000
 
 
 /*****
@@ -162,6 +165,15 @@ void verbose_open(char, const char *);
 void verbose_close(char);
 void verbose_endline(void);
 
+extern int processing_canceled;
+int gifsicle_progress(const char *phase, int done, int total, void *thunk);
+int check_progress(const char *phase, int done, int total);
+
+extern unsigned long time_budget;
+void start_time_budget(void);
+double time_budget_left(void);
+double current_msec(void);
+
 #define EXIT_OK		0
 #define EXIT_ERR	1
 #define EXIT_USER_ERR	1
@@ -194,7 +206,8 @@ void	merge_comments(Gif_Comment *destc, Gif_Comment *srcc);
 Gif_Image *merge_image(Gif_Stream *dest, Gif_Stream *src, Gif_Image *srci,
 		       int same_compressed_ok);
 
-void	optimize_fragments(Gif_Stream *, int optimizeness, int huge_stream);
+int	optimize_fragments(Gif_Stream *, int optimizeness, int huge_stream,
+			   FILE *progressive);
 
 /*****
  * image/colormap transformations
@@ -219,6 +232,9 @@ int	crop_image(Gif_Image *, Gt_Crop *, int preserve_total_crop);
 
 void	flip_image(Gif_Image *, int scr_width, int scr_height, int is_vert);
 void	rotate_image(Gif_Image *, int scr_width, int scr_height, int rotation);
+int	orient_image(Gif_Image *, int scr_width, int scr_height,
+		     int flip_horizontal, int flip_vertical, int rotation,
+		     int defer);
 void	scale_image(Gif_Stream *, Gif_Image *, double xfactor, double yfactor);
 void	resize_stream(Gif_Stream *, int new_width, int new_height, int fit);
 
@@ -230,23 +246,52 @@ Gif_Color *histogram(Gif_Stream *, int *);
 #define COLORMAP_DIVERSITY		0
 #define COLORMAP_BLEND_DIVERSITY	1
 #define COLORMAP_MEDIAN_CUT		2
+
+#define DITHER_NONE			0
+#define DITHER_FLOYD_STEINBERG		1
+#define DITHER_INCREMENTAL		2
 Gif_Colormap *colormap_blend_diversity(Gif_Color *, int, int);
 Gif_Colormap *colormap_flat_diversity(Gif_Color *, int, int);
 Gif_Colormap *colormap_median_cut(Gif_Color *, int, int);
 
-typedef struct color_hash_item color_hash_item;
+typedef struct color_hash color_hash;
 typedef void (*colormap_image_func)
      (Gif_Image *, uint8_t *, Gif_Colormap *, Gif_Colormap *,
-      color_hash_item **, uint32_t *);
+      color_hash *, uint32_t *);
 
 void	colormap_image_posterize
 	(Gif_Image *, uint8_t *, Gif_Colormap *, Gif_Colormap *,
-	 color_hash_item **, uint32_t *);
+	 color_hash *, uint32_t *);
 void	colormap_image_floyd_steinberg
 	(Gif_Image *, uint8_t *, Gif_Colormap *, Gif_Colormap *,
-	 color_hash_item **, uint32_t *);
+	 color_hash *, uint32_t *);
+void	colormap_image_floyd_steinberg_incremental
+	(Gif_Image *, uint8_t *, Gif_Colormap *, Gif_Colormap *,
+	 color_hash *, uint32_t *);
 void	colormap_stream(Gif_Stream *, Gif_Colormap *, colormap_image_func);
 
+/*****
+ * analysis cache
+ **/
+extern const char *analysis_cache_dir;
+uint64_t	stream_digest(Gif_Stream *);
+uint8_t *	analysis_cache_load(uint64_t digest, const char *kind,
+				    uint32_t param, uint32_t *size_store);
+void		analysis_cache_store(uint64_t digest, const char *kind,
+				     uint32_t param, const uint8_t *data,
+				     uint32_t size);
+
+/*****
+ * optimizer checkpoints
+ **/
+extern const char *checkpoint_file;
+extern int checkpoint_resume;
+extern unsigned long checkpoint_interval;
+uint8_t *	checkpoint_load(uint64_t digest, uint32_t param,
+				uint32_t *size_store);
+int		checkpoint_store(uint64_t digest, uint32_t param,
+				 const uint8_t *data, uint32_t size);
+
 /*****
  * parsing stuff
  **/
@@ -289,6 +334,7 @@ void		clear_def_frame_once_options(void);
 
 Gif_Stream *	merge_frame_interval(Gt_Frameset *, int f1, int f2,
 				     Gt_OutputData *, int compress, int *huge);
+int		uncompress_frame_task(int frame, void *thunk);
 void		clear_frameset(Gt_Frameset *, int from);
 void		blank_frameset(Gt_Frameset *, int from, int to, int delete_ob);
 
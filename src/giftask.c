@@ -0,0 +1,271 @@
+/* giftask.c - Run per-frame work on several threads.
+   Copyright (C) 2026 Eddie Kohler, kohler@cs.ucla.edu
+   This file is part of the LCDF GIF library.
+
+   The LCDF GIF library is free software. It is distributed under the GNU
+   General Public License, version 2; you can copy, distribute, or alter it at
+   will, as long as this notice is kept intact and this source code is made
+   available. There is no warranty, express or implied. */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <lcdfgif/gif.h>
+#if HAVE_PTHREAD
+# include <pthread.h>
+#endif
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A frame task calls a function once for every frame, 0 up to nframes - 1,
+   on a set of worker threads. Workers start frames in order. The caller
+   collects frames in order with Gif_WaitFrameTask, so a frame task sits
+   between a per-frame stage, which runs in parallel, and the next stage,
+   which consumes frames one at a time. Workers never start a frame more
+   than 'window' frames past the one being collected; this bounds how much
+   finished but uncollected work can pile up. A window of 0 is unbounded.
+
+   Gif_FinishFrameTask waits for every frame, so it can also serve as a
+   barrier before a stage that needs all frames at once.
+
+   A frame queue, from Gif_NewFrameQueue, starts no frame until the caller
+   submits it with Gif_SubmitFrameTask. This lets a serial stage hand each
+   frame to the workers once it is ready.
+
+   Without thread support, or with fewer than 2 threads, no threads are
+   started and each frame runs on the caller's thread when collected. */
+
+struct Gif_FrameTask {
+  Gif_FrameTaskFunc func;
+  void *thunk;
+  int nframes;
+  int window;
+  int next;			/* next frame to start */
+  int ready;			/* frames before this may start */
+  int collected;		/* frames before this have been collected */
+  int8_t *result;		/* -1 until a frame finishes, then 0 or 1 */
+  int nthreads;
+#if HAVE_PTHREAD
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t frame_done;
+  pthread_cond_t window_moved;
+#endif
+};
+
+
+#if HAVE_PTHREAD
+static void *
+frame_task_worker(void *arg)
+{
+  Gif_FrameTask *gft = (Gif_FrameTask *) arg;
+  int frame, result;
+
+  pthread_mutex_lock(&gft->lock);
+  while (gft->next < gft->nframes) {
+    frame = gft->next;
+    if (frame >= gft->ready
+	|| (gft->window > 0 && frame >= gft->collected + gft->window)) {
+      pthread_cond_wait(&gft->window_moved, &gft->lock);
+      continue;
+    }
+    gft->next++;
+    pthread_mutex_unlock(&gft->lock);
+
+    result = (*gft->func)(frame, gft->thunk) != 0;
+
+    pthread_mutex_lock(&gft->lock);
+    gft->result[frame] = result;
+    pthread_cond_broadcast(&gft->frame_done);
+  }
+  pthread_mutex_unlock(&gft->lock);
+  return 0;
+}
+#endif
+
+static Gif_FrameTask *
+new_frame_task(int nframes, int nthreads, int window, int ready,
+	       Gif_FrameTaskFunc func, void *thunk)
+{
+  Gif_FrameTask *gft = Gif_New(Gif_FrameTask);
+  int i;
+  if (!gft)
+    return 0;
+  gft->func = func;
+  gft->thunk = thunk;
+  gft->nframes = nframes;
+  gft->window = window;
+  gft->next = gft->collected = 0;
+  gft->ready = ready;
+  gft->nthreads = 0;
+  gft->result = Gif_NewArray(int8_t, nframes > 0 ? nframes : 1);
+  if (!gft->result) {
+    Gif_Delete(gft);
+    return 0;
+  }
+  for (i = 0; i < nframes; i++)
+    gft->result[i] = -1;
+
+#if HAVE_PTHREAD
+  if (nthreads > nframes)
+    nthreads = nframes;
+  if (nthreads > 1 && (gft->threads = Gif_NewArray(pthread_t, nthreads))) {
+    pthread_mutex_init(&gft->lock, 0);
+    pthread_cond_init(&gft->frame_done, 0);
+    pthread_cond_init(&gft->window_moved, 0);
+    while (gft->nthreads < nthreads
+	   && pthread_create(&gft->threads[gft->nthreads], 0,
+			     frame_task_worker, gft) == 0)
+      gft->nthreads++;
+    /* if no thread started, frames run on the caller's thread */
+    if (gft->nthreads == 0) {
+      pthread_mutex_destroy(&gft->lock);
+      pthread_cond_destroy(&gft->frame_done);
+      pthread_cond_destroy(&gft->window_moved);
+      Gif_DeleteArray(gft->threads);
+    }
+  }
+#else
+  (void) nthreads;
+#endif
+
+  return gft;
+}
+
+Gif_FrameTask *
+Gif_NewFrameTask(int nframes, int nthreads, int window,
+		 Gif_FrameTaskFunc func, void *thunk)
+{
+  return new_frame_task(nframes, nthreads, window, nframes, func, thunk);
+}
+
+Gif_FrameTask *
+Gif_NewFrameQueue(int nframes, int nthreads, int window,
+		  Gif_FrameTaskFunc func, void *thunk)
+{
+  return new_frame_task(nframes, nthreads, window, 0, func, thunk);
+}
+
+/* Let frames up to and including 'frame' start. */
+void
+Gif_SubmitFrameTask(Gif_FrameTask *gft, int frame)
+{
+#if HAVE_PTHREAD
+  if (gft->nthreads > 0) {
+    pthread_mutex_lock(&gft->lock);
+    if (frame + 1 > gft->ready) {
+      gft->ready = frame + 1;
+      pthread_cond_broadcast(&gft->window_moved);
+    }
+    pthread_mutex_unlock(&gft->lock);
+    return;
+  }
+#endif
+  if (frame + 1 > gft->ready)
+    gft->ready = frame + 1;
+}
+
+/* Wait for 'frame' to finish and return its result. Collecting a frame
+   lets workers move on to later frames; it also submits the frame. */
+int
+Gif_WaitFrameTask(Gif_FrameTask *gft, int frame)
+{
+  int result;
+#if HAVE_PTHREAD
+  if (gft->nthreads > 0) {
+    pthread_mutex_lock(&gft->lock);
+    if (frame + 1 > gft->ready) {
+      gft->ready = frame + 1;
+      pthread_cond_broadcast(&gft->window_moved);
+    }
+    if (frame > gft->collected) {
+      gft->collected = frame;
+      pthread_cond_broadcast(&gft->window_moved);
+    }
+    while (gft->result[frame] < 0)
+      pthread_cond_wait(&gft->frame_done, &gft->lock);
+    result = gft->result[frame];
+    if (frame + 1 > gft->collected) {
+      gft->collected = frame + 1;
+      pthread_cond_broadcast(&gft->window_moved);
+    }
+    pthread_mutex_unlock(&gft->lock);
+    return result;
+  }
+#endif
+  if (frame + 1 > gft->ready)
+    gft->ready = frame + 1;
+  for (; gft->next <= frame; gft->next++)
+    gft->result[gft->next] = (*gft->func)(gft->next, gft->thunk) != 0;
+  if (frame + 1 > gft->collected)
+    gft->collected = frame + 1;
+  return gft->result[frame];
+}
+
+/* Wait for every frame to finish and stop the workers. Returns 1 if every
+   frame succeeded, 0 otherwise. Frames not yet submitted run too. */
+int
+Gif_FinishFrameTask(Gif_FrameTask *gft)
+{
+  int i, ok = 1;
+#if HAVE_PTHREAD
+  if (gft->nthreads > 0) {
+    pthread_mutex_lock(&gft->lock);
+    gft->window = 0;
+    gft->ready = gft->nframes;
+    pthread_cond_broadcast(&gft->window_moved);
+    pthread_mutex_unlock(&gft->lock);
+    for (i = 0; i < gft->nthreads; i++)
+      pthread_join(gft->threads[i], 0);
+    pthread_mutex_destroy(&gft->lock);
+    pthread_cond_destroy(&gft->frame_done);
+    pthread_cond_destroy(&gft->window_moved);
+    Gif_DeleteArray(gft->threads);
+    gft->nthreads = 0;
+  }
+#endif
+  if (gft->nframes > 0)
+    Gif_WaitFrameTask(gft, gft->nframes - 1);
+  for (i = 0; i < gft->nframes; i++)
+    if (!gft->result[i])
+      ok = 0;
+  return ok;
+}
+
+/* Start no more frames. Frames that have not started fail; frames already
+   running still finish. */
+void
+Gif_CancelFrameTask(Gif_FrameTask *gft)
+{
+  int i;
+#if HAVE_PTHREAD
+  if (gft->nthreads > 0)
+    pthread_mutex_lock(&gft->lock);
+#endif
+  for (i = gft->next; i < gft->nframes; i++)
+    gft->result[i] = 0;
+  gft->next = gft->nframes;
+#if HAVE_PTHREAD
+  if (gft->nthreads > 0) {
+    pthread_cond_broadcast(&gft->frame_done);
+    pthread_cond_broadcast(&gft->window_moved);
+    pthread_mutex_unlock(&gft->lock);
+  }
+#endif
+}
+
+void
+Gif_DeleteFrameTask(Gif_FrameTask *gft)
+{
+  if (!gft)
+    return;
+  Gif_FinishFrameTask(gft);
+  Gif_DeleteArray(gft->result);
+  Gif_Delete(gft);
+}
+
+
+#ifdef __cplusplus
+}
+#endif
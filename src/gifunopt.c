@@ -17,94 +17,365 @@
 extern "C" {
 #endif
 
-#define TRANSPARENT 256
+/* A rectangle of screen pixels; 'right' and 'bottom' are exclusive. */
+typedef struct {
+  int left;
+  int top;
+  int right;
+  int bottom;
+} Gif_UnoptRect;
+
+/* A frame's unoptimized result, applied once every frame has succeeded. */
+typedef struct {
+  uint8_t *data;
+  Gif_Colormap *local;
+  int transparent;
+  int disposal;
+  Gif_UnoptRect out;
+} Gif_UnoptFrame;
+
+/* The composited screen, with the number of pixels showing each value, so
+   a frame costs time in proportion to its own area, not the screen's.
+
+   If every image uses the global colormap, screen values are global color
+   indices and 'transparent' is 256. Otherwise screen values index 'allcol',
+   the distinct colors of all the stream's colormaps, and 'transparent' is
+   'nallcol'; each output frame then gets the global colormap if it can, and
+   a local colormap if it must. */
+typedef struct {
+  uint16_t *screen;
+  uint32_t *count;
+  int transparent;
+  uint16_t background;
+
+  uint16_t *saved;		/* rectangle saved for GIF_DISPOSAL_PREVIOUS */
+  uint32_t saved_cap;
+  uint32_t *saved_count;
+  Gif_UnoptRect dirty;		/* area the last disposal may have changed */
+
+  Gif_UnoptFrame *frames;
+  int global_ncol;		/* global colormap size the frames need */
+
+  Gif_Color *allcol;
+  int nallcol;
+  uint32_t *hash;		/* open-addressed: RGB + 1, or 0 if empty */
+  uint16_t *hash_index;
+  uint32_t hash_mask;
+  short *global_index;		/* allcol index -> global index, or -1 */
+  int *out_map;			/* allcol index -> output index, per frame */
+  Gif_Colormap *in_cm;		/* 'in_map' translates this colormap */
+  uint16_t in_map[256];
+} Gif_Unoptimizer;
+
+
+static void
+frame_rect(Gif_Stream *gfs, Gif_Image *gfi, Gif_UnoptRect *r)
+{
+  r->left = gfi->left < gfs->screen_width ? gfi->left : gfs->screen_width;
+  r->top = gfi->top < gfs->screen_height ? gfi->top : gfs->screen_height;
+  r->right = gfi->left + gfi->width;
+  if (r->right > gfs->screen_width) r->right = gfs->screen_width;
+  r->bottom = gfi->top + gfi->height;
+  if (r->bottom > gfs->screen_height) r->bottom = gfs->screen_height;
+}
+
+static void
+union_rect(Gif_UnoptRect *r, const Gif_UnoptRect *r2)
+{
+  if (r2->left >= r2->right || r2->top >= r2->bottom)
+    return;
+  else if (r->left >= r->right || r->top >= r->bottom)
+    *r = *r2;
+  else {
+    if (r2->left < r->left) r->left = r2->left;
+    if (r2->top < r->top) r->top = r2->top;
+    if (r2->right > r->right) r->right = r2->right;
+    if (r2->bottom > r->bottom) r->bottom = r2->bottom;
+  }
+}
+
+
+/* combined colors */
+
+static int
+find_all_color(Gif_Unoptimizer *u, const Gif_Color *c, int insert)
+{
+  uint32_t key = (((uint32_t) c->red << 16) | (c->green << 8) | c->blue) + 1;
+  uint32_t h = (key * 2654435761U) & u->hash_mask;
+  while (u->hash[h] && u->hash[h] != key)
+    h = (h + 1) & u->hash_mask;
+  if (!u->hash[h]) {
+    if (!insert)
+      return -1;
+    u->hash[h] = key;
+    u->hash_index[h] = u->nallcol;
+    u->allcol[u->nallcol] = *c;
+    u->nallcol++;
+  }
+  return u->hash_index[h];
+}
+
+static int
+collect_all_colors(Gif_Stream *gfs, Gif_Unoptimizer *u)
+{
+  Gif_Colormap *last = 0;
+  int i, j, ncol = gfs->global ? gfs->global->ncol : 0;
+  uint32_t hash_size = 512;
+
+  for (i = 0; i < gfs->nimages; i++)
+    if (gfs->images[i]->local && gfs->images[i]->local != last) {
+      last = gfs->images[i]->local;
+      ncol += last->ncol;
+    }
+  if (ncol > 65535)		/* screen values must fit in 16 bits */
+    ncol = 65535;
+  while (hash_size < (uint32_t) ncol * 2)
+    hash_size *= 2;
+
+  u->allcol = Gif_NewArray(Gif_Color, ncol ? ncol : 1);
+  u->hash = Gif_NewArray(uint32_t, hash_size);
+  u->hash_index = Gif_NewArray(uint16_t, hash_size);
+  if (!u->allcol || !u->hash || !u->hash_index)
+    return 0;
+  memset(u->hash, 0, sizeof(uint32_t) * hash_size);
+  u->hash_mask = hash_size - 1;
+  u->nallcol = 0;
+
+  if (gfs->global)
+    for (j = 0; j < gfs->global->ncol; j++)
+      find_all_color(u, &gfs->global->col[j], 1);
+  for (i = 0, last = 0; i < gfs->nimages; i++)
+    if (gfs->images[i]->local && gfs->images[i]->local != last) {
+      last = gfs->images[i]->local;
+      for (j = 0; j < last->ncol; j++) {
+	if (u->nallcol == ncol && find_all_color(u, &last->col[j], 0) < 0)
+	  return 0;
+	find_all_color(u, &last->col[j], 1);
+      }
+    }
+
+  u->global_index = Gif_NewArray(short, u->nallcol ? u->nallcol : 1);
+  u->out_map = Gif_NewArray(int, u->nallcol ? u->nallcol : 1);
+  if (!u->global_index || !u->out_map)
+    return 0;
+  for (j = 0; j < u->nallcol; j++)
+    u->global_index[j] = -1;
+  if (gfs->global)
+    for (j = gfs->global->ncol - 1; j >= 0; j--)
+      u->global_index[find_all_color(u, &gfs->global->col[j], 0)] = j;
+  return 1;
+}
+
+/* Set u->in_map to translate gfi's pixels to screen values. */
+static int
+prepare_in_map(Gif_Stream *gfs, Gif_Image *gfi, Gif_Unoptimizer *u)
+{
+  Gif_Colormap *gfcm = gfi->local ? gfi->local : gfs->global;
+  int i;
+  if (!u->allcol) {
+    for (i = 0; i < 256; i++)
+      u->in_map[i] = i;
+  } else if (gfcm != u->in_cm) {
+    if (!gfcm || gfcm->ncol <= 0)
+      return 0;
+    for (i = 0; i < gfcm->ncol && i < 256; i++)
+      u->in_map[i] = find_all_color(u, &gfcm->col[i], 0);
+    /* out-of-range pixels get color 0 */
+    for (; i < 256; i++)
+      u->in_map[i] = u->in_map[0];
+    u->in_cm = gfcm;
+  }
+  return 1;
+}
+
 
 static void
-put_image_in_screen(Gif_Stream *gfs, Gif_Image *gfi, uint16_t *screen)
+put_image_in_screen(Gif_Stream *gfs, Gif_Image *gfi, Gif_Unoptimizer *u,
+		    const Gif_UnoptRect *r)
 {
   int transparent = gfi->transparent;
   int x, y;
-  int w = gfi->width;
-  int h = gfi->height;
-  if (gfi->left + w > gfs->screen_width) w = gfs->screen_width - gfi->left;
-  if (gfi->top + h > gfs->screen_height) h = gfs->screen_height - gfi->top;
+  int w = r->right - r->left;
 
-  for (y = 0; y < h; y++) {
-    uint16_t *move = screen + gfs->screen_width * (y + gfi->top) + gfi->left;
+  for (y = 0; y < r->bottom - r->top; y++) {
+    uint16_t *move = u->screen + gfs->screen_width * (y + r->top) + r->left;
     uint8_t *line = gfi->img[y];
     for (x = 0; x < w; x++, move++, line++)
-      if (*line != transparent)
-	*move = *line;
+      if (*line != transparent && *move != u->in_map[*line]) {
+	u->count[*move]--;
+	*move = u->in_map[*line];
+	u->count[*move]++;
+      }
   }
 }
 
 
-static void
-put_background_in_screen(Gif_Stream *gfs, Gif_Image *gfi, uint16_t *screen)
+/* Returns 1 if any visible pixel became transparent. */
+static int
+put_background_in_screen(Gif_Stream *gfs, Gif_UnoptFrame *frame,
+			 Gif_Unoptimizer *u, const Gif_UnoptRect *r)
 {
   uint16_t solid;
-  int x, y;
-  int w = gfi->width;
-  int h = gfi->height;
-  if (gfi->left + w > gfs->screen_width) w = gfs->screen_width - gfi->left;
-  if (gfi->top + h > gfs->screen_height) h = gfs->screen_height - gfi->top;
+  int x, y, cleared = 0;
+  int w = r->right - r->left;
 
-  if (gfi->transparent >= 0)
-    solid = TRANSPARENT;
-  else if (gfs->images[0]->transparent >= 0)
-    solid = TRANSPARENT;
+  if (frame->transparent >= 0)
+    solid = u->transparent;
+  else if (u->frames[0].transparent >= 0)
+    solid = u->transparent;
   else
-    solid = gfs->background;
+    solid = u->background;
 
-  for (y = 0; y < h; y++) {
-    uint16_t *move = screen + gfs->screen_width * (y + gfi->top) + gfi->left;
+  for (y = r->top; y < r->bottom; y++) {
+    uint16_t *move = u->screen + gfs->screen_width * y + r->left;
     for (x = 0; x < w; x++, move++)
-      *move = solid;
+      if (*move != solid) {
+	u->count[*move]--;
+	u->count[solid]++;
+	*move = solid;
+	cleared = 1;
+      }
   }
+  return cleared && solid == u->transparent;
 }
 
 
 static int
-create_image_data(Gif_Stream *gfs, Gif_Image *gfi, uint16_t *screen,
-		  uint8_t *new_data, int *used_transparent)
+save_screen_area(Gif_Stream *gfs, Gif_Unoptimizer *u, const Gif_UnoptRect *r)
 {
-  int have[257];
-  int transparent = -1;
-  int size = gfs->screen_width * gfs->screen_height;
-  uint16_t *move;
-  int i;
+  int y, w = r->right - r->left;
+  uint32_t size = (uint32_t) w * (r->bottom - r->top);
+  if (size > u->saved_cap) {
+    Gif_DeleteArray(u->saved);
+    u->saved = Gif_NewArray(uint16_t, size);
+    u->saved_cap = u->saved ? size : 0;
+    if (!u->saved)
+      return 0;
+  }
+  for (y = r->top; y < r->bottom; y++)
+    memcpy(u->saved + w * (y - r->top),
+	   u->screen + gfs->screen_width * y + r->left, w * sizeof(uint16_t));
+  memcpy(u->saved_count, u->count, sizeof(uint32_t) * (u->transparent + 1));
+  return 1;
+}
 
-  /* mark colors used opaquely in the image */
-  assert(TRANSPARENT == 256);
-  for (i = 0; i < 257; i++)
-    have[i] = 0;
-  for (i = 0, move = screen; i < size; i++, move++)
-    have[*move] = 1;
+/* Returns 1 if any visible pixel became transparent. */
+static int
+restore_screen_area(Gif_Stream *gfs, Gif_Unoptimizer *u,
+		    const Gif_UnoptRect *r)
+{
+  int x, y, cleared = 0, w = r->right - r->left;
+  for (y = r->top; y < r->bottom; y++) {
+    uint16_t *move = u->screen + gfs->screen_width * y + r->left;
+    const uint16_t *saved = u->saved + w * (y - r->top);
+    for (x = 0; x < w; x++, move++, saved++)
+      if (*move != *saved) {
+	cleared |= (*saved == u->transparent);
+	*move = *saved;
+      }
+  }
+  memcpy(u->count, u->saved_count, sizeof(uint32_t) * (u->transparent + 1));
+  return cleared;
+}
+
+
+/* Choose the output colormap for a frame of combined colors: the global
+   colormap if it has every color on the screen and room for transparency,
+   otherwise a new local colormap. Sets u->out_map and frame->local, and
+   returns the transparent index, -1 if there's none, or -2 on failure. */
+static int
+choose_colormap(Gif_Stream *gfs, Gif_UnoptFrame *frame, Gif_Unoptimizer *u)
+{
+  uint8_t used[256];
+  int i, n, transparent = -1;
+  int need_transparent = u->count[u->transparent] != 0;
+  Gif_Colormap *local;
+
+  if (gfs->global) {
+    memset(used, 0, sizeof(used));
+    for (i = 0; i < u->nallcol; i++)
+      if (u->count[i]) {
+	if (u->global_index[i] < 0)
+	  goto local_colormap;
+	u->out_map[i] = u->global_index[i];
+	used[u->global_index[i]] = 1;
+      }
+    if (need_transparent) {
+      for (i = 0; i < 256 && transparent < 0; i++)
+	if (!used[i])
+	  transparent = i;
+      if (transparent < 0)
+	goto local_colormap;
+      if (transparent >= u->global_ncol)
+	u->global_ncol = transparent + 1;
+    }
+    frame->local = 0;
+    return transparent;
+  }
 
-  /* the new transparent color is a color unused in either */
-  if (have[TRANSPARENT]) {
+ local_colormap:
+  for (i = n = 0; i < u->nallcol; i++)
+    if (u->count[i])
+      n++;
+  if (n + need_transparent > 256)
+    return -2;
+  local = Gif_NewFullColormap(n + need_transparent, 256);
+  if (!local)
+    return -2;
+  for (i = n = 0; i < u->nallcol; i++)
+    if (u->count[i]) {
+      local->col[n] = u->allcol[i];
+      u->out_map[i] = n++;
+    }
+  if (need_transparent) {
+    transparent = n;
+    local->col[n].red = local->col[n].green = local->col[n].blue = 0;
+  }
+  frame->local = local;
+  local->refcount++;
+  return transparent;
+}
+
+
+static int
+create_image_data(Gif_Stream *gfs, Gif_UnoptFrame *frame, Gif_Unoptimizer *u,
+		  const Gif_UnoptRect *r, uint8_t *new_data,
+		  int *used_transparent)
+{
+  int transparent = -1;
+  int w = r->right - r->left;
+  int i, x, y;
+
+  if (u->allcol) {
+    transparent = choose_colormap(gfs, frame, u);
+    if (transparent < -1)
+      goto error;
+  } else if (u->count[u->transparent]) {
+    /* the new transparent color is a color unused in the image */
     for (i = 0; i < 256 && transparent < 0; i++)
-      if (!have[i])
+      if (!u->count[i])
 	transparent = i;
     if (transparent < 0)
       goto error;
-    if (transparent >= gfs->global->ncol) {
-      Gif_ReArray(gfs->global->col, Gif_Color, 256);
-      if (!gfs->global->col) goto error;
-      gfs->global->ncol = transparent + 1;
-    }
+    if (transparent >= u->global_ncol)
+      u->global_ncol = transparent + 1;
   }
 
   /* map the wide image onto the new data */
   *used_transparent = 0;
-  for (i = 0, move = screen; i < size; i++, move++, new_data++)
-    if (*move == TRANSPARENT) {
-      *new_data = transparent;
-      *used_transparent = 1;
-    } else
-      *new_data = *move;
+  for (y = r->top; y < r->bottom; y++) {
+    uint16_t *move = u->screen + gfs->screen_width * y + r->left;
+    for (x = 0; x < w; x++, move++, new_data++)
+      if (*move == u->transparent) {
+	*new_data = transparent;
+	*used_transparent = 1;
+      } else if (u->allcol)
+	*new_data = u->out_map[*move];
+      else
+	*new_data = *move;
+  }
 
-  gfi->transparent = transparent;
+  frame->transparent = transparent;
   return 1;
 
  error:
@@ -113,41 +384,69 @@ create_image_data(Gif_Stream *gfs, Gif_Image *gfi, uint16_t *screen,
 
 
 static int
-unoptimize_image(Gif_Stream *gfs, Gif_Image *gfi, uint16_t *screen)
+unoptimize_image(Gif_Stream *gfs, Gif_Image *gfi, Gif_UnoptFrame *frame,
+		 Gif_Unoptimizer *u, int flags)
 {
-  int size = gfs->screen_width * gfs->screen_height;
-  int used_transparent;
-  uint8_t *new_data = Gif_NewArray(uint8_t, size);
-  uint16_t *new_screen = screen;
-  if (!new_data) return 0;
+  Gif_UnoptRect r, out;
+  int used_transparent, cleared = 0;
+  uint8_t *new_data;
 
   /* Oops! May need to uncompress it */
   Gif_UncompressImage(gfi);
+  Gif_ApplyIndexMap(gfi);
   Gif_ReleaseCompressedImage(gfi);
 
-  if (gfi->disposal == GIF_DISPOSAL_PREVIOUS) {
-    new_screen = Gif_NewArray(uint16_t, size);
-    if (!new_screen) return 0;
-    memcpy(new_screen, screen, size * sizeof(uint16_t));
+  frame_rect(gfs, gfi, &r);
+  if (!prepare_in_map(gfs, gfi, u))
+    return 0;
+  if (gfi->disposal == GIF_DISPOSAL_PREVIOUS && !save_screen_area(gfs, u, &r))
+    return 0;
+
+  put_image_in_screen(gfs, gfi, u, &r);
+
+  /* With GIF_UNOPTIMIZE_CROP, output only the area that can differ from
+     the previous frame: this frame, plus whatever the previous disposal
+     touched. The first frame covers the screen. */
+  out.left = out.top = 0;
+  out.right = gfs->screen_width;
+  out.bottom = gfs->screen_height;
+  if ((flags & GIF_UNOPTIMIZE_CROP) && gfi != gfs->images[0]) {
+    out = u->dirty;
+    union_rect(&out, &r);
+    if (out.left >= out.right || out.top >= out.bottom)
+      out.left = out.top = 0, out.right = out.bottom = 1;
   }
 
-  put_image_in_screen(gfs, gfi, new_screen);
-  if (!create_image_data(gfs, gfi, new_screen, new_data, &used_transparent)) {
+  new_data = Gif_NewArray(uint8_t, (out.right - out.left)
+			  * (out.bottom - out.top));
+  if (!new_data
+      || !create_image_data(gfs, frame, u, &out, new_data,
+			    &used_transparent)) {
     Gif_DeleteArray(new_data);
     return 0;
   }
+  frame->data = new_data;
+  frame->out = out;
 
-  if (gfi->disposal == GIF_DISPOSAL_PREVIOUS)
-    Gif_DeleteArray(new_screen);
-  else if (gfi->disposal == GIF_DISPOSAL_BACKGROUND)
-    put_background_in_screen(gfs, gfi, screen);
+  u->dirty.left = u->dirty.right = 0;
+  if (gfi->disposal == GIF_DISPOSAL_PREVIOUS) {
+    cleared = restore_screen_area(gfs, u, &r);
+    u->dirty = r;
+  } else if (gfi->disposal == GIF_DISPOSAL_BACKGROUND) {
+    cleared = put_background_in_screen(gfs, frame, u, &r);
+    u->dirty = r;
+  }
 
-  gfi->left = 0;
-  gfi->top = 0;
-  gfi->width = gfs->screen_width;
-  gfi->height = gfs->screen_height;
-  gfi->disposal = used_transparent;
-  Gif_SetUncompressedImage(gfi, new_data, Gif_DeleteArrayFunc, 0);
+  if (flags & GIF_UNOPTIMIZE_CROP) {
+    /* Pixels that became transparent are in this frame's area; clear that
+       area, and have the next frame repaint all of it. */
+    if (cleared) {
+      frame->disposal = GIF_DISPOSAL_BACKGROUND;
+      union_rect(&u->dirty, &out);
+    } else
+      frame->disposal = GIF_DISPOSAL_NONE;
+  } else
+    frame->disposal = used_transparent;
 
   return 1;
 }
@@ -175,32 +474,88 @@ int
 Gif_FullUnoptimize(Gif_Stream *gfs, int flags)
 {
   int ok = 1;
-  int i, size;
-  uint16_t *screen;
-  uint16_t background;
+  int i, size, any_locals = 0;
+  Gif_Unoptimizer u;
   Gif_Image *gfi;
 
   if (gfs->nimages < 1) return 1;
   for (i = 0; i < gfs->nimages; i++)
     if (gfs->images[i]->local)
+      any_locals = 1;
+    else if (!gfs->global)
       return 0;
-  if (!gfs->global)
-    return 0;
+
+  memset(&u, 0, sizeof(u));
+  if (any_locals && !collect_all_colors(gfs, &u)) {
+    ok = 0;
+    goto done;
+  }
 
   Gif_CalculateScreenSize(gfs, 0);
   size = gfs->screen_width * gfs->screen_height;
 
-  screen = Gif_NewArray(uint16_t, size);
+  u.transparent = u.allcol ? u.nallcol : 256;
+  if (!u.allcol)
+    u.background = gfs->background;
+  else if (gfs->global && gfs->background < gfs->global->ncol)
+    u.background = find_all_color(&u, &gfs->global->col[gfs->background], 0);
+  else
+    u.background = u.transparent;
+  u.screen = Gif_NewArray(uint16_t, size);
+  u.count = Gif_NewArray(uint32_t, u.transparent + 1);
+  u.saved_count = Gif_NewArray(uint32_t, u.transparent + 1);
+  u.frames = Gif_NewArray(Gif_UnoptFrame, gfs->nimages);
+  if (!u.screen || !u.count || !u.saved_count || !u.frames) {
+    ok = 0;
+    goto done;
+  }
   gfi = gfs->images[0];
-  background = gfi->transparent >= 0 ? TRANSPARENT : gfs->background;
+  if (gfi->transparent >= 0)
+    u.background = u.transparent;
   for (i = 0; i < size; i++)
-    screen[i] = background;
+    u.screen[i] = u.background;
+  memset(u.count, 0, sizeof(uint32_t) * (u.transparent + 1));
+  u.count[u.background] = size;
+  memset(u.frames, 0, sizeof(Gif_UnoptFrame) * gfs->nimages);
+
+  /* Leave the stream untouched unless every frame succeeds. */
+  for (i = 0; i < gfs->nimages && ok; i++)
+    if (!unoptimize_image(gfs, gfs->images[i], &u.frames[i], &u, flags))
+      ok = 0;
 
-  for (i = 0; i < gfs->nimages; i++)
-    if (!unoptimize_image(gfs, gfs->images[i], screen))
+  if (ok && gfs->global && u.global_ncol > gfs->global->ncol) {
+    Gif_ReArray(gfs->global->col, Gif_Color, 256);
+    if (!gfs->global->col)
       ok = 0;
+    else {
+      memset(&gfs->global->col[gfs->global->ncol], 0,
+	     sizeof(Gif_Color) * (u.global_ncol - gfs->global->ncol));
+      gfs->global->ncol = u.global_ncol;
+    }
+  }
+
+  for (i = 0; i < gfs->nimages; i++) {
+    Gif_UnoptFrame *frame = &u.frames[i];
+    gfi = gfs->images[i];
+    if (!ok) {
+      Gif_DeleteArray(frame->data);
+      Gif_DeleteColormap(frame->local);
+      continue;
+    }
+    if (u.allcol) {
+      Gif_DeleteColormap(gfi->local);
+      gfi->local = frame->local;
+    }
+    gfi->left = frame->out.left;
+    gfi->top = frame->out.top;
+    gfi->width = frame->out.right - frame->out.left;
+    gfi->height = frame->out.bottom - frame->out.top;
+    gfi->transparent = frame->transparent;
+    gfi->disposal = frame->disposal;
+    Gif_SetUncompressedImage(gfi, frame->data, Gif_DeleteArrayFunc, 0);
+  }
 
-  if (ok) {
+  if (ok && !(flags & GIF_UNOPTIMIZE_CROP)) {
     if (flags & GIF_UNOPTIMIZE_SIMPLEST_DISPOSAL) {
       /* set disposal based on use of transparency.
 	 If (every transparent pixel in frame i is also transparent in frame
@@ -217,7 +572,17 @@ Gif_FullUnoptimize(Gif_Stream *gfs, int flags)
 	gfs->images[i]->disposal = GIF_DISPOSAL_BACKGROUND;
   }
 
-  Gif_DeleteArray(screen);
+ done:
+  Gif_DeleteArray(u.screen);
+  Gif_DeleteArray(u.count);
+  Gif_DeleteArray(u.saved);
+  Gif_DeleteArray(u.saved_count);
+  Gif_DeleteArray(u.allcol);
+  Gif_DeleteArray(u.hash);
+  Gif_DeleteArray(u.hash_index);
+  Gif_DeleteArray(u.global_index);
+  Gif_DeleteArray(u.out_map);
+  Gif_DeleteArray(u.frames);
   return ok;
 }
 
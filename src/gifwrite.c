@@ -227,7 +227,12 @@ gfc_define(Gif_CodeTable *gfc, Gif_Node *work_node, uint8_t suffix,
 static inline const uint8_t *
 gif_imageline(Gif_Image *gfi, unsigned pos)
 {
-  unsigned y = pos / gfi->width, x = pos - y * gfi->width;
+  unsigned y, x;
+  /* A dense, noninterlaced image is written as one long line. */
+  if (!gfi->interlace && Gif_ImageDense(gfi))
+    return pos < (unsigned) gfi->width * gfi->height
+      ? Gif_ImagePixels(gfi) + pos : NULL;
+  y = pos / gfi->width, x = pos - y * gfi->width;
   if (y == (unsigned) gfi->height)
     return NULL;
   else if (!gfi->interlace)
@@ -239,10 +244,89 @@ gif_imageline(Gif_Image *gfi, unsigned pos)
 static inline unsigned
 gif_line_endpos(Gif_Image *gfi, unsigned pos)
 {
-  unsigned y = pos / gfi->width;
+  unsigned y;
+  if (!gfi->interlace && Gif_ImageDense(gfi))
+    return gfi->width * gfi->height;
+  y = pos / gfi->width;
   return (y + 1) * gfi->width;
 }
 
+/* Flexible parsing. Greedy LZW always emits the longest string in the code
+   table. With GIF_WRITE_FLEXIBLE, the encoder also considers emitting each
+   of the FLEXIBLE_WINDOW next-shorter prefixes of that string, and picks
+   the one that lets the prefix plus the following string cover the most
+   pixels. The output is standard LZW, but a shortened code wastes a table
+   entry (the decoder defines "prefix + next pixel", which is the longer
+   string we already have), so shortening must win by FLEXIBLE_MARGIN
+   pixels. */
+#define FLEXIBLE_WINDOW		4
+#define FLEXIBLE_MARGIN		2
+
+static unsigned
+gfc_match_length(Gif_CodeTable *gfc, Gif_Image *gfi, unsigned pos)
+{
+  const uint8_t *imageline = gif_imageline(gfi, pos);
+  unsigned line_endpos = gif_line_endpos(gfi, pos);
+  const uint8_t *index_map = gfi->index_map;
+  Gif_Node *node = 0;
+  unsigned len = 0;
+
+  while (imageline) {
+    node = gfc_lookup(gfc, node, index_map ? index_map[*imageline] : *imageline);
+    if (!node)
+      break;
+    len++;
+    imageline++;
+    pos++;
+    if (pos == line_endpos) {
+      imageline = gif_imageline(gfi, pos);
+      line_endpos = gif_line_endpos(gfi, pos);
+    }
+  }
+  return len;
+}
+
+static Gif_Node *
+gfc_prefix_node(Gif_CodeTable *gfc, Gif_Image *gfi, unsigned pos,
+                unsigned len)
+{
+  const uint8_t *imageline = gif_imageline(gfi, pos);
+  unsigned line_endpos = gif_line_endpos(gfi, pos);
+  const uint8_t *index_map = gfi->index_map;
+  Gif_Node *node = 0;
+
+  for (; len; len--) {
+    node = gfc_lookup(gfc, node, index_map ? index_map[*imageline] : *imageline);
+    imageline++;
+    pos++;
+    if (pos == line_endpos) {
+      imageline = gif_imageline(gfi, pos);
+      line_endpos = gif_line_endpos(gfi, pos);
+    }
+  }
+  return node;
+}
+
+/* Return the length of the prefix of the 'run'-pixel string at 'pos' that
+   flexible parsing would emit. */
+static unsigned
+flexible_prefix_length(Gif_CodeTable *gfc, Gif_Image *gfi, unsigned pos,
+                       unsigned run)
+{
+  unsigned best_len = run, best_cover, k, cover;
+  unsigned min_len = run > FLEXIBLE_WINDOW ? run - FLEXIBLE_WINDOW : 1;
+
+  best_cover = run + gfc_match_length(gfc, gfi, pos + run) + FLEXIBLE_MARGIN;
+  for (k = run - 1; k >= min_len; k--) {
+    cover = k + gfc_match_length(gfc, gfi, pos + k);
+    if (cover > best_cover) {
+      best_len = k;
+      best_cover = cover;
+    }
+  }
+  return best_len;
+}
+
 static int
 write_compressed_data(Gif_Image *gfi,
 		      int min_code_bits, Gif_CodeTable *gfc, Gif_Writer *grr)
@@ -256,6 +340,7 @@ write_compressed_data(Gif_Image *gfi,
   unsigned clear_bufpos, clear_pos;
   unsigned line_endpos;
   const uint8_t *imageline;
+  const uint8_t *index_map = gfi->index_map;
 
   Gif_Node *work_node;
   unsigned run;
@@ -289,7 +374,7 @@ write_compressed_data(Gif_Image *gfi,
      below. */
 
   pos = clear_pos = clear_bufpos = 0;
-  line_endpos = gfi->width;
+  line_endpos = gif_line_endpos(gfi, pos);
   imageline = gif_imageline(gfi, pos);
 
   while (1) {
@@ -349,20 +434,41 @@ write_compressed_data(Gif_Image *gfi,
     /* If height is 0 -- no more pixels to write -- we output work_node next
        time around. */
     while (imageline) {
-      suffix = *imageline;
+      suffix = index_map ? index_map[*imageline] : *imageline;
       next_node = gfc_lookup(gfc, work_node, suffix);
 
       imageline++;
       pos++;
       if (pos == line_endpos) {
 	imageline = gif_imageline(gfi, pos);
-        line_endpos += gfi->width;
+        line_endpos = gif_line_endpos(gfi, pos);
       }
 
       if (!next_node) {
+        /* Maybe output a shorter code (flexible parsing). */
+        int shortened = 0;
+        if ((grr->gcinfo.flags & GIF_WRITE_FLEXIBLE) && run > 1) {
+          unsigned start = pos - 1 - run;
+          unsigned len = flexible_prefix_length(gfc, gfi, start, run);
+          if (len < run) {
+            work_node = gfc_prefix_node(gfc, gfi, start, len);
+            pos = start + len;
+            imageline = gif_imageline(gfi, pos);
+            suffix = index_map ? index_map[*imageline] : *imageline;
+            pos++;
+            imageline = gif_imageline(gfi, pos);
+            line_endpos = gif_line_endpos(gfi, pos);
+            run = len;
+            shortened = 1;
+          }
+        }
+
 	/* Output the current code. */
 	if (next_code < GIF_MAX_CODE) {
-          gfc_define(gfc, work_node, suffix, next_code);
+          /* After a shortened code, the decoder's new code duplicates one
+             we already have; skip it without linking it in. */
+          if (!shortened)
+            gfc_define(gfc, work_node, suffix, next_code);
           next_code++;
 	} else
 	  next_code = GIF_MAX_CODE + 1; /* to match "> CUR_BUMP_CODE" above */
@@ -470,9 +576,14 @@ calculate_min_code_bits(Gif_Image *gfi, const Gif_Writer *grr)
     colors_used = 0;
     for (y = 0; y < height && colors_used < 128; y++) {
       uint8_t *data = gfi->img[y];
-      for (x = width; x > 0; x--, data++)
-	if (*data > colors_used)
-	  colors_used = *data;
+      if (gfi->index_map) {
+	for (x = width; x > 0; x--, data++)
+	  if (gfi->index_map[*data] > colors_used)
+	    colors_used = gfi->index_map[*data];
+      } else
+	for (x = width; x > 0; x--, data++)
+	  if (*data > colors_used)
+	    colors_used = *data;
     }
     colors_used++;
 
@@ -522,7 +633,7 @@ int
 Gif_FullCompressImage(Gif_Stream *gfs, Gif_Image *gfi,
 		      const Gif_CompressInfo *gcinfo)
 {
-  int ok = 0;
+  int ok = 0, flexible;
   uint8_t min_code_bits;
   Gif_Writer grr;
   Gif_CodeTable gfc;
@@ -547,6 +658,11 @@ Gif_FullCompressImage(Gif_Stream *gfs, Gif_Image *gfi,
     goto done;
   }
 
+  /* Flexible parsing is usually, but not always, smaller than greedy
+     parsing, so try both. */
+  flexible = grr.gcinfo.flags & GIF_WRITE_FLEXIBLE;
+  grr.gcinfo.flags &= ~GIF_WRITE_FLEXIBLE;
+
   min_code_bits = calculate_min_code_bits(gfi, &grr);
   ok = write_compressed_data(gfi, min_code_bits, &gfc, &grr);
   save_compression_result(gfi, &grr, ok);
@@ -559,6 +675,12 @@ Gif_FullCompressImage(Gif_Stream *gfs, Gif_Image *gfi,
       save_compression_result(gfi, &grr, 1);
   }
 
+  if (flexible && ok) {
+    grr.gcinfo.flags |= GIF_WRITE_FLEXIBLE | GIF_WRITE_SHRINK;
+    if (write_compressed_data(gfi, min_code_bits, &gfc, &grr))
+      save_compression_result(gfi, &grr, 1);
+  }
+
  done:
   Gif_DeleteArray(grr.v);
   Gif_DeleteArray(gfc.nodes);
@@ -621,9 +743,73 @@ write_color_table(Gif_Colormap *gfcm, int totalcol, Gif_Writer *grr)
 }
 
 
+static void
+write_compressed_blocks(const uint8_t *compressed, uint32_t compressed_len,
+			Gif_Writer *grr)
+{
+  while (compressed_len > 0) {
+    uint16_t amt = (compressed_len > 0x7000 ? 0x7000 : compressed_len);
+    gifputblock(compressed, amt, grr);
+    compressed += amt;
+    compressed_len -= amt;
+  }
+}
+
+
+/* When writing with several threads, images without usable compressed data
+   are compressed ahead of the writer by a frame task, each into its own
+   memory buffer. The writer collects them in order. */
+
+typedef struct {
+  Gif_Stream *gfs;
+  Gif_CompressInfo gcinfo;
+  int global_size;
+  Gif_Writer *frames;
+} Gif_CompressStage;
+
+static int
+compress_stage_frame(int i, void *thunk)
+{
+  Gif_CompressStage *stage = (Gif_CompressStage *) thunk;
+  Gif_Image *gfi = stage->gfs->images[i];
+  Gif_Writer *grr = &stage->frames[i];
+  Gif_CodeTable gfc;
+  uint8_t min_code_bits;
+  int ok = 0;
+
+  grr->v = NULL;
+  grr->pos = grr->cap = 0;
+  grr->byte_putter = memory_byte_putter;
+  grr->block_putter = memory_block_putter;
+  grr->gcinfo = stage->gcinfo;
+  grr->global_size = stage->global_size;
+  grr->local_size = get_color_table_size(stage->gfs, gfi, grr);
+  grr->errors = 0;
+
+  /* same test as write_image */
+  min_code_bits = calculate_min_code_bits(gfi, grr);
+  if (gfi->compressed
+      && (!(grr->gcinfo.flags & GIF_WRITE_CAREFUL_MIN_CODE_SIZE)
+	  || gfi->compressed[0] == min_code_bits))
+    return 1;
+
+  gfc_init(&gfc);
+  if (gfc.nodes && gfc.links)
+    ok = write_compressed_data(gfi, min_code_bits, &gfc, grr);
+  if (!ok || !grr->v) {
+    Gif_DeleteArray(grr->v);
+    grr->v = NULL;
+    ok = 0;
+  }
+  Gif_DeleteArray(gfc.nodes);
+  Gif_DeleteArray(gfc.links);
+  return ok;
+}
+
+
 static int
 write_image(Gif_Stream *gfs, Gif_Image *gfi, Gif_CodeTable *gfc,
-            Gif_Writer *grr)
+            Gif_Writer *grr, Gif_Writer *precompressed)
 {
   uint8_t min_code_bits, packed = 0;
   grr->local_size = get_color_table_size(gfs, gfi, grr);
@@ -647,6 +833,13 @@ write_image(Gif_Stream *gfs, Gif_Image *gfi, Gif_CodeTable *gfc,
   if (grr->local_size > 0)
     write_color_table(gfi->local, grr->local_size, grr);
 
+  if (precompressed && precompressed->v) {
+    write_compressed_blocks(precompressed->v, precompressed->pos, grr);
+    Gif_DeleteArray(precompressed->v);
+    precompressed->v = NULL;
+    return 1;
+  }
+
   /* calculate min_code_bits here (because calculation may involve
      recompression, if GIF_WRITE_CAREFUL_MIN_CODE_SIZE is true) */
   min_code_bits = calculate_min_code_bits(gfi, grr);
@@ -656,17 +849,9 @@ write_image(Gif_Stream *gfs, Gif_Image *gfi, Gif_CodeTable *gfc,
      but modify the uncompressed data anyway. That sucks. */
   if (gfi->compressed
       && (!(grr->gcinfo.flags & GIF_WRITE_CAREFUL_MIN_CODE_SIZE)
-          || gfi->compressed[0] == min_code_bits)) {
-    uint8_t *compressed = gfi->compressed;
-    uint32_t compressed_len = gfi->compressed_len;
-    while (compressed_len > 0) {
-      uint16_t amt = (compressed_len > 0x7000 ? 0x7000 : compressed_len);
-      gifputblock(compressed, amt, grr);
-      compressed += amt;
-      compressed_len -= amt;
-    }
-
-  } else
+          || gfi->compressed[0] == min_code_bits))
+    write_compressed_blocks(gfi->compressed, gfi->compressed_len, grr);
+  else
     write_compressed_data(gfi, min_code_bits, gfc, grr);
 
   return 1;
@@ -782,70 +967,68 @@ write_generic_extension(Gif_Extension *gfex, Gif_Writer *grr)
       gifputblock((const uint8_t *)gfex->application, len, grr);
     }
   }
-  while (pos + 255 < gfex->length) {
-    gifputbyte(255, grr);
-    gifputblock(gfex->data + pos, 255, grr);
-    pos += 255;
-  }
-  if (pos < gfex->length) {
-    uint32_t len = gfex->length - pos;
-    gifputbyte(len, grr);
-    gifputblock(gfex->data + pos, len, grr);
+  if (gfex->packetized)	/* already in sub-blocks */
+    write_compressed_blocks(gfex->data, gfex->length, grr);
+  else {
+    while (pos + 255 < gfex->length) {
+      gifputbyte(255, grr);
+      gifputblock(gfex->data + pos, 255, grr);
+      pos += 255;
+    }
+    if (pos < gfex->length) {
+      uint32_t len = gfex->length - pos;
+      gifputbyte(len, grr);
+      gifputblock(gfex->data + pos, len, grr);
+    }
   }
   gifputbyte(0, grr);
 }
 
 
-static int
-write_gif(Gif_Stream *gfs, Gif_Writer *grr)
+static void
+write_gif_header(Gif_Stream *gfs, Gif_Writer *grr)
 {
-  int ok = 0;
+  uint8_t isgif89a = 0;
   int i;
-  Gif_Image *gfi;
-  Gif_Extension *gfex = gfs->extensions;
-  Gif_CodeTable gfc;
-
-  gfc_init(&gfc);
-  if (!gfc.nodes || !gfc.links)
-    goto done;
-
-  {
-    uint8_t isgif89a = 0;
-    if (gfs->comment || gfs->loopcount > -1)
+  if (gfs->comment || gfs->loopcount > -1)
+    isgif89a = 1;
+  for (i = 0; i < gfs->nimages && !isgif89a; i++) {
+    Gif_Image *gfi = gfs->images[i];
+    if (gfi->identifier || gfi->transparent != -1 || gfi->disposal ||
+	gfi->delay || gfi->comment)
       isgif89a = 1;
-    for (i = 0; i < gfs->nimages && !isgif89a; i++) {
-      gfi = gfs->images[i];
-      if (gfi->identifier || gfi->transparent != -1 || gfi->disposal ||
-	  gfi->delay || gfi->comment)
-	isgif89a = 1;
-    }
-    if (isgif89a)
-      gifputblock((const uint8_t *)"GIF89a", 6, grr);
-    else
-      gifputblock((const uint8_t *)"GIF87a", 6, grr);
   }
+  if (isgif89a)
+    gifputblock((const uint8_t *)"GIF89a", 6, grr);
+  else
+    gifputblock((const uint8_t *)"GIF87a", 6, grr);
 
   write_logical_screen_descriptor(gfs, grr);
 
   if (gfs->loopcount > -1)
     write_netscape_loop_extension(gfs->loopcount, grr);
+}
 
-  for (i = 0; i < gfs->nimages; i++) {
-    Gif_Image *gfi = gfs->images[i];
-    while (gfex && gfex->position == i) {
-      write_generic_extension(gfex, grr);
-      gfex = gfex->next;
-    }
-    if (gfi->comment)
-      write_comment_extensions(gfi->comment, grr);
-    if (gfi->identifier)
-      write_name_extension(gfi->identifier, grr);
-    if (gfi->transparent != -1 || gfi->disposal || gfi->delay)
-      write_graphic_control_extension(gfi, grr);
-    if (!write_image(gfs, gfi, &gfc, grr))
-      goto done;
+/* Write the extensions that precede image number 'i', which is 'gfi'. */
+static void
+write_image_extensions(Gif_Image *gfi, int i, Gif_Extension **gfexp,
+		       Gif_Writer *grr)
+{
+  while (*gfexp && (*gfexp)->position == i) {
+    write_generic_extension(*gfexp, grr);
+    *gfexp = (*gfexp)->next;
   }
+  if (gfi->comment)
+    write_comment_extensions(gfi->comment, grr);
+  if (gfi->identifier)
+    write_name_extension(gfi->identifier, grr);
+  if (gfi->transparent != -1 || gfi->disposal || gfi->delay)
+    write_graphic_control_extension(gfi, grr);
+}
 
+static void
+write_gif_trailer(Gif_Stream *gfs, Gif_Extension *gfex, Gif_Writer *grr)
+{
   while (gfex) {
     write_generic_extension(gfex, grr);
     gfex = gfex->next;
@@ -854,9 +1037,70 @@ write_gif(Gif_Stream *gfs, Gif_Writer *grr)
     write_comment_extensions(gfs->comment, grr);
 
   gifputbyte(';', grr);
+}
+
+
+static int
+write_gif(Gif_Stream *gfs, Gif_Writer *grr)
+{
+  int ok = 0;
+  int i;
+  Gif_Extension *gfex = gfs->extensions;
+  Gif_CodeTable gfc;
+  Gif_CompressStage stage;
+  Gif_FrameTask *task = 0;
+
+  gfc_init(&gfc);
+  stage.frames = 0;
+  if (!gfc.nodes || !gfc.links)
+    goto done;
+
+  write_gif_header(gfs, grr);
+
+  /* Compress up to two frames per thread ahead of the writer */
+  if (grr->gcinfo.threads > 1 && gfs->nimages > 1) {
+    stage.gfs = gfs;
+    stage.gcinfo = grr->gcinfo;
+    stage.global_size = grr->global_size;
+    stage.frames = Gif_NewArray(Gif_Writer, gfs->nimages);
+    /* frames that never start, after an error or cancel, have no buffer */
+    for (i = 0; stage.frames && i < gfs->nimages; i++)
+      stage.frames[i].v = 0;
+    if (stage.frames)
+      task = Gif_NewFrameTask(gfs->nimages, grr->gcinfo.threads,
+			      2 * grr->gcinfo.threads,
+			      compress_stage_frame, &stage);
+  }
+
+  for (i = 0; i < gfs->nimages; i++) {
+    Gif_Image *gfi = gfs->images[i];
+    if (grr->gcinfo.progress
+	&& (*grr->gcinfo.progress)("write", i, gfs->nimages,
+				   grr->gcinfo.progress_thunk))
+      goto done;
+    write_image_extensions(gfi, i, &gfex, grr);
+    if (task)
+      Gif_WaitFrameTask(task, i);
+    if (!write_image(gfs, gfi, &gfc, grr, task ? &stage.frames[i] : 0))
+      goto done;
+  }
+
+  write_gif_trailer(gfs, gfex, grr);
+  if (grr->gcinfo.progress)
+    (*grr->gcinfo.progress)("write", gfs->nimages, gfs->nimages,
+			    grr->gcinfo.progress_thunk);
   ok = 1;
 
  done:
+  if (task) {
+    if (!ok)
+      Gif_CancelFrameTask(task);
+    Gif_FinishFrameTask(task);
+    for (i = 0; i < gfs->nimages; i++)
+      Gif_DeleteArray(stage.frames[i].v);
+    Gif_DeleteFrameTask(task);
+  }
+  Gif_DeleteArray(stage.frames);
   Gif_DeleteArray(gfc.nodes);
   Gif_DeleteArray(gfc.links);
   return ok;
@@ -880,6 +1124,74 @@ Gif_FullWriteFile(Gif_Stream *gfs, const Gif_CompressInfo *gcinfo,
 }
 
 
+/* An incremental writer writes a stream's header when created, then one
+   image per call, then the trailer. The header's GIF version and global
+   colormap come from the stream as it is at Init; the caller must not
+   change the screen, global colormap, background, or loop count, and must
+   not add GIF89a features (delays, disposals, transparency, names,
+   comments) if the stream had none at Init. Images must be passed in
+   stream order. Each image is written as it stands, so an image with
+   compressed data is not recompressed. */
+
+struct Gif_IncrementalWriter {
+  Gif_Writer grr;
+  Gif_CodeTable gfc;
+  Gif_Extension *gfex;
+  int nimages;
+};
+
+Gif_IncrementalWriter *
+Gif_IncrementalWriteFileInit(Gif_Stream *gfs, const Gif_CompressInfo *gcinfo,
+			     FILE *f)
+{
+  Gif_IncrementalWriter *giw = Gif_New(Gif_IncrementalWriter);
+  if (!giw)
+    return 0;
+  gfc_init(&giw->gfc);
+  if (!giw->gfc.nodes || !giw->gfc.links) {
+    Gif_DeleteArray(giw->gfc.nodes);
+    Gif_DeleteArray(giw->gfc.links);
+    Gif_Delete(giw);
+    return 0;
+  }
+  giw->grr.f = f;
+  giw->grr.byte_putter = file_byte_putter;
+  giw->grr.block_putter = file_block_putter;
+  if (gcinfo)
+    giw->grr.gcinfo = *gcinfo;
+  else
+    Gif_InitCompressInfo(&giw->grr.gcinfo);
+  giw->grr.errors = 0;
+  giw->gfex = gfs->extensions;
+  giw->nimages = 0;
+  write_gif_header(gfs, &giw->grr);
+  return giw;
+}
+
+int
+Gif_IncrementalWriteImage(Gif_IncrementalWriter *giw, Gif_Stream *gfs,
+			  Gif_Image *gfi)
+{
+  write_image_extensions(gfi, giw->nimages, &giw->gfex, &giw->grr);
+  giw->nimages++;
+  return write_image(gfs, gfi, &giw->gfc, &giw->grr, 0);
+}
+
+/* Write the trailer, unless 'complete' is 0, and free the writer. An
+   incomplete file lacks the trailer, and perhaps some images. */
+int
+Gif_IncrementalWriteComplete(Gif_IncrementalWriter *giw, Gif_Stream *gfs,
+			     int complete)
+{
+  if (complete)
+    write_gif_trailer(gfs, giw->gfex, &giw->grr);
+  Gif_DeleteArray(giw->gfc.nodes);
+  Gif_DeleteArray(giw->gfc.links);
+  Gif_Delete(giw);
+  return complete;
+}
+
+
 #undef Gif_CompressImage
 #undef Gif_WriteFile
 
@@ -287,6 +287,7 @@ put_sub_image_colormap(Gif_XContext *gfx, Gif_Image *gfi, Gif_Colormap *gfcm,
     Gif_UncompressImage(gfi);
     release_uncompressed = 1;
   }
+  Gif_ApplyIndexMap(gfi);
 
   /* Check subimage dimensions */
   if (width <= 0 || height <= 0 || left < 0 || top < 0
@@ -477,6 +478,7 @@ Gif_XSubMask(Gif_XContext *gfx, Gif_Image *gfi,
     Gif_UncompressImage(gfi);
     release_uncompressed = 1;
   }
+  Gif_ApplyIndexMap(gfi);
 
   /* Create the X image */
   ximage =
@@ -69,8 +69,8 @@ mark_used_colors(Gif_Stream *gfs, Gif_Image *gfi, Gt_Crop *crop,
 	combine_crop(&c, crop, gfi);
 	l = c.x;
 	t = c.y;
-	r = l + c.w;
-	b = t + c.h;
+	r = l + (c.w > 0 ? c.w : 0);
+	b = t + (c.h > 0 ? c.h : 0);
     } else {
 	l = t = 0;
 	r = gfi->width;
@@ -226,6 +226,22 @@ merge_comments(Gif_Comment *destc, Gif_Comment *srcc)
 }
 
 
+/* Return 1 if 'a' and 'b' have the same colors. If an image uses the
+   transparent slot just past its colormap's colors, the other image must
+   use an equal slot. */
+static int
+colormaps_equal(const Gif_Colormap *a, const Gif_Colormap *b,
+		int a_uses_slot, int b_uses_slot)
+{
+  int i;
+  for (i = 0; i < a->ncol; i++)
+    if (!GIF_COLOREQ(&a->col[i], &b->col[i]))
+      return 0;
+  if (a_uses_slot && b_uses_slot)
+    return GIF_COLOREQ(&a->col[i], &b->col[i]);
+  return !a_uses_slot && !b_uses_slot;
+}
+
 Gif_Image *
 merge_image(Gif_Stream *dest, Gif_Stream *src, Gif_Image *srci,
 	    int same_compressed_ok)
@@ -246,13 +262,14 @@ merge_image(Gif_Stream *dest, Gif_Stream *src, Gif_Image *srci,
   Gif_Image *desti;
 
   /* mark colors that were actually used in this image */
+  Gif_ApplyIndexMap(srci);
   islocal = srci->local != 0;
   imagecm = islocal ? srci->local : src->global;
   if (!imagecm)
     fatal_error("no global or local colormap for source image");
   imagecol = imagecm->col;
   {
-      int ncol = imagecm->ncol, nleft = 256 - ncol;
+      int ncol = imagecm->ncol, nleft = ncol;
       int w = srci->width, h = srci->height, i, j;
       for (i = 0; i != ncol; ++i)
           imagecol[i].haspixel &= ~4;
@@ -332,6 +349,22 @@ merge_image(Gif_Stream *dest, Gif_Stream *src, Gif_Image *srci,
   }
 
   assert(destcm->ncol <= 256);
+
+  /* Frames that shared a local colormap on input often need equal local
+     colormaps now; share those too, so later passes see one colormap. */
+  if (localcm && dest->nimages > 0) {
+    Gif_Image *previ = dest->images[dest->nimages - 1];
+    Gif_Colormap *prevcm = previ->local;
+    if (prevcm && prevcm->ncol == localcm->ncol
+	&& colormaps_equal(prevcm, localcm,
+			   previ->transparent >= prevcm->ncol,
+			   srci->transparent >= 0
+			   && map[srci->transparent] >= localcm->ncol)) {
+      Gif_DeleteColormap(localcm);
+      localcm = prevcm;
+    }
+  }
+
   /* Make the new image. */
   desti = Gif_NewImage();
 
@@ -347,6 +380,8 @@ merge_image(Gif_Stream *dest, Gif_Stream *src, Gif_Image *srci,
   desti->width = srci->width;
   desti->height = srci->height;
   desti->local = localcm;
+  if (localcm)
+    localcm->refcount++;
 
   if (srci->comment) {
     desti->comment = Gif_NewComment();
@@ -362,11 +397,22 @@ merge_image(Gif_Stream *dest, Gif_Stream *src, Gif_Image *srci,
     int i, j;
     Gif_CreateUncompressedImage(desti);
 
-    if (trivial_map)
+    if (trivial_map && Gif_ImageDense(srci))
+      memcpy(Gif_ImagePixels(desti), Gif_ImagePixels(srci),
+	     desti->width * desti->height);
+
+    else if (trivial_map)
       for (j = 0; j < desti->height; j++)
 	memcpy(desti->img[j], srci->img[j], desti->width);
 
-    else
+    else if (Gif_ImageDense(srci)) {
+      const uint8_t *srcdata = Gif_ImagePixels(srci);
+      uint8_t *destdata = Gif_ImagePixels(desti);
+      uint8_t *enddata = destdata + desti->width * desti->height;
+      for (; destdata != enddata; srcdata++, destdata++)
+	*destdata = map[*srcdata];
+
+    } else
       for (j = 0; j < desti->height; j++) {
 	uint8_t *srcdata = srci->img[j];
 	uint8_t *destdata = desti->img[j];
@@ -11,6 +11,7 @@
 #include "gifsicle.h"
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
 
 typedef struct {
   int left;
@@ -27,11 +28,16 @@ typedef struct {
   uint32_t size;
   uint8_t disposal;
   int transparent;
-  uint8_t *needed_colors;
+  uint16_t *needed_colors;	/* all_colormap indices used by this frame,
+				   in order: the required ones, then those
+				   that may be replaced by transparency */
   uint16_t required_color_count;
+  int needed_color_count;
   int32_t active_penalty;
   int32_t global_penalty;
   int32_t colormap_penalty;
+  uint64_t screen_hash;		/* hash of the composited screen, for
+				   -Ofold-loops */
   Gif_Image *new_gfi;
 } Gif_OptData;
 
@@ -51,13 +57,19 @@ static Gif_Colormap *out_global_map;
 #define TRANSP (0)
 static uint16_t background;
 #define NOT_IN_OUT_GLOBAL (256)
-static uint16_t *last_data;
-static uint16_t *this_data;
-static uint16_t *next_data;
 static int image_index;
 
 static int gif_color_count;
 
+/* The screen buffers last_data, this_data and next_data hold all_colormap
+   indices. They're declared in optscreen.h, 8 bits wide when all_colormap
+   fits, 16 bits wide otherwise. */
+
+/* Scratch space for get_used_colors: need_scratch[] is all zeros between
+   frames; need_touched[] lists the entries a frame has set */
+static uint8_t *need_scratch;
+static uint16_t *need_touched;
+
 
 /*****
  * SIMPLE HELPERS
@@ -141,6 +153,14 @@ permuting_sorter_down(const void *v1, const void *v2)
   return (permuting_sort_values[*n2] - permuting_sort_values[*n1]);
 }
 
+static int
+uint16_sorter(const void *v1, const void *v2)
+{
+  const uint16_t *n1 = (const uint16_t *)v1;
+  const uint16_t *n2 = (const uint16_t *)v2;
+  return *n1 - *n2;
+}
+
 static uint16_t *
 sort_permutation(uint16_t *perm, int size, int32_t *values, int is_down)
 {
@@ -170,291 +190,11 @@ safe_bounds(Gif_Image *area)
   return b;
 }
 
-static void
-copy_data_area(uint16_t *dst, uint16_t *src, Gif_Image *area)
-{
-  Gif_OptBounds ob;
-  int y;
-  if (!area)
-    return;
-  ob = safe_bounds(area);
-  dst += ob.top * screen_width + ob.left;
-  src += ob.top * screen_width + ob.left;
-  for (y = 0; y < ob.height; y++) {
-    memcpy(dst, src, sizeof(uint16_t) * ob.width);
-    dst += screen_width;
-    src += screen_width;
-  }
-}
-
-static void
-copy_data_area_subimage(uint16_t *dst, uint16_t *src, Gif_OptData *area)
-{
-  Gif_Image img;
-  img.left = area->left;
-  img.top = area->top;
-  img.width = area->width;
-  img.height = area->height;
-  copy_data_area(dst, src, &img);
-}
-
-static void
-fill_data_area(uint16_t *dst, uint16_t value, Gif_Image *area)
-{
-  int x, y;
-  Gif_OptBounds ob = safe_bounds(area);
-  dst += ob.top * screen_width + ob.left;
-  for (y = 0; y < ob.height; y++) {
-    for (x = 0; x < ob.width; x++)
-      dst[x] = value;
-    dst += screen_width;
-  }
-}
-
-static void
-fill_data_area_subimage(uint16_t *dst, uint16_t value, Gif_OptData *area)
-{
-  Gif_Image img;
-  img.left = area->left;
-  img.top = area->top;
-  img.width = area->width;
-  img.height = area->height;
-  fill_data_area(dst, value, &img);
-}
-
-static void
-erase_screen(uint16_t *dst)
-{
-  uint32_t i;
-  uint32_t screen_size = screen_width * screen_height;
-  for (i = 0; i < screen_size; i++)
-    *dst++ = background;
-}
-
-/*****
- * APPLY A GIF FRAME OR DISPOSAL TO AN IMAGE DESTINATION
- **/
-
-static void
-apply_frame(uint16_t *dst, Gif_Image *gfi, int replace, int save_uncompressed)
-{
-  int i, y, was_compressed = 0;
-  uint16_t map[256];
-  Gif_Colormap *colormap = gfi->local ? gfi->local : in_global_map;
-  Gif_OptBounds ob = safe_bounds(gfi);
-
-  if (!gfi->img) {
-    was_compressed = 1;
-    Gif_UncompressImage(gfi);
-  }
-
-  /* make sure transparency maps to TRANSP */
-  for (i = 0; i < colormap->ncol; i++)
-    map[i] = colormap->col[i].pixel;
-  /* out-of-bounds colors map to 0, for the sake of argument */
-  for (i = colormap->ncol; i < 256; i++)
-    map[i] = colormap->col[0].pixel;
-  if (gfi->transparent >= 0 && gfi->transparent < 256)
-    map[gfi->transparent] = TRANSP;
-  else
-    replace = 1;
-
-  /* map the image */
-  dst += ob.left + ob.top * screen_width;
-  for (y = 0; y < ob.height; y++) {
-    uint8_t *gfi_pointer = gfi->img[y];
-    int x;
-
-    if (replace)
-      for (x = 0; x < ob.width; x++)
-	dst[x] = map[gfi_pointer[x]];
-    else
-      for (x = 0; x < ob.width; x++) {
-	uint16_t new_pixel = map[gfi_pointer[x]];
-	if (new_pixel != TRANSP)
-	    dst[x] = new_pixel;
-      }
-
-    dst += screen_width;
-  }
-
-  if (was_compressed && !save_uncompressed)
-    Gif_ReleaseUncompressedImage(gfi);
-}
-
-static void
-apply_frame_disposal(uint16_t *into_data, uint16_t *from_data,
-		     uint16_t *previous_data, Gif_Image *gfi)
-{
-  int screen_size = screen_width * screen_height;
-  if (gfi->disposal == GIF_DISPOSAL_PREVIOUS)
-    memcpy(into_data, previous_data, sizeof(uint16_t) * screen_size);
-  else {
-    memcpy(into_data, from_data, sizeof(uint16_t) * screen_size);
-    if (gfi->disposal == GIF_DISPOSAL_BACKGROUND)
-      fill_data_area(into_data, background, gfi);
-  }
-}
-
 
 /*****
  * FIND THE SMALLEST BOUNDING RECTANGLE ENCLOSING ALL CHANGES
  **/
 
-/* find_difference_bounds: Find the smallest rectangular area containing all
-   the changes and store it in 'bounds'. */
-
-static void
-find_difference_bounds(Gif_OptData *bounds, Gif_Image *gfi, Gif_Image *last)
-{
-  int lf, rt, lf_min, rt_max, tp, bt, x, y;
-  Gif_OptBounds ob;
-
-  /* 1.Aug.99 - use current bounds if possible, since this function is a speed
-     bottleneck */
-  if (!last || last->disposal == GIF_DISPOSAL_NONE
-      || last->disposal == GIF_DISPOSAL_ASIS) {
-    ob = safe_bounds(gfi);
-    lf_min = ob.left;
-    rt_max = ob.left + ob.width - 1;
-    tp = ob.top;
-    bt = ob.top + ob.height - 1;
-  } else {
-    lf_min = 0;
-    rt_max = screen_width - 1;
-    tp = 0;
-    bt = screen_height - 1;
-  }
-
-  for (; tp < screen_height; tp++)
-    if (memcmp(last_data + screen_width * tp, this_data + screen_width * tp,
-	       screen_width * sizeof(uint16_t)) != 0)
-      break;
-  for (; bt >= tp; bt--)
-    if (memcmp(last_data + screen_width * bt, this_data + screen_width * bt,
-	       screen_width * sizeof(uint16_t)) != 0)
-      break;
-
-  lf = screen_width;
-  rt = 0;
-  for (y = tp; y <= bt; y++) {
-    uint16_t *ld = last_data + screen_width * y;
-    uint16_t *td = this_data + screen_width * y;
-    for (x = lf_min; x < lf; x++)
-      if (ld[x] != td[x])
-	break;
-    lf = x;
-
-    for (x = rt_max; x > rt; x--)
-      if (ld[x] != td[x])
-	break;
-    rt = x;
-  }
-
-  /* 19.Aug.1999 - handle case when there's no difference between frames */
-  if (tp > bt) {
-    tp = bt = gfi->top;
-    lf = rt = gfi->left;
-  }
-
-  bounds->left = lf;
-  bounds->top = tp;
-  bounds->width = rt + 1 - lf;
-  bounds->height = bt + 1 - tp;
-}
-
-
-/* expand_difference_bounds: If the current image has background disposal and
-   the background is transparent, we must expand the difference bounds to
-   include any blanked (newly transparent) pixels that are still transparent
-   in the next image. This function does that by comparing this_data and
-   next_data. The new bounds are passed and stored in 'bounds'; the image's
-   old bounds, which are also the maximum bounds, are passed in
-   'this_bounds'. */
-
-static int
-expand_difference_bounds(Gif_OptData *bounds, Gif_Image *this_bounds)
-{
-  int x, y, expanded = 0;
-
-  int lf = bounds->left, tp = bounds->top,
-      rt = lf + bounds->width - 1, bt = tp + bounds->height - 1;
-
-  Gif_OptBounds ob = safe_bounds(this_bounds);
-  int tlf = ob.left, ttp = ob.top,
-      trt = ob.left + ob.width - 1, tbt = ob.top + ob.height - 1;
-
-  if (lf > rt || tp > bt)
-    lf = 0, tp = 0, rt = screen_width - 1, bt = screen_height - 1;
-
-  for (y = ttp; y < tp; y++) {
-    uint16_t *now = this_data + screen_width * y;
-    uint16_t *next = next_data + screen_width * y;
-    for (x = tlf; x <= trt; x++)
-      if (now[x] != TRANSP && next[x] == TRANSP) {
-	expanded = 1;
-	goto found_top;
-      }
-  }
- found_top:
-  tp = y;
-
-  for (y = tbt; y > bt; y--) {
-    uint16_t *now = this_data + screen_width * y;
-    uint16_t *next = next_data + screen_width * y;
-    for (x = tlf; x <= trt; x++)
-      if (now[x] != TRANSP && next[x] == TRANSP) {
-	expanded = 1;
-	goto found_bottom;
-      }
-  }
- found_bottom:
-  bt = y;
-
-  for (x = tlf; x < lf; x++) {
-    uint16_t *now = this_data + x;
-    uint16_t *next = next_data + x;
-    for (y = tp; y <= bt; y++)
-      if (now[y*screen_width] != TRANSP && next[y*screen_width] == TRANSP) {
-	expanded = 1;
-	goto found_left;
-      }
-  }
- found_left:
-  lf = x;
-
-  for (x = trt; x > rt; x--) {
-    uint16_t *now = this_data + x;
-    uint16_t *next = next_data + x;
-    for (y = tp; y <= bt; y++)
-      if (now[y*screen_width] != TRANSP && next[y*screen_width] == TRANSP) {
-	expanded = 1;
-	goto found_right;
-      }
-  }
- found_right:
-  rt = x;
-
-  if (!expanded)
-    for (y = tp; y <= bt; ++y) {
-      uint16_t *now = this_data + y*screen_width;
-      uint16_t *next = next_data + y*screen_width;
-      for (x = lf; x <= rt; ++x)
-	if (now[x] != TRANSP && next[x] == TRANSP) {
-	  expanded = 1;
-	  goto found_expanded;
-	}
-    }
-
- found_expanded:
-  bounds->left = lf;
-  bounds->top = tp;
-  bounds->width = rt + 1 - lf;
-  bounds->height = bt + 1 - tp;
-  return expanded;
-}
-
-
 /* fix_difference_bounds: make sure the image isn't 0x0. */
 
 static void
@@ -480,198 +220,6 @@ fix_difference_bounds(Gif_OptData *bounds)
 #define REQUIRED	2
 #define REPLACE_TRANSP	1
 
-/* get_used_colors: mark which colors are needed by a given image. Returns a
-   need array so that need[j] == REQUIRED if the output colormap must
-   include all_color j; REPLACE_TRANSP if it should be replaced by
-   transparency; and 0 if it's not in the image at all.
-
-   If use_transparency > 0, then a pixel which was the same in the last frame
-   may be replaced with transparency. If use_transparency == 2, transparency
-   MUST be set. (This happens on the first image if the background should be
-   transparent.) */
-
-static void
-get_used_colors(Gif_OptData *bounds, int use_transparency)
-{
-  int top = bounds->top, width = bounds->width, height = bounds->height;
-  int i, x, y;
-  int all_ncol = all_colormap->ncol;
-  uint8_t *need = Gif_NewArray(uint8_t, all_ncol);
-
-  for (i = 0; i < all_ncol; i++)
-    need[i] = 0;
-
-  /* set elements that are in the image. need == 2 means the color
-     must be in the map; need == 1 means the color may be replaced by
-     transparency. */
-  for (y = top; y < top + height; y++) {
-    uint16_t *data = this_data + screen_width * y + bounds->left;
-    uint16_t *last = last_data + screen_width * y + bounds->left;
-    for (x = 0; x < width; x++) {
-      if (data[x] != last[x])
-	need[data[x]] = REQUIRED;
-      else if (need[data[x]] == 0)
-	need[data[x]] = REPLACE_TRANSP;
-    }
-  }
-  if (need[TRANSP])
-    need[TRANSP] = REQUIRED;
-
-  /* check for too many colors; also force transparency if needed */
-  {
-    int count[3];
-    /* Count distinct pixels in each category */
-    count[0] = count[1] = count[2] = 0;
-    for (i = 0; i < all_ncol; i++)
-      count[need[i]]++;
-    /* If use_transparency is large and there's room, add transparency */
-    if (use_transparency > 1 && !need[TRANSP] && count[REQUIRED] < 256) {
-      need[TRANSP] = REQUIRED;
-      count[REQUIRED]++;
-    }
-    /* If too many "potentially transparent" pixels, force transparency */
-    if (count[REPLACE_TRANSP] + count[REQUIRED] > 256)
-      use_transparency = 1;
-    /* Make sure transparency is marked necessary if we use it */
-    if (count[REPLACE_TRANSP] > 0 && use_transparency && !need[TRANSP]) {
-      need[TRANSP] = REQUIRED;
-      count[REQUIRED]++;
-    }
-    /* If not using transparency, change "potentially transparent" pixels to
-       "actually used" pixels */
-    if (!use_transparency) {
-      for (i = 0; i < all_ncol; i++)
-	if (need[i] == REPLACE_TRANSP)
-	  need[i] = REQUIRED;
-      count[REQUIRED] += count[REPLACE_TRANSP];
-    }
-    /* If too many "actually used" pixels, fail miserably */
-    if (count[REQUIRED] > 256)
-      fatal_error("more than 256 colors required in a frame", count[REQUIRED]);
-    /* If we can afford to have transparency, and we want to use it, then
-       include it */
-    if (count[REQUIRED] < 256 && use_transparency && !need[TRANSP]) {
-      need[TRANSP] = REQUIRED;
-      count[REQUIRED]++;
-    }
-    bounds->required_color_count = count[REQUIRED];
-  }
-
-  bounds->needed_colors = need;
-}
-
-
-/*****
- * FIND SUBIMAGES AND COLORS USED
- **/
-
-static void
-create_subimages(Gif_Stream *gfs, int optimize_flags, int save_uncompressed)
-{
-  int screen_size;
-  Gif_Image *last_gfi;
-  int next_data_valid;
-  uint16_t *previous_data = 0;
-
-  screen_size = screen_width * screen_height;
-
-  next_data = Gif_NewArray(uint16_t, screen_size);
-  next_data_valid = 0;
-
-  /* do first image. Remember to uncompress it if necessary */
-  erase_screen(last_data);
-  erase_screen(this_data);
-  last_gfi = 0;
-
-  /* PRECONDITION: last_data, previous_data -- garbage
-     this_data -- equal to image data after disposal of previous image
-     next_data -- equal to image data for next image if next_image_valid */
-  for (image_index = 0; image_index < gfs->nimages; image_index++) {
-    Gif_Image *gfi = gfs->images[image_index];
-    Gif_OptData *subimage = new_opt_data();
-
-    /* save previous data if necessary */
-    if (gfi->disposal == GIF_DISPOSAL_PREVIOUS) {
-      if (!previous_data)
-	previous_data = Gif_NewArray(uint16_t, screen_size);
-      memcpy(previous_data, this_data, sizeof(uint16_t) * screen_size);
-    }
-
-    /* set this_data equal to the current image */
-    if (next_data_valid) {
-      uint16_t *temp = this_data;
-      this_data = next_data;
-      next_data = temp;
-      next_data_valid = 0;
-    } else
-      apply_frame(this_data, gfi, 0, save_uncompressed);
-
-    /* find minimum area of difference between this image and last image */
-    subimage->disposal = GIF_DISPOSAL_ASIS;
-    if (image_index > 0)
-      find_difference_bounds(subimage, gfi, last_gfi);
-    else {
-      Gif_OptBounds ob = safe_bounds(gfi);
-      subimage->left = ob.left;
-      subimage->top = ob.top;
-      subimage->width = ob.width;
-      subimage->height = ob.height;
-    }
-
-    /* might need to expand difference border if transparent background &
-       background disposal */
-    if ((gfi->disposal == GIF_DISPOSAL_BACKGROUND
-	 || gfi->disposal == GIF_DISPOSAL_PREVIOUS)
-	&& background == TRANSP
-	&& image_index < gfs->nimages - 1) {
-      /* set up next_data */
-      Gif_Image *next_gfi = gfs->images[image_index + 1];
-      apply_frame_disposal(next_data, this_data, previous_data, gfi);
-      apply_frame(next_data, next_gfi, 0, save_uncompressed);
-      next_data_valid = 1;
-      /* expand border as necessary */
-      if (expand_difference_bounds(subimage, gfi))
-	subimage->disposal = GIF_DISPOSAL_BACKGROUND;
-    }
-
-    fix_difference_bounds(subimage);
-
-    /* set map of used colors */
-    {
-      int use_transparency = (optimize_flags & GT_OPT_MASK) > 1 && image_index > 0;
-      if (image_index == 0 && background == TRANSP)
-	use_transparency = 2;
-      get_used_colors(subimage, use_transparency);
-    }
-
-    gfi->user_data = subimage;
-    last_gfi = gfi;
-
-    /* Apply optimized disposal to last_data and unoptimized disposal to
-       this_data. Before 9.Dec.1998 I applied unoptimized disposal uniformly
-       to both. This led to subtle bugs. After all, to determine bounds, we
-       want to compare the current image (only obtainable through unoptimized
-       disposal) with what WILL be left after the previous OPTIMIZED image's
-       disposal. This fix is repeated in create_new_image_data */
-    if (subimage->disposal == GIF_DISPOSAL_BACKGROUND)
-      fill_data_area_subimage(last_data, background, subimage);
-    else
-      copy_data_area_subimage(last_data, this_data, subimage);
-
-    if (last_gfi->disposal == GIF_DISPOSAL_BACKGROUND)
-      fill_data_area(this_data, background, last_gfi);
-    else if (last_gfi->disposal == GIF_DISPOSAL_PREVIOUS) {
-      uint16_t *temp = previous_data;
-      previous_data = this_data;
-      this_data = temp;
-    }
-  }
-
-  Gif_DeleteArray(next_data);
-  if (previous_data)
-    Gif_DeleteArray(previous_data);
-}
-
 
 /*****
  * CALCULATE OUTPUT GLOBAL COLORMAP
@@ -696,11 +244,10 @@ static void
 increment_penalties(Gif_OptData *opt, int32_t *penalty, int32_t delta)
 {
   int i;
-  int all_ncol = all_colormap->ncol;
-  uint8_t *need = opt->needed_colors;
-  for (i = 1; i < all_ncol; i++)
-    if (need[i] == REQUIRED)
-      penalty[i] += delta;
+  uint16_t *need = opt->needed_colors;
+  for (i = 0; i < opt->required_color_count; i++)
+    if (need[i] != TRANSP)
+      penalty[need[i]] += delta;
 }
 
 static void
@@ -710,7 +257,9 @@ create_out_global_map(Gif_Stream *gfs)
   int32_t *penalty = Gif_NewArray(int32_t, all_ncol);
   uint16_t *permute = Gif_NewArray(uint16_t, all_ncol);
   uint16_t *ordering = Gif_NewArray(uint16_t, all_ncol);
-  int cur_ncol, i, imagei;
+  int *user_start = Gif_NewArray(int, all_ncol + 1);
+  int *users, *user_pos;
+  int cur_ncol, i, j, imagei;
   int nglobal_all = (all_ncol <= 257 ? all_ncol - 1 : 256);
   int permutation_changed;
 
@@ -728,6 +277,27 @@ create_out_global_map(Gif_Stream *gfs)
       (all_ncol > 257 ? opt->colormap_penalty : opt->global_penalty);
   }
 
+  /* index the images that require each color, so removing a color only
+     visits those images: users[user_start[P] .. user_start[P+1]-1] */
+  for (i = 0; i <= all_ncol; i++)
+    user_start[i] = 0;
+  for (imagei = 0; imagei < gfs->nimages; imagei++) {
+    Gif_OptData *opt = (Gif_OptData *)gfs->images[imagei]->user_data;
+    for (j = 0; j < opt->required_color_count; j++)
+      user_start[opt->needed_colors[j] + 1]++;
+  }
+  for (i = 0; i < all_ncol; i++)
+    user_start[i + 1] += user_start[i];
+  users = Gif_NewArray(int, user_start[all_ncol] ? user_start[all_ncol] : 1);
+  user_pos = Gif_NewArray(int, all_ncol);
+  memcpy(user_pos, user_start, sizeof(int) * all_ncol);
+  for (imagei = 0; imagei < gfs->nimages; imagei++) {
+    Gif_OptData *opt = (Gif_OptData *)gfs->images[imagei]->user_data;
+    for (j = 0; j < opt->required_color_count; j++)
+      users[user_pos[opt->needed_colors[j]]++] = imagei;
+  }
+  Gif_DeleteArray(user_pos);
+
   /* set initial penalties for each color */
   for (i = 1; i < all_ncol; i++)
     penalty[i] = 0;
@@ -751,10 +321,9 @@ create_out_global_map(Gif_Stream *gfs)
     ordering[removed] = cur_ncol - 1;
 
     /* decrement penalties for colors that are out of the running */
-    for (imagei = 0; imagei < gfs->nimages; imagei++) {
-      Gif_OptData *opt = (Gif_OptData *)gfs->images[imagei]->user_data;
-      uint8_t *need = opt->needed_colors;
-      if (opt->global_penalty > 0 && need[removed] == REQUIRED) {
+    for (j = user_start[removed]; j < user_start[removed + 1]; j++) {
+      Gif_OptData *opt = (Gif_OptData *)gfs->images[users[j]]->user_data;
+      if (opt->global_penalty > 0) {
 	increment_penalties(opt, penalty, -opt->active_penalty);
 	opt->global_penalty = 0;
 	opt->colormap_penalty = (cur_ncol > 256 ? -1 : 0);
@@ -800,6 +369,8 @@ create_out_global_map(Gif_Stream *gfs)
   Gif_DeleteArray(penalty);
   Gif_DeleteArray(permute);
   Gif_DeleteArray(ordering);
+  Gif_DeleteArray(user_start);
+  Gif_DeleteArray(users);
 }
 
 
@@ -828,9 +399,11 @@ colormap_rgb_permutation_sorter(const void *v1, const void *v2)
    change or read it at all. */
 
 static uint8_t *
-prepare_colormap_map(Gif_Image *gfi, Gif_Colormap *into, uint8_t *need)
+prepare_colormap_map(Gif_Image *gfi, Gif_Colormap *into, Gif_OptData *opt)
 {
-  int i;
+  int i, j;
+  uint16_t *need = opt->needed_colors;
+  int nrequired = opt->required_color_count;
   int is_global = (into == out_global_map);
 
   int all_ncol = all_colormap->ncol;
@@ -848,10 +421,11 @@ prepare_colormap_map(Gif_Image *gfi, Gif_Colormap *into, uint8_t *need)
     into_used[i] = 0;
 
   /* go over all non-transparent global pixels which MUST appear
-     (need[P]==REQUIRED) and place them in 'into' */
-  for (i = 1; i < all_ncol; i++) {
+     (the required part of 'need') and place them in 'into' */
+  for (j = 0; j < nrequired; j++) {
     int val;
-    if (need[i] != REQUIRED)
+    i = need[j];
+    if (i == TRANSP)
       continue;
 
     /* fail if a needed pixel isn't in the global map */
@@ -881,7 +455,7 @@ prepare_colormap_map(Gif_Image *gfi, Gif_Colormap *into, uint8_t *need)
 
   /* now check for transparency */
   gfi->transparent = -1;
-  if (need[TRANSP]) {
+  if (nrequired > 0 && need[0] == TRANSP) {
     int transparent = -1;
 
     /* first, look for an unused index in 'into'. Pick the lowest one: the
@@ -908,9 +482,8 @@ prepare_colormap_map(Gif_Image *gfi, Gif_Colormap *into, uint8_t *need)
 
     /* change mapping */
     map[TRANSP] = transparent;
-    for (i = 1; i < all_ncol; i++)
-      if (need[i] == REPLACE_TRANSP)
-	map[i] = transparent;
+    for (j = nrequired; j < opt->needed_color_count; j++)
+      map[need[j]] = transparent;
 
     gfi->transparent = transparent;
   }
@@ -932,19 +505,19 @@ prepare_colormap_map(Gif_Image *gfi, Gif_Colormap *into, uint8_t *need)
    in this image's colormap. May set a local colormap on 'gfi'. */
 
 static uint8_t *
-prepare_colormap(Gif_Image *gfi, uint8_t *need)
+prepare_colormap(Gif_Image *gfi, Gif_OptData *opt)
 {
   uint8_t *map;
 
   /* try to map pixel values into the global colormap */
   Gif_DeleteColormap(gfi->local);
   gfi->local = 0;
-  map = prepare_colormap_map(gfi, out_global_map, need);
+  map = prepare_colormap_map(gfi, out_global_map, opt);
 
   if (!map) {
     /* that didn't work; add a local colormap. */
     gfi->local = Gif_NewFullColormap(0, 256);
-    map = prepare_colormap_map(gfi, gfi->local, need);
+    map = prepare_colormap_map(gfi, gfi->local, opt);
   }
 
   return map;
@@ -952,245 +525,768 @@ prepare_colormap(Gif_Image *gfi, uint8_t *need)
 
 
 /*****
- * CREATE OUTPUT FRAME DATA
+ * PASSES OVER SCREEN BUFFERS
+ **/
+
+/*****
+ * LOOP FOLDING
+ **/
+
+/* fold_loops: If the animation is several repeats of a shorter cycle -- the
+   same composited screens with the same delays -- keep one cycle and raise
+   the loop count to compensate. Called after create_subimages has set each
+   frame's screen_hash. Matching hashes only nominate a period; 'repeats'
+   recomposes the screens to confirm it. */
+
+static int
+extension_in_frames(Gif_Stream *gfs, int from, int to)
+{
+  Gif_Extension *gfex;
+  for (gfex = gfs->extensions; gfex; gfex = gfex->next)
+    if (gfex->position >= from && gfex->position < to)
+      return 1;
+  return 0;
+}
+
+static void
+fold_loops(Gif_Stream *gfs, int (*repeats)(Gif_Stream *, int, int),
+	   int save_uncompressed)
+{
+  int n = gfs->nimages, period, i, repeats_with_other_delays = 0;
+  long loopcount = gfs->loopcount;
+
+  for (period = 1; period <= n / 2; period++) {
+    int same_delays = 1;
+    /* extensions placed before a dropped frame would move to the trailer */
+    if (n % period || extension_in_frames(gfs, period, n))
+      continue;
+    for (i = period; i < n; i++) {
+      Gif_Image *gfi = gfs->images[i], *cycle_gfi = gfs->images[i - period];
+      if (((Gif_OptData *) gfi->user_data)->screen_hash
+	  != ((Gif_OptData *) cycle_gfi->user_data)->screen_hash
+	  || gfi->identifier || gfi->comment)
+	break;
+      if (gfi->delay != cycle_gfi->delay)
+	same_delays = 0;
+    }
+    if (i < n || !repeats(gfs, period, save_uncompressed))
+      continue;
+    else if (!same_delays) {
+      if (!repeats_with_other_delays)
+	repeats_with_other_delays = period;
+      continue;
+    }
+
+    /* GIF plays a loopcount-N animation N + 1 times; 0 means forever */
+    if (loopcount != 0) {
+      loopcount = (loopcount < 0 ? 1 : loopcount + 1) * (n / period) - 1;
+      if (loopcount > 0xFFFF)
+	return;
+    }
+    for (i = n - 1; i >= period; i--) {
+      delete_opt_data((Gif_OptData *) gfs->images[i]->user_data);
+      gfs->images[i]->user_data = 0;
+      Gif_RemoveImage(gfs, i);
+    }
+    gfs->loopcount = loopcount;
+    return;
+  }
+
+  if (repeats_with_other_delays)
+    warning(1, "frames repeat every %d frames, but delays differ; not folding",
+	    repeats_with_other_delays);
+}
+
+
+/*****
+ * ANALYSIS CACHE
+ * store and reload the results of create_subimages
  **/
 
-/* simple_frame_data: just copy the data from the image into the frame data.
-   No funkiness, no transparency, nothing */
+/* A cached subimage analysis is 5 header words (image count, all_colormap
+   size, screen width, screen height, background), then 6 words per frame
+   (left | top << 16, width | height << 16, disposal << 16 | required color
+   count, needed color count, and the low and high halves of the screen
+   hash), then each frame's needed colors as 16-bit words. */
+
+#define SUBIMAGE_CACHE_HEADER	5
+#define SUBIMAGE_CACHE_FRAME	6
+
+static uint64_t subimage_cache_digest;
+static uint32_t subimage_cache_param;
+
+static int
+load_cached_subimages(Gif_Stream *gfs)
+{
+  uint32_t size, *words, *w, nneeded = 0;
+  uint16_t *needed;
+  int i, ok;
+  uint8_t *data = analysis_cache_load(subimage_cache_digest, "opt",
+				      subimage_cache_param, &size);
+  if (!data)
+    return 0;
+
+  words = (uint32_t *) data;
+  ok = size >= (SUBIMAGE_CACHE_HEADER
+		+ SUBIMAGE_CACHE_FRAME * gfs->nimages) * 4
+    && words[0] == (uint32_t) gfs->nimages
+    && words[1] == (uint32_t) all_colormap->ncol
+    && words[2] == (uint32_t) screen_width
+    && words[3] == (uint32_t) screen_height
+    && words[4] == background;
+  for (i = 0, w = words + SUBIMAGE_CACHE_HEADER; ok && i < gfs->nimages;
+       i++, w += SUBIMAGE_CACHE_FRAME) {
+    ok = (w[0] & 0xFFFF) + (w[1] & 0xFFFF) <= (uint32_t) screen_width
+      && (w[0] >> 16) + (w[1] >> 16) <= (uint32_t) screen_height
+      && (w[2] & 0xFFFF) <= w[3]
+      && w[3] <= (uint32_t) all_colormap->ncol;
+    nneeded += w[3];
+  }
+  ok = ok && size == (SUBIMAGE_CACHE_HEADER
+		      + SUBIMAGE_CACHE_FRAME * gfs->nimages) * 4 + nneeded * 2;
+  needed = (uint16_t *) w;
+  for (i = 0; ok && i < (int) nneeded; i++)
+    ok = needed[i] < all_colormap->ncol;
+  if (!ok) {
+    Gif_DeleteArray(data);
+    return 0;
+  }
+
+  for (i = 0, w = words + SUBIMAGE_CACHE_HEADER; i < gfs->nimages;
+       i++, w += SUBIMAGE_CACHE_FRAME) {
+    Gif_OptData *subimage = new_opt_data();
+    subimage->left = w[0] & 0xFFFF;
+    subimage->top = w[0] >> 16;
+    subimage->width = w[1] & 0xFFFF;
+    subimage->height = w[1] >> 16;
+    subimage->disposal = w[2] >> 16;
+    subimage->required_color_count = w[2] & 0xFFFF;
+    subimage->needed_color_count = w[3];
+    subimage->screen_hash = w[4] | ((uint64_t) w[5] << 32);
+    subimage->needed_colors = Gif_NewArray(uint16_t, w[3] ? w[3] : 1);
+    memcpy(subimage->needed_colors, needed, sizeof(uint16_t) * w[3]);
+    needed += w[3];
+    gfs->images[i]->user_data = subimage;
+  }
+
+  Gif_DeleteArray(data);
+  return 1;
+}
 
 static void
-simple_frame_data(Gif_Image *gfi, uint8_t *map)
+store_cached_subimages(Gif_Stream *gfs)
 {
-  Gif_OptBounds ob = safe_bounds(gfi);
-  int x, y, scan_width = gfi->width;
-
-  for (y = 0; y < ob.height; y++) {
-    uint16_t *from = this_data + screen_width * (y + ob.top) + ob.left;
-    uint8_t *into = gfi->image_data + y * scan_width;
-    for (x = 0; x < ob.width; x++)
-      *into++ = map[*from++];
+  uint32_t size, *words, *w, nneeded = 0;
+  uint16_t *needed;
+  int i;
+
+  for (i = 0; i < gfs->nimages; i++)
+    nneeded += ((Gif_OptData *) gfs->images[i]->user_data)->needed_color_count;
+  size = (SUBIMAGE_CACHE_HEADER + SUBIMAGE_CACHE_FRAME * gfs->nimages) * 4
+    + nneeded * 2;
+  words = (uint32_t *) Gif_NewArray(uint8_t, size);
+
+  words[0] = gfs->nimages;
+  words[1] = all_colormap->ncol;
+  words[2] = screen_width;
+  words[3] = screen_height;
+  words[4] = background;
+  w = words + SUBIMAGE_CACHE_HEADER;
+  needed = (uint16_t *) (w + SUBIMAGE_CACHE_FRAME * gfs->nimages);
+  for (i = 0; i < gfs->nimages; i++, w += SUBIMAGE_CACHE_FRAME) {
+    Gif_OptData *subimage = (Gif_OptData *) gfs->images[i]->user_data;
+    w[0] = subimage->left | (subimage->top << 16);
+    w[1] = subimage->width | (subimage->height << 16);
+    w[2] = (subimage->disposal << 16) | subimage->required_color_count;
+    w[3] = subimage->needed_color_count;
+    w[4] = (uint32_t) subimage->screen_hash;
+    w[5] = (uint32_t) (subimage->screen_hash >> 32);
+    memcpy(needed, subimage->needed_colors,
+	   sizeof(uint16_t) * subimage->needed_color_count);
+    needed += subimage->needed_color_count;
   }
+
+  analysis_cache_store(subimage_cache_digest, "opt", subimage_cache_param,
+		       (uint8_t *) words, size);
+  Gif_DeleteArray(words);
 }
 
 
-/* transp_frame_data: copy the frame data into the actual image, using
-   transparency occasionally according to a heuristic described below */
+/*****
+ * EFFORT UNDER A TIME BUDGET
+ **/
+
+/* With --time-budget, create_new_image_data picks an effort level for each
+   frame, from the requested -O level down to 0, where the frame is written
+   as it came in if that's possible. The level drops whenever the frames
+   left would overrun the budget, at the time per pixel frames have taken
+   at the current level so far. A level that hasn't run yet is guessed to
+   take half as long as the level above it. */
+
+#define MAX_EFFORT 4
+
+static int effort;
+static double effort_msec[MAX_EFFORT + 1];
+static double effort_pixels[MAX_EFFORT + 1];
+static double *pixels_left;	/* optimized area of frames i and later */
+static uint8_t *frame_effort;
+
+static void
+start_effort(Gif_Stream *gfs, int optimize_flags)
+{
+  int i;
+  effort = constrain(1, optimize_flags & GT_OPT_MASK, MAX_EFFORT);
+  for (i = 0; i <= MAX_EFFORT; i++)
+    effort_msec[i] = effort_pixels[i] = 0;
+  frame_effort = time_budget ? Gif_NewArray(uint8_t, gfs->nimages) : 0;
+  pixels_left = 0;
+}
+
+static double
+effort_estimate(int level)
+{
+  int l;
+  for (l = level; l <= MAX_EFFORT; l++)
+    if (effort_pixels[l])
+      return effort_msec[l] / effort_pixels[l] / (1 << (l - level));
+  return 0;
+}
+
+static int
+choose_effort(Gif_Stream *gfs, double *left_store)
+{
+  double left;
+  int i;
+  if (!frame_effort)
+    return effort;
+  if (!pixels_left) {
+    /* -Ofold-loops may have dropped frames since start_effort */
+    pixels_left = Gif_NewArray(double, gfs->nimages + 1);
+    pixels_left[gfs->nimages] = 0;
+    for (i = gfs->nimages - 1; i >= 0; i--) {
+      Gif_OptData *opt = (Gif_OptData *) gfs->images[i]->user_data;
+      pixels_left[i] = pixels_left[i + 1] + opt->width * opt->height;
+    }
+  }
+  left = *left_store = time_budget_left();
+  if (left <= 0)
+    effort = 0;
+  while (effort > 0 && effort_estimate(effort) * pixels_left[image_index] > left)
+    effort--;
+  return effort;
+}
+
+static void
+record_effort(int level, double left_before)
+{
+  if (frame_effort) {
+    frame_effort[image_index] = level;
+    effort_msec[level] += left_before - time_budget_left();
+    effort_pixels[level] += pixels_left[image_index]
+      - pixels_left[image_index + 1];
+  }
+}
 
+/* Warn about frames that got less effort than requested, as ranges of
+   frame numbers at each level. */
 static void
-transp_frame_data(Gif_Stream *gfs, Gif_Image *gfi, uint8_t *map,
-		  int optimize_flags, Gif_CompressInfo *gcinfo)
+report_effort(int nimages, int optimize_flags)
 {
-  Gif_OptBounds ob = safe_bounds(gfi);
-  int x, y, transparent = gfi->transparent;
-  uint16_t *last = 0;
-  uint16_t *cur = 0;
-  uint8_t *data, *begin_same;
-  uint8_t *t2_data = 0, *last_for_t2;
-  int nsame;
-
-  /* First, try w/o transparency. Compare this to the result using
-     transparency and pick the better of the two. */
-  simple_frame_data(gfi, map);
-  Gif_FullCompressImage(gfs, gfi, gcinfo);
-  gcinfo->flags |= GIF_WRITE_SHRINK;
-
-  /* Actually copy data to frame.
-
-     Use transparency if possible to shrink the size of the written GIF.
-
-     The written GIF will be small if patterns (sequences of pixel values)
-     recur in the image.
-     We could conceivably use transparency to produce THE OPTIMAL image,
-     with the most recurring patterns of the best kinds; but this would
-     be very hard (wouldn't it?). Instead, we settle for a heuristic:
-     we try and create RUNS. (Since we *try* to create them, they will
-     presumably recur!) A RUN is a series of adjacent pixels all with the
-     same value.
-
-     By & large, we just use the regular image's values. However, we might
-     create a transparent run *not in* the regular image, if TWO OR MORE
-     adjacent runs OF DIFFERENT COLORS *could* be made transparent.
-
-     (An area can be made transparent if the corresponding area in the previous
-     frame had the same colors as the area does now.)
-
-     Why? If only one run (say of color C) could be transparent, we get no
-     large immediate advantage from making it transparent (it'll be a run of
-     the same length regardless). Also, we might LOSE: what if the run was
-     adjacent to some more of color C, which couldn't be made transparent? If
-     we use color C (instead of the transparent color), then we get a longer
-     run.
-
-     This simple heuristic does a little better than Gifwizard's (6/97)
-     on some images, but does *worse than nothing at all* on others.
-
-     However, it DOES do better than the complicated, greedy algorithm that
-     preceded it; and now we pick either the transparency-optimized version or
-     the normal version, whichever compresses smaller, for the best of both
-     worlds. (9/98)
-
-     On several images, making SINGLE color runs transparent wins over the
-     previous heuristic, so try both at optimize level 3 or above (the cost is
-     ~30%). (2/11) */
-
-    data = begin_same = last_for_t2 = gfi->image_data;
-    nsame = 0;
-
-    for (y = 0; y < ob.height; ++y) {
-	last = last_data + screen_width * (y + ob.top) + ob.left;
-	cur = this_data + screen_width * (y + ob.top) + ob.left;
-	for (x = 0; x < ob.width; ++x) {
-	    if (*cur != *last && map[*cur] != transparent) {
-		if (nsame == 1 && data[-1] != transparent
-		    && (optimize_flags & GT_OPT_MASK) > 2) {
-		    if (!t2_data)
-			t2_data = Gif_NewArray(uint8_t, ob.width * ob.height);
-		    memcpy(t2_data + (last_for_t2 - gfi->image_data),
-			   last_for_t2, begin_same - last_for_t2);
-		    memset(t2_data + (begin_same - gfi->image_data),
-			   transparent, data - begin_same);
-		    last_for_t2 = data;
-		}
-		nsame = 0;
-	    } else if (nsame == 0) {
-		begin_same = data;
-		++nsame;
-	    } else if (nsame == 1 && map[*cur] != data[-1]) {
-		memset(begin_same, transparent, data - begin_same);
-		++nsame;
-	    }
-	    if (nsame > 1)
-		*data = transparent;
-	    else
-		*data = map[*cur];
-	    ++data, ++cur, ++last;
-	}
+  static const char * const names[] = {
+    "unoptimized", "-O1", "-O2", "-O3", "-O4"
+  };
+  int requested = constrain(1, optimize_flags & GT_OPT_MASK, MAX_EFFORT);
+  char buf[256];
+  int i, j, len = 0;
+  if (!frame_effort)
+    return;
+  for (i = 0; i < nimages && frame_effort[i] == requested; i++)
+    /* nada */;
+  if (i < nimages) {
+    for (i = 0; i < nimages; i = j) {
+      for (j = i + 1; j < nimages && frame_effort[j] == frame_effort[i]; j++)
+	/* nada */;
+      if (len > (int) sizeof(buf) - 40) {
+	strcpy(buf + len, ", ...");
+	break;
+      } else if (j == i + 1)
+	len += sprintf(buf + len, "%s#%d %s", len ? ", " : "", i,
+		       names[frame_effort[i]]);
+      else
+	len += sprintf(buf + len, "%s#%d-%d %s", len ? ", " : "", i, j - 1,
+		       names[frame_effort[i]]);
     }
+    warning(1, "time budget lowered optimization: %s", buf);
+  }
+}
 
-    if (t2_data)
-	memcpy(t2_data + (last_for_t2 - gfi->image_data),
-	       last_for_t2, data - last_for_t2);
 
+/*****
+ * PROGRESSIVE OUTPUT
+ **/
 
-    /* Now, try compressed transparent version(s) and pick the better of the
-       two (or three). */
-    Gif_FullCompressImage(gfs, gfi, gcinfo);
-    if (t2_data) {
-	Gif_SetUncompressedImage(gfi, t2_data, Gif_DeleteArrayFunc, 0);
-        Gif_FullCompressImage(gfs, gfi, gcinfo);
+/* With a progressive output file, each frame is written once it's final,
+   rather than after the whole stream is optimized. A frame is final when
+   the next frame is done: finalize_optimizer's passes could otherwise drop
+   the next frame, adding its delay to this one, or switch this frame's
+   disposal. Frames dropped here are removed from the stream at the end.
+
+   The header needs to know whether the stream uses GIF89a features. A loop
+   count or the first delay usually settles that; until it's settled, final
+   frames wait, as do all frames under --careful, which sizes the global
+   colormap by every frame's transparent index. */
+
+static FILE *progressive_file;
+static Gif_IncrementalWriter *progressive_writer;
+static int progressive_pending;	/* last frame kept, not yet final */
+static int progressive_next;	/* first final frame not yet written */
+static uint8_t *progressive_dropped;
+
+/* Return true if 'gfi', just after 'prev', is an entirely transparent
+   frame whose delay can go to 'prev'. */
+static int
+empty_frame_absorbed(Gif_Image *gfi, Gif_Image *prev)
+{
+  if (gfi->width == 1 && gfi->height == 1 && gfi->transparent >= 0
+      && !gfi->identifier && !gfi->comment
+      && (gfi->disposal == GIF_DISPOSAL_ASIS
+	  || gfi->disposal == GIF_DISPOSAL_NONE
+	  || gfi->disposal == GIF_DISPOSAL_PREVIOUS)
+      && gfi->delay && prev->delay) {
+    Gif_UncompressImage(gfi);
+    return gfi->img[0][0] == gfi->transparent
+      && (prev->disposal == GIF_DISPOSAL_ASIS
+	  || prev->disposal == GIF_DISPOSAL_NONE);
+  }
+  return 0;
+}
+
+/* 10.Dec.1998 - prefer GIF_DISPOSAL_NONE to GIF_DISPOSAL_ASIS. This is
+   semantically "wrong" -- it's better to set the disposal explicitly than
+   rely on default behavior -- but will result in smaller GIF files, since
+   the graphic control extension can be left off in many cases. */
+static void
+prefer_disposal_none(Gif_Image *gfi)
+{
+  if (gfi->disposal == GIF_DISPOSAL_ASIS
+      && gfi->delay == 0
+      && gfi->transparent < 0)
+    gfi->disposal = GIF_DISPOSAL_NONE;
+}
+
+/* Called by create_new_image_data, after any frames are folded away. */
+static void
+start_progressive(Gif_Stream *gfs)
+{
+  progressive_writer = 0;
+  progressive_pending = -1;
+  progressive_next = 0;
+  progressive_dropped = 0;
+  if (progressive_file)
+    progressive_dropped = Gif_NewArray(uint8_t, gfs->nimages);
+  if (progressive_dropped)
+    memset(progressive_dropped, 0, gfs->nimages);
+}
+
+/* Write final frames before 'limit', opening the writer first if the
+   header is settled, or if 'force' is true. */
+static void
+write_progressive(Gif_Stream *gfs, int limit, int force)
+{
+  int i;
+  if (!progressive_writer) {
+    int isgif89a = gfs->comment || gfs->loopcount > -1;
+    for (i = progressive_next; i < limit && !isgif89a; i++) {
+      Gif_Image *gfi = gfs->images[i];
+      isgif89a = !progressive_dropped[i]
+	&& (gfi->identifier || gfi->transparent != -1 || gfi->disposal
+	    || gfi->delay || gfi->comment);
     }
+    if ((!isgif89a || (gif_write_info.flags & GIF_WRITE_CAREFUL_MIN_CODE_SIZE))
+	&& !force)
+      return;
+    if (background == TRANSP)
+      gfs->background = (uint8_t)gfs->images[0]->transparent;
+    progressive_writer = Gif_IncrementalWriteFileInit(gfs, &gif_write_info,
+						      progressive_file);
+    if (!progressive_writer)
+      return;
+  }
+  for (; progressive_next < limit; progressive_next++) {
+    Gif_Image *gfi = gfs->images[progressive_next];
+    if (progressive_dropped[progressive_next])
+      continue;
+    Gif_IncrementalWriteImage(progressive_writer, gfs, gfi);
+    Gif_ReleaseCompressedImage(gfi);
     Gif_ReleaseUncompressedImage(gfi);
+  }
+}
+
+/* Called by create_new_image_data once frame 'image_index' is done. */
+static void
+progressive_frame(Gif_Stream *gfs, int optimize_flags)
+{
+  Gif_Image *gfi = gfs->images[image_index];
+  if (!progressive_dropped)
+    return;
+  if (progressive_pending >= 0) {
+    Gif_Image *prev = gfs->images[progressive_pending];
+    if (!(optimize_flags & GT_OPT_KEEPEMPTY)
+	&& empty_frame_absorbed(gfi, prev)) {
+      prev->delay += gfi->delay;
+      progressive_dropped[image_index] = 1;
+      Gif_ReleaseUncompressedImage(gfi);
+      Gif_ReleaseCompressedImage(gfi);
+      return;
+    }
+    prefer_disposal_none(prev);
+  }
+  progressive_pending = image_index;
+  write_progressive(gfs, image_index, 0);
+}
 
-    gcinfo->flags &= ~GIF_WRITE_SHRINK;
+/* Write the rest of the stream and remove dropped frames. Returns 1 if the
+   stream was written. */
+static int
+finish_progressive(Gif_Stream *gfs)
+{
+  int i, j, ok = 0;
+  if (!progressive_dropped)
+    return 0;
+  if (!processing_canceled) {
+    if (progressive_pending >= 0)
+      prefer_disposal_none(gfs->images[progressive_pending]);
+    write_progressive(gfs, gfs->nimages, 1);
+  }
+  if (progressive_writer)
+    ok = Gif_IncrementalWriteComplete(progressive_writer, gfs,
+				      !processing_canceled);
+
+  for (i = j = 0; i < gfs->nimages; i++)
+    if (progressive_dropped[i])
+      Gif_DeleteImage(gfs->images[i]);
+    else
+      gfs->images[j++] = gfs->images[i];
+  gfs->nimages = j;
+
+  Gif_DeleteArray(progressive_dropped);
+  progressive_dropped = 0;
+  progressive_writer = 0;
+  return ok;
 }
 
 
 /*****
- * CREATE NEW IMAGE DATA
+ * CHECKPOINTS
  **/
 
-/* last == what last image ended up looking like
-   this == what new image should look like
+/* With --checkpoint, create_new_image_data saves its state between frames
+   every checkpoint_interval seconds; with --resume, it continues from the
+   saved state. Everything before create_new_image_data is deterministic,
+   so a resumed run recomputes it, and the checkpoint holds only what
+   create_new_image_data changes: the screens last_data and this_data, and
+   the finished frames. It also records the global colormap, which must
+   match the recomputed one.
+
+   A checkpoint is keyed by a digest of the optimizer's input and by the
+   optimize flags. Its payload is 10 header words (image count, next frame,
+   screen width, screen height, screen pixel size, all_colormap size,
+   background, compression flags, global colormap size, and 0), the global
+   colormap as RGB triples, the two screens, and then each finished frame:
+   3 words (left | top << 16, width | height << 16, disposal | interlace << 8
+   | transparent << 16), the local colormap size or 0xFFFFFFFF, the local
+   colormap, and then 1 and compressed data or 2 and pixels, as a length
+   word and bytes. */
+
+#define CHECKPOINT_HEADER	10
+
+static uint64_t checkpoint_digest;
+static uint32_t checkpoint_param;
+static double checkpoint_msec;
+
+/* A checkpoint payload being built or read. While reading, 'size' is the
+   read position and 'cap' the payload length. 'ok' goes to 0 on overflow. */
+typedef struct {
+  uint8_t *data;
+  uint32_t size;
+  uint32_t cap;
+  int ok;
+} Gif_OptBuffer;
 
-   last = apply O1 + dispose O1 + ... + apply On-1 + dispose On-1
-   this = apply U1 + dispose U1 + ... + apply Un-1 + dispose Un-1 + apply Un
+static void
+buffer_put(Gif_OptBuffer *b, const void *data, uint32_t len)
+{
+  if (!b->ok || len > 0xFFFFFFFFU - b->size) {
+    b->ok = 0;
+    return;
+  }
+  if (b->size + len > b->cap) {
+    uint32_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->size + len)
+      cap = cap > 0x7FFFFFFFU ? 0xFFFFFFFFU : cap * 2;
+    Gif_ReArray(b->data, uint8_t, cap);
+    if (!b->data) {
+      b->ok = 0;
+      return;
+    }
+    b->cap = cap;
+  }
+  memcpy(b->data + b->size, data, len);
+  b->size += len;
+}
 
-   invariant: apply O1 + dispose O1 + ... + apply Ok
-   === apply U1 + dispose U1 + ... + apply Uk */
+static void
+buffer_put32(Gif_OptBuffer *b, uint32_t w)
+{
+  buffer_put(b, &w, 4);
+}
+
+static const uint8_t *
+buffer_get(Gif_OptBuffer *b, uint32_t len)
+{
+  const uint8_t *p = b->data + b->size;
+  if (!b->ok || len > b->cap - b->size) {
+    b->ok = 0;
+    return 0;
+  }
+  b->size += len;
+  return p;
+}
+
+static uint32_t
+buffer_get32(Gif_OptBuffer *b)
+{
+  uint32_t w = 0;
+  const uint8_t *p = buffer_get(b, 4);
+  if (p)
+    memcpy(&w, p, 4);
+  return w;
+}
 
 static void
-create_new_image_data(Gif_Stream *gfs, int optimize_flags)
+buffer_put_colormap(Gif_OptBuffer *b, const Gif_Colormap *gfcm)
 {
-  Gif_Image cur_unopt_gfi;	/* placehoder; maintains pre-optimization
-				   image size so we can apply background
-				   disposal */
-  int screen_size = screen_width * screen_height;
-  uint16_t *previous_data = 0;
-  Gif_CompressInfo gcinfo = gif_write_info;
-  if ((optimize_flags & GT_OPT_MASK) >= 3)
-      gcinfo.flags |= GIF_WRITE_OPTIMIZE;
-
-  gfs->global = out_global_map;
-
-  /* do first image. Remember to uncompress it if necessary */
-  erase_screen(last_data);
-  erase_screen(this_data);
-
-  for (image_index = 0; image_index < gfs->nimages; image_index++) {
-    Gif_Image *cur_gfi = gfs->images[image_index];
-    Gif_OptData *opt = (Gif_OptData *)cur_gfi->user_data;
-    int was_compressed = (cur_gfi->img == 0);
-
-    /* save previous data if necessary */
-    if (cur_gfi->disposal == GIF_DISPOSAL_PREVIOUS) {
-      previous_data = Gif_NewArray(uint16_t, screen_size);
-      copy_data_area(previous_data, this_data, cur_gfi);
+  int i;
+  for (i = 0; i < gfcm->ncol; i++) {
+    uint8_t rgb[3];
+    rgb[0] = gfcm->col[i].red;
+    rgb[1] = gfcm->col[i].green;
+    rgb[2] = gfcm->col[i].blue;
+    buffer_put(b, rgb, 3);
+  }
+}
+
+static void
+save_checkpoint(Gif_Stream *gfs, int next, const void *last,
+		const void *this, int pixel_size)
+{
+  static int warned = 0;
+  uint32_t screen_bytes = screen_width * screen_height * pixel_size;
+  Gif_OptBuffer b;
+  int i, y;
+
+  b.data = 0;
+  b.size = b.cap = 0;
+  b.ok = 1;
+  buffer_put32(&b, gfs->nimages);
+  buffer_put32(&b, next);
+  buffer_put32(&b, screen_width);
+  buffer_put32(&b, screen_height);
+  buffer_put32(&b, pixel_size);
+  buffer_put32(&b, all_colormap->ncol);
+  buffer_put32(&b, background);
+  buffer_put32(&b, gif_write_info.flags);
+  buffer_put32(&b, out_global_map->ncol);
+  buffer_put32(&b, 0);
+  buffer_put_colormap(&b, out_global_map);
+  buffer_put(&b, last, screen_bytes);
+  buffer_put(&b, this, screen_bytes);
+
+  for (i = 0; i < next; i++) {
+    Gif_Image *gfi = gfs->images[i];
+    buffer_put32(&b, gfi->left | ((uint32_t) gfi->top << 16));
+    buffer_put32(&b, gfi->width | ((uint32_t) gfi->height << 16));
+    buffer_put32(&b, gfi->disposal | (gfi->interlace ? 0x100 : 0)
+		 | ((uint32_t) (gfi->transparent & 0xFFFF) << 16));
+    buffer_put32(&b, gfi->local ? (uint32_t) gfi->local->ncol : 0xFFFFFFFFU);
+    if (gfi->local)
+      buffer_put_colormap(&b, gfi->local);
+    if (gfi->compressed) {
+      buffer_put32(&b, 1);
+      buffer_put32(&b, gfi->compressed_len);
+      buffer_put(&b, gfi->compressed, gfi->compressed_len);
+    } else {
+      buffer_put32(&b, 2);
+      buffer_put32(&b, gfi->width * gfi->height);
+      for (y = 0; y < gfi->height; y++)
+	buffer_put(&b, gfi->img[y], gfi->width);
     }
+  }
 
-    /* set up this_data to be equal to the current image */
-    apply_frame(this_data, cur_gfi, 0, 0);
-
-    /* save actual bounds and disposal from unoptimized version so we can
-       apply the disposal correctly next time through */
-    cur_unopt_gfi = *cur_gfi;
-
-    /* set bounds and disposal from optdata */
-    Gif_ReleaseUncompressedImage(cur_gfi);
-    cur_gfi->left = opt->left;
-    cur_gfi->top = opt->top;
-    cur_gfi->width = opt->width;
-    cur_gfi->height = opt->height;
-    cur_gfi->disposal = opt->disposal;
-    if (image_index > 0)
-	cur_gfi->interlace = 0;
-
-    /* find the new image's colormap and then make new data */
-    {
-      uint8_t *map = prepare_colormap(cur_gfi, opt->needed_colors);
-      uint8_t *data = Gif_NewArray(uint8_t, cur_gfi->width * cur_gfi->height);
-      Gif_SetUncompressedImage(cur_gfi, data, Gif_DeleteArrayFunc, 0);
-
-      /* don't use transparency on first frame */
-      if ((optimize_flags & GT_OPT_MASK) > 1 && image_index > 0
-	  && cur_gfi->transparent >= 0)
-	transp_frame_data(gfs, cur_gfi, map, optimize_flags, &gcinfo);
-      else
-	simple_frame_data(cur_gfi, map);
-
-      if (cur_gfi->img) {
-	if (was_compressed || (optimize_flags & GT_OPT_MASK) > 1) {
-	  Gif_FullCompressImage(gfs, cur_gfi, &gcinfo);
-	  Gif_ReleaseUncompressedImage(cur_gfi);
-	} else			/* bug fix 22.May.2001 */
-	  Gif_ReleaseCompressedImage(cur_gfi);
-      }
+  if ((!b.ok || !checkpoint_store(checkpoint_digest, checkpoint_param,
+				  b.data, b.size))
+      && !warned) {
+    warning(0, "can't write checkpoint %s: %s", checkpoint_file,
+	    b.ok ? strerror(errno) : "out of memory");
+    warned = 1;
+  }
+  Gif_DeleteArray(b.data);
+}
 
-      Gif_DeleteArray(map);
+/* Read a finished frame from a checkpoint into 'gfi', or just check it if
+   'gfi' is null. */
+static int
+read_checkpoint_frame(Gif_OptBuffer *b, Gif_Image *gfi)
+{
+  uint32_t position = buffer_get32(b), size = buffer_get32(b);
+  uint32_t flags = buffer_get32(b), ncol = buffer_get32(b);
+  uint32_t form, len, i;
+  int left = position & 0xFFFF, top = position >> 16;
+  int width = size & 0xFFFF, height = size >> 16;
+  int transparent = flags >> 16;
+  const uint8_t *colors = 0, *data;
+
+  if (ncol != 0xFFFFFFFFU)
+    colors = buffer_get(b, ncol <= 256 ? ncol * 3 : 0xFFFFFFFFU);
+  form = buffer_get32(b);
+  len = buffer_get32(b);
+  data = buffer_get(b, len);
+  if (!b->ok || width == 0 || height == 0
+      || left + width > screen_width || top + height > screen_height
+      || (flags & 0xFF) > GIF_DISPOSAL_PREVIOUS || (flags & 0xFE00)
+      || (transparent > 255 && transparent != 0xFFFF)
+      || (form == 1 ? len == 0
+	  : form != 2 || len != (uint32_t) width * height))
+    return b->ok = 0;
+  if (!gfi)
+    return 1;
+
+  delete_opt_data((Gif_OptData *) gfi->user_data);
+  gfi->user_data = 0;
+  Gif_ReleaseUncompressedImage(gfi);
+  Gif_ReleaseCompressedImage(gfi);
+  gfi->left = left;
+  gfi->top = top;
+  gfi->width = width;
+  gfi->height = height;
+  gfi->disposal = flags & 0xFF;
+  gfi->interlace = (flags & 0x100) != 0;
+  gfi->transparent = transparent == 0xFFFF ? -1 : transparent;
+  Gif_DeleteColormap(gfi->local);
+  gfi->local = 0;
+  if (colors) {
+    gfi->local = Gif_NewFullColormap(ncol, 256);
+    for (i = 0; i < ncol; i++, colors += 3) {
+      gfi->local->col[i].red = colors[0];
+      gfi->local->col[i].green = colors[1];
+      gfi->local->col[i].blue = colors[2];
+      gfi->local->col[i].haspixel = 0;
     }
+  }
+  if (form == 1) {
+    gfi->compressed = Gif_NewArray(uint8_t, len);
+    memcpy(gfi->compressed, data, len);
+    gfi->compressed_len = len;
+    gfi->free_compressed = Gif_DeleteArrayFunc;
+  } else {
+    uint8_t *pixels = Gif_NewArray(uint8_t, len);
+    memcpy(pixels, data, len);
+    Gif_SetUncompressedImage(gfi, pixels, Gif_DeleteArrayFunc, 0);
+  }
+  return 1;
+}
+
+/* Called by create_new_image_data before the first frame. If there's a
+   checkpoint to resume from, restore it and return the first frame left
+   to do; otherwise return 0. */
+static int
+resume_checkpoint(Gif_Stream *gfs, void *last, void *this, int pixel_size)
+{
+  uint32_t size, screen_bytes = screen_width * screen_height * pixel_size;
+  uint32_t w[CHECKPOINT_HEADER];
+  const uint8_t *colors, *saved_last, *saved_this;
+  Gif_OptBuffer b;
+  int i, next, ok;
+
+  checkpoint_msec = current_msec();
+  if (!checkpoint_file || !checkpoint_resume
+      || !(b.data = checkpoint_load(checkpoint_digest, checkpoint_param,
+				    &size)))
+    return 0;
 
-    delete_opt_data(opt);
-    cur_gfi->user_data = 0;
+  b.size = 0;
+  b.cap = size;
+  b.ok = 1;
+  for (i = 0; i < CHECKPOINT_HEADER; i++)
+    w[i] = buffer_get32(&b);
+  next = w[1];
+  ok = b.ok && w[0] == (uint32_t) gfs->nimages
+    && w[1] <= (uint32_t) gfs->nimages
+    && w[2] == (uint32_t) screen_width && w[3] == (uint32_t) screen_height
+    && w[4] == (uint32_t) pixel_size
+    && w[5] == (uint32_t) all_colormap->ncol && w[6] == background
+    && w[7] == (uint32_t) gif_write_info.flags
+    && w[8] == (uint32_t) out_global_map->ncol;
+  colors = buffer_get(&b, out_global_map->ncol * 3);
+  for (i = 0; ok && colors && i < out_global_map->ncol; i++, colors += 3)
+    ok = out_global_map->col[i].red == colors[0]
+      && out_global_map->col[i].green == colors[1]
+      && out_global_map->col[i].blue == colors[2];
+  saved_last = buffer_get(&b, screen_bytes);
+  saved_this = buffer_get(&b, screen_bytes);
+
+  /* check every frame before changing anything */
+  {
+    uint32_t frames_start = b.size;
+    for (i = 0; ok && i < next; i++)
+      ok = read_checkpoint_frame(&b, 0);
+    ok = ok && b.ok && b.size == b.cap;
+    b.size = frames_start;
+  }
+  if (ok) {
+    memcpy(last, saved_last, screen_bytes);
+    memcpy(this, saved_this, screen_bytes);
+    for (i = 0; i < next; i++)
+      read_checkpoint_frame(&b, gfs->images[i]);
+  } else {
+    warning(0, "checkpoint %s doesn't match, starting over", checkpoint_file);
+    next = 0;
+  }
 
-    /* Set up last_data and this_data. last_data must contain this_data + new
-       disposal. this_data must contain this_data + old disposal. */
-    if (cur_gfi->disposal == GIF_DISPOSAL_NONE
-	|| cur_gfi->disposal == GIF_DISPOSAL_ASIS)
-      copy_data_area(last_data, this_data, cur_gfi);
-    else if (cur_gfi->disposal == GIF_DISPOSAL_BACKGROUND)
-      fill_data_area(last_data, background, cur_gfi);
-    else
-      assert(0 && "optimized frame has strange disposal");
+  Gif_DeleteArray(b.data);
+  return next;
+}
 
-    if (cur_unopt_gfi.disposal == GIF_DISPOSAL_BACKGROUND)
-      fill_data_area(this_data, background, &cur_unopt_gfi);
-    else if (cur_unopt_gfi.disposal == GIF_DISPOSAL_PREVIOUS) {
-      copy_data_area(this_data, previous_data, &cur_unopt_gfi);
-      Gif_DeleteArray(previous_data);
-    }
+/* Called by create_new_image_data once frame 'image_index' is done. */
+static void
+checkpoint_frame(Gif_Stream *gfs, const void *last, const void *this,
+		 int pixel_size)
+{
+  if (checkpoint_file && image_index + 1 < gfs->nimages
+      && current_msec() - checkpoint_msec >= checkpoint_interval * 1000.) {
+    save_checkpoint(gfs, image_index + 1, last, this, pixel_size);
+    checkpoint_msec = current_msec();
   }
 }
 
 
+/* optscreen.h has the passes that read and write whole screens, compiled
+   once for 8-bit and once for 16-bit screen pixels. Most streams fit in 8
+   bits, which halves the memory traffic of those passes. */
+
+#define OPT_PIXEL		uint8_t
+#define OPT_NAME(name)		name##_8
+#include "optscreen.h"
+#undef OPT_PIXEL
+#undef OPT_NAME
+
+#define OPT_PIXEL		uint16_t
+#define OPT_NAME(name)		name##_16
+#include "optscreen.h"
+#undef OPT_PIXEL
+#undef OPT_NAME
+
+
 /*****
  * INITIALIZATION AND FINALIZATION
  **/
@@ -1198,7 +1294,7 @@ create_new_image_data(Gif_Stream *gfs, int optimize_flags)
 static int
 initialize_optimizer(Gif_Stream *gfs)
 {
-  int i, screen_size;
+  int i;
 
   if (gfs->nimages < 1)
     return 0;
@@ -1221,11 +1317,13 @@ initialize_optimizer(Gif_Stream *gfs)
   {
     int any_globals = 0;
     int first_transparent = -1;
+    Gif_Colormap *last_local = 0;
     for (i = 0; i < gfs->nimages; i++) {
       Gif_Image *gfi = gfs->images[i];
-      if (gfi->local)
-	colormap_combine(all_colormap, gfi->local);
-      else
+      /* frames often share a local colormap; combine it once */
+      if (gfi->local && gfi->local != last_local)
+	colormap_combine(all_colormap, last_local = gfi->local);
+      else if (!gfi->local)
 	any_globals = 1;
       if (gfi->transparent >= 0 && first_transparent < 0)
 	first_transparent = i;
@@ -1248,11 +1346,6 @@ initialize_optimizer(Gif_Stream *gfs)
   for (i = 0; i < gfs->nimages; i++)
     Gif_ClipImage(gfs->images[i], 0, 0, screen_width, screen_height);
 
-  /* create data arrays */
-  screen_size = screen_width * screen_height;
-  last_data = Gif_NewArray(uint16_t, screen_size);
-  this_data = Gif_NewArray(uint16_t, screen_size);
-
   /* set up colormaps */
   gif_color_count = 2;
   while (gif_color_count < gfs->global->ncol && gif_color_count < 256)
@@ -1273,60 +1366,86 @@ finalize_optimizer(Gif_Stream *gfs, int optimize_flags)
 {
   int i;
 
+  /* a canceled optimization leaves a half-done stream that is about to be
+     thrown away; just free the optimizer's state */
+  if (processing_canceled) {
+    for (i = 0; i < gfs->nimages; i++) {
+      delete_opt_data((Gif_OptData *) gfs->images[i]->user_data);
+      gfs->images[i]->user_data = 0;
+    }
+    if (gfs->global != in_global_map)
+      Gif_DeleteColormap(in_global_map);
+    Gif_DeleteColormap(all_colormap);
+    return;
+  }
+
   if (background == TRANSP)
     gfs->background = (uint8_t)gfs->images[0]->transparent;
 
+  /* progressive output already did the rest, frame by frame */
+  if (progressive_file)
+    goto done;
+
   /* 11.Mar.2010 - remove entirely transparent frames. */
   for (i = 1; i < gfs->nimages && !(optimize_flags & GT_OPT_KEEPEMPTY); ++i) {
     Gif_Image *gfi = gfs->images[i];
-    if (gfi->width == 1 && gfi->height == 1 && gfi->transparent >= 0
-	&& !gfi->identifier && !gfi->comment
-	&& (gfi->disposal == GIF_DISPOSAL_ASIS
-	    || gfi->disposal == GIF_DISPOSAL_NONE
-	    || gfi->disposal == GIF_DISPOSAL_PREVIOUS)
-	&& gfi->delay && gfs->images[i-1]->delay) {
-      Gif_UncompressImage(gfi);
-      if (gfi->img[0][0] == gfi->transparent
-	  && (gfs->images[i-1]->disposal == GIF_DISPOSAL_ASIS
-	      || gfs->images[i-1]->disposal == GIF_DISPOSAL_NONE)) {
-	gfs->images[i-1]->delay += gfi->delay;
-	Gif_DeleteImage(gfi);
-	memmove(&gfs->images[i], &gfs->images[i+1], sizeof(Gif_Image *) * (gfs->nimages - i - 1));
-	--gfs->nimages;
-	--i;
-      }
+    if (empty_frame_absorbed(gfi, gfs->images[i-1])) {
+      gfs->images[i-1]->delay += gfi->delay;
+      Gif_DeleteImage(gfi);
+      memmove(&gfs->images[i], &gfs->images[i+1], sizeof(Gif_Image *) * (gfs->nimages - i - 1));
+      --gfs->nimages;
+      --i;
     }
   }
 
-  /* 10.Dec.1998 - prefer GIF_DISPOSAL_NONE to GIF_DISPOSAL_ASIS. This is
-     semantically "wrong" -- it's better to set the disposal explicitly than
-     rely on default behavior -- but will result in smaller GIF files, since
-     the graphic control extension can be left off in many cases. */
   for (i = 0; i < gfs->nimages; i++)
-    if (gfs->images[i]->disposal == GIF_DISPOSAL_ASIS
-	&& gfs->images[i]->delay == 0
-	&& gfs->images[i]->transparent < 0)
-      gfs->images[i]->disposal = GIF_DISPOSAL_NONE;
+    prefer_disposal_none(gfs->images[i]);
 
+ done:
   Gif_DeleteColormap(in_global_map);
   Gif_DeleteColormap(all_colormap);
-
-  Gif_DeleteArray(last_data);
-  Gif_DeleteArray(this_data);
 }
 
 
-/* the interface function! */
+/* the interface function! If 'progressive' is nonnull, frames are written
+   to it as they are finished; returns 1 if the whole stream was written
+   there. Written frames lose their image data. */
 
-void
-optimize_fragments(Gif_Stream *gfs, int optimize_flags, int huge_stream)
+int
+optimize_fragments(Gif_Stream *gfs, int optimize_flags, int huge_stream,
+		   FILE *progressive)
 {
+  int subimages_cached = 0, written;
   if (!initialize_optimizer(gfs))
-    return;
+    return 0;
+  progressive_file = progressive;
+  if (checkpoint_file) {
+    checkpoint_digest = stream_digest(gfs);
+    checkpoint_param = optimize_flags;
+  }
 
-  create_subimages(gfs, optimize_flags, !huge_stream);
-  create_out_global_map(gfs);
-  create_new_image_data(gfs, optimize_flags);
+  /* The subimage analysis depends on the stream, on whether frames after
+     the first may use transparency, and on -Ofold-loops' screen hashes. */
+  if (analysis_cache_dir) {
+    subimage_cache_digest = stream_digest(gfs);
+    subimage_cache_param = ((optimize_flags & GT_OPT_MASK) > 1)
+      | (optimize_flags & GT_OPT_FOLDLOOPS ? 2 : 0);
+    subimages_cached = load_cached_subimages(gfs);
+  }
 
+  start_effort(gfs, optimize_flags);
+  if (all_colormap->ncol <= 256)
+    optimize_screens_8(gfs, optimize_flags, !huge_stream, subimages_cached);
+  else
+    optimize_screens_16(gfs, optimize_flags, !huge_stream, subimages_cached);
+  if (!processing_canceled)
+    report_effort(gfs->nimages, optimize_flags);
+  Gif_DeleteArray(frame_effort);
+  Gif_DeleteArray(pixels_left);
+  frame_effort = 0;
+
+  written = finish_progressive(gfs);
   finalize_optimizer(gfs, optimize_flags);
+  progressive_file = 0;
+  return written;
 }
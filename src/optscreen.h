@@ -0,0 +1,1007 @@
+/* optscreen.h - Optimizer passes over screen buffers, for one pixel type.
+   Copyright (C) 1997-2013 Eddie Kohler, ekohler@gmail.com
+   This file is part of gifsicle.
+
+   Gifsicle is free software. It is distributed under the GNU Public License,
+   version 2; you can copy, distribute, or alter it at will, as long
+   as this notice is kept intact and this source code is made available. There
+   is no warranty, express or implied. */
+
+/* optimize.c includes this file once per screen pixel type. Before each
+   inclusion, it defines OPT_PIXEL as the type of a screen pixel (an index
+   into all_colormap), and OPT_NAME(x) as the name of this type's version of
+   'x'. */
+
+#define last_data		OPT_NAME(last_data)
+#define this_data		OPT_NAME(this_data)
+#define next_data		OPT_NAME(next_data)
+#define copy_data_area		OPT_NAME(copy_data_area)
+#define copy_data_area_subimage	OPT_NAME(copy_data_area_subimage)
+#define fill_data_area		OPT_NAME(fill_data_area)
+#define fill_data_area_subimage	OPT_NAME(fill_data_area_subimage)
+#define erase_screen		OPT_NAME(erase_screen)
+#define apply_frame		OPT_NAME(apply_frame)
+#define apply_frame_disposal	OPT_NAME(apply_frame_disposal)
+#define find_difference_bounds	OPT_NAME(find_difference_bounds)
+#define expand_difference_bounds	OPT_NAME(expand_difference_bounds)
+#define get_used_colors		OPT_NAME(get_used_colors)
+#define hash_screen		OPT_NAME(hash_screen)
+#define create_subimages	OPT_NAME(create_subimages)
+#define dispose_frame		OPT_NAME(dispose_frame)
+#define screens_repeat		OPT_NAME(screens_repeat)
+#define simple_frame_data	OPT_NAME(simple_frame_data)
+#define transp_frame_data	OPT_NAME(transp_frame_data)
+#define passthrough_frame	OPT_NAME(passthrough_frame)
+#define create_new_image_data	OPT_NAME(create_new_image_data)
+#define optimize_screens	OPT_NAME(optimize_screens)
+
+static OPT_PIXEL *last_data;
+static OPT_PIXEL *this_data;
+static OPT_PIXEL *next_data;
+
+
+/*****
+ * MANIPULATING IMAGE AREAS
+ **/
+
+static void
+copy_data_area(OPT_PIXEL *dst, OPT_PIXEL *src, Gif_Image *area)
+{
+  Gif_OptBounds ob;
+  int y;
+  if (!area)
+    return;
+  ob = safe_bounds(area);
+  dst += ob.top * screen_width + ob.left;
+  src += ob.top * screen_width + ob.left;
+  for (y = 0; y < ob.height; y++) {
+    memcpy(dst, src, sizeof(OPT_PIXEL) * ob.width);
+    dst += screen_width;
+    src += screen_width;
+  }
+}
+
+static void
+copy_data_area_subimage(OPT_PIXEL *dst, OPT_PIXEL *src, Gif_OptData *area)
+{
+  Gif_Image img;
+  img.left = area->left;
+  img.top = area->top;
+  img.width = area->width;
+  img.height = area->height;
+  copy_data_area(dst, src, &img);
+}
+
+static void
+fill_data_area(OPT_PIXEL *dst, OPT_PIXEL value, Gif_Image *area)
+{
+  int x, y;
+  Gif_OptBounds ob = safe_bounds(area);
+  dst += ob.top * screen_width + ob.left;
+  for (y = 0; y < ob.height; y++) {
+    for (x = 0; x < ob.width; x++)
+      dst[x] = value;
+    dst += screen_width;
+  }
+}
+
+static void
+fill_data_area_subimage(OPT_PIXEL *dst, OPT_PIXEL value, Gif_OptData *area)
+{
+  Gif_Image img;
+  img.left = area->left;
+  img.top = area->top;
+  img.width = area->width;
+  img.height = area->height;
+  fill_data_area(dst, value, &img);
+}
+
+static void
+erase_screen(OPT_PIXEL *dst)
+{
+  uint32_t i;
+  uint32_t screen_size = screen_width * screen_height;
+  for (i = 0; i < screen_size; i++)
+    *dst++ = background;
+}
+
+/*****
+ * APPLY A GIF FRAME OR DISPOSAL TO AN IMAGE DESTINATION
+ **/
+
+static void
+apply_frame(OPT_PIXEL *dst, Gif_Image *gfi, int replace, int save_uncompressed)
+{
+  int i, y, was_compressed = 0;
+  OPT_PIXEL map[256];
+  Gif_Colormap *colormap = gfi->local ? gfi->local : in_global_map;
+  Gif_OptBounds ob = safe_bounds(gfi);
+
+  if (!gfi->img) {
+    was_compressed = 1;
+    Gif_UncompressImage(gfi);
+  }
+
+  /* make sure transparency maps to TRANSP */
+  for (i = 0; i < colormap->ncol; i++)
+    map[i] = colormap->col[i].pixel;
+  /* out-of-bounds colors map to 0, for the sake of argument */
+  for (i = colormap->ncol; i < 256; i++)
+    map[i] = colormap->col[0].pixel;
+  if (gfi->transparent >= 0 && gfi->transparent < 256)
+    map[gfi->transparent] = TRANSP;
+  else
+    replace = 1;
+  /* fold in any pending index map instead of rewriting the pixels */
+  if (gfi->index_map) {
+    OPT_PIXEL pending[256];
+    for (i = 0; i < 256; i++)
+      pending[i] = map[gfi->index_map[i]];
+    memcpy(map, pending, sizeof(map));
+  }
+
+  /* map the image; a full-screen dense frame is one long run */
+  dst += ob.left + ob.top * screen_width;
+  if (replace && ob.width == screen_width && Gif_ImageDense(gfi)
+      && gfi->width == ob.width) {
+    const uint8_t *gfi_pointer = Gif_ImagePixels(gfi);
+    OPT_PIXEL *end = dst + ob.width * ob.height;
+    for (; dst != end; dst++, gfi_pointer++)
+      *dst = map[*gfi_pointer];
+    ob.height = 0;
+  }
+  for (y = 0; y < ob.height; y++) {
+    uint8_t *gfi_pointer = gfi->img[y];
+    int x;
+
+    if (replace)
+      for (x = 0; x < ob.width; x++)
+	dst[x] = map[gfi_pointer[x]];
+    else
+      for (x = 0; x < ob.width; x++) {
+	OPT_PIXEL new_pixel = map[gfi_pointer[x]];
+	if (new_pixel != TRANSP)
+	    dst[x] = new_pixel;
+      }
+
+    dst += screen_width;
+  }
+
+  if (was_compressed && !save_uncompressed)
+    Gif_ReleaseUncompressedImage(gfi);
+}
+
+static void
+apply_frame_disposal(OPT_PIXEL *into_data, OPT_PIXEL *from_data,
+		     OPT_PIXEL *previous_data, Gif_Image *gfi)
+{
+  int screen_size = screen_width * screen_height;
+  if (gfi->disposal == GIF_DISPOSAL_PREVIOUS)
+    memcpy(into_data, previous_data, sizeof(OPT_PIXEL) * screen_size);
+  else {
+    memcpy(into_data, from_data, sizeof(OPT_PIXEL) * screen_size);
+    if (gfi->disposal == GIF_DISPOSAL_BACKGROUND)
+      fill_data_area(into_data, background, gfi);
+  }
+}
+
+
+/*****
+ * FIND THE SMALLEST BOUNDING RECTANGLE ENCLOSING ALL CHANGES
+ **/
+
+/* find_difference_bounds: Find the smallest rectangular area containing all
+   the changes and store it in 'bounds'. */
+
+static void
+find_difference_bounds(Gif_OptData *bounds, Gif_Image *gfi, Gif_Image *last)
+{
+  int lf, rt, lf_min, rt_max, tp, bt, x, y;
+  Gif_OptBounds ob;
+
+  /* 1.Aug.99 - use current bounds if possible, since this function is a speed
+     bottleneck */
+  if (!last || last->disposal == GIF_DISPOSAL_NONE
+      || last->disposal == GIF_DISPOSAL_ASIS) {
+    ob = safe_bounds(gfi);
+    lf_min = ob.left;
+    rt_max = ob.left + ob.width - 1;
+    tp = ob.top;
+    bt = ob.top + ob.height - 1;
+  } else {
+    lf_min = 0;
+    rt_max = screen_width - 1;
+    tp = 0;
+    bt = screen_height - 1;
+  }
+
+  for (; tp < screen_height; tp++)
+    if (memcmp(last_data + screen_width * tp, this_data + screen_width * tp,
+	       screen_width * sizeof(OPT_PIXEL)) != 0)
+      break;
+  for (; bt >= tp; bt--)
+    if (memcmp(last_data + screen_width * bt, this_data + screen_width * bt,
+	       screen_width * sizeof(OPT_PIXEL)) != 0)
+      break;
+
+  lf = screen_width;
+  rt = 0;
+  for (y = tp; y <= bt; y++) {
+    OPT_PIXEL *ld = last_data + screen_width * y;
+    OPT_PIXEL *td = this_data + screen_width * y;
+    for (x = lf_min; x < lf; x++)
+      if (ld[x] != td[x])
+	break;
+    lf = x;
+
+    for (x = rt_max; x > rt; x--)
+      if (ld[x] != td[x])
+	break;
+    rt = x;
+  }
+
+  /* 19.Aug.1999 - handle case when there's no difference between frames */
+  if (tp > bt) {
+    tp = bt = gfi->top;
+    lf = rt = gfi->left;
+  }
+
+  bounds->left = lf;
+  bounds->top = tp;
+  bounds->width = rt + 1 - lf;
+  bounds->height = bt + 1 - tp;
+}
+
+
+/* expand_difference_bounds: If the current image has background disposal and
+   the background is transparent, we must expand the difference bounds to
+   include any blanked (newly transparent) pixels that are still transparent
+   in the next image. This function does that by comparing this_data and
+   next_data. The new bounds are passed and stored in 'bounds'; the image's
+   old bounds, which are also the maximum bounds, are passed in
+   'this_bounds'. */
+
+static int
+expand_difference_bounds(Gif_OptData *bounds, Gif_Image *this_bounds)
+{
+  int x, y, expanded = 0;
+
+  int lf = bounds->left, tp = bounds->top,
+      rt = lf + bounds->width - 1, bt = tp + bounds->height - 1;
+
+  Gif_OptBounds ob = safe_bounds(this_bounds);
+  int tlf = ob.left, ttp = ob.top,
+      trt = ob.left + ob.width - 1, tbt = ob.top + ob.height - 1;
+
+  if (lf > rt || tp > bt)
+    lf = 0, tp = 0, rt = screen_width - 1, bt = screen_height - 1;
+
+  for (y = ttp; y < tp; y++) {
+    OPT_PIXEL *now = this_data + screen_width * y;
+    OPT_PIXEL *next = next_data + screen_width * y;
+    for (x = tlf; x <= trt; x++)
+      if (now[x] != TRANSP && next[x] == TRANSP) {
+	expanded = 1;
+	goto found_top;
+      }
+  }
+ found_top:
+  tp = y;
+
+  for (y = tbt; y > bt; y--) {
+    OPT_PIXEL *now = this_data + screen_width * y;
+    OPT_PIXEL *next = next_data + screen_width * y;
+    for (x = tlf; x <= trt; x++)
+      if (now[x] != TRANSP && next[x] == TRANSP) {
+	expanded = 1;
+	goto found_bottom;
+      }
+  }
+ found_bottom:
+  bt = y;
+
+  for (x = tlf; x < lf; x++) {
+    OPT_PIXEL *now = this_data + x;
+    OPT_PIXEL *next = next_data + x;
+    for (y = tp; y <= bt; y++)
+      if (now[y*screen_width] != TRANSP && next[y*screen_width] == TRANSP) {
+	expanded = 1;
+	goto found_left;
+      }
+  }
+ found_left:
+  lf = x;
+
+  for (x = trt; x > rt; x--) {
+    OPT_PIXEL *now = this_data + x;
+    OPT_PIXEL *next = next_data + x;
+    for (y = tp; y <= bt; y++)
+      if (now[y*screen_width] != TRANSP && next[y*screen_width] == TRANSP) {
+	expanded = 1;
+	goto found_right;
+      }
+  }
+ found_right:
+  rt = x;
+
+  if (!expanded)
+    for (y = tp; y <= bt; ++y) {
+      OPT_PIXEL *now = this_data + y*screen_width;
+      OPT_PIXEL *next = next_data + y*screen_width;
+      for (x = lf; x <= rt; ++x)
+	if (now[x] != TRANSP && next[x] == TRANSP) {
+	  expanded = 1;
+	  goto found_expanded;
+	}
+    }
+
+ found_expanded:
+  bounds->left = lf;
+  bounds->top = tp;
+  bounds->width = rt + 1 - lf;
+  bounds->height = bt + 1 - tp;
+  return expanded;
+}
+
+
+/*****
+ * DETERMINE WHICH COLORS ARE USED
+ **/
+
+/* get_used_colors: find which colors are needed by a given image. Sets
+   bounds->needed_colors to the list of all_colormap indices J such that the
+   output colormap must include all_color J (the first
+   bounds->required_color_count entries), followed by those J whose pixels
+   should be replaced by transparency. Each list is in increasing order.
+   Colors not in the image aren't listed: a frame uses at most a few hundred
+   colors, though all_colormap may have many thousands.
+
+   If use_transparency > 0, then a pixel which was the same in the last frame
+   may be replaced with transparency. If use_transparency == 2, transparency
+   MUST be set. (This happens on the first image if the background should be
+   transparent.) */
+
+static void
+get_used_colors(Gif_OptData *bounds, int use_transparency)
+{
+  int top = bounds->top, width = bounds->width, height = bounds->height;
+  int i, x, y, j;
+  int all_ncol = all_colormap->ncol;
+  uint8_t *need = need_scratch;
+  uint16_t *touched = need_touched;
+  int ntouched = 0;
+  uint16_t *list;
+
+  /* set elements that are in the image. need == 2 means the color
+     must be in the map; need == 1 means the color may be replaced by
+     transparency. */
+  for (y = top; y < top + height; y++) {
+    OPT_PIXEL *data = this_data + screen_width * y + bounds->left;
+    OPT_PIXEL *last = last_data + screen_width * y + bounds->left;
+    for (x = 0; x < width; x++) {
+      if (!need[data[x]])
+	touched[ntouched++] = data[x];
+      if (data[x] != last[x])
+	need[data[x]] = REQUIRED;
+      else if (need[data[x]] == 0)
+	need[data[x]] = REPLACE_TRANSP;
+    }
+  }
+  if (need[TRANSP])
+    need[TRANSP] = REQUIRED;
+
+  /* check for too many colors; also force transparency if needed */
+  {
+    int count[3];
+    /* Count distinct pixels in each category */
+    count[0] = count[1] = count[2] = 0;
+    for (i = 0; i < ntouched; i++)
+      count[need[touched[i]]]++;
+    /* If use_transparency is large and there's room, add transparency */
+    if (use_transparency > 1 && !need[TRANSP] && count[REQUIRED] < 256) {
+      touched[ntouched++] = TRANSP;
+      need[TRANSP] = REQUIRED;
+      count[REQUIRED]++;
+    }
+    /* If too many "potentially transparent" pixels, force transparency */
+    if (count[REPLACE_TRANSP] + count[REQUIRED] > 256)
+      use_transparency = 1;
+    /* Make sure transparency is marked necessary if we use it */
+    if (count[REPLACE_TRANSP] > 0 && use_transparency && !need[TRANSP]) {
+      touched[ntouched++] = TRANSP;
+      need[TRANSP] = REQUIRED;
+      count[REQUIRED]++;
+    }
+    /* If not using transparency, change "potentially transparent" pixels to
+       "actually used" pixels */
+    if (!use_transparency) {
+      for (i = 0; i < ntouched; i++)
+	if (need[touched[i]] == REPLACE_TRANSP)
+	  need[touched[i]] = REQUIRED;
+      count[REQUIRED] += count[REPLACE_TRANSP];
+    }
+    /* If too many "actually used" pixels, fail miserably */
+    if (count[REQUIRED] > 256)
+      fatal_error("more than 256 colors required in a frame", count[REQUIRED]);
+    /* If we can afford to have transparency, and we want to use it, then
+       include it */
+    if (count[REQUIRED] < 256 && use_transparency && !need[TRANSP]) {
+      touched[ntouched++] = TRANSP;
+      need[TRANSP] = REQUIRED;
+      count[REQUIRED]++;
+    }
+    bounds->required_color_count = count[REQUIRED];
+  }
+
+  /* put the touched colors in order; when there are many, rescanning is
+     cheaper than sorting */
+  if (ntouched * 8 > all_ncol) {
+    for (i = ntouched = 0; i < all_ncol; i++)
+      if (need[i])
+	touched[ntouched++] = i;
+  } else
+    qsort(touched, ntouched, sizeof(uint16_t), uint16_sorter);
+
+  /* make the list, and leave the scratch array clean for the next frame */
+  list = Gif_NewArray(uint16_t, ntouched ? ntouched : 1);
+  for (i = j = 0; i < ntouched; i++)
+    if (need[touched[i]] == REQUIRED)
+      list[j++] = touched[i];
+  for (i = 0; i < ntouched; i++) {
+    if (need[touched[i]] == REPLACE_TRANSP)
+      list[j++] = touched[i];
+    need[touched[i]] = 0;
+  }
+  bounds->needed_colors = list;
+  bounds->needed_color_count = ntouched;
+}
+
+
+/*****
+ * FIND SUBIMAGES AND COLORS USED
+ **/
+
+static uint64_t
+hash_screen(const OPT_PIXEL *data)
+{
+  uint64_t h = 14695981039346656037ULL;
+  const OPT_PIXEL *end = data + screen_width * screen_height;
+  for (; data < end; data++)
+    h = (h ^ *data) * 1099511628211ULL;
+  return h;
+}
+
+static void
+create_subimages(Gif_Stream *gfs, int optimize_flags, int save_uncompressed)
+{
+  int screen_size;
+  Gif_Image *last_gfi;
+  int next_data_valid;
+  OPT_PIXEL *previous_data = 0;
+
+  screen_size = screen_width * screen_height;
+
+  next_data = Gif_NewArray(OPT_PIXEL, screen_size);
+  next_data_valid = 0;
+
+  need_scratch = Gif_NewArray(uint8_t, all_colormap->ncol);
+  memset(need_scratch, 0, all_colormap->ncol);
+  need_touched = Gif_NewArray(uint16_t, all_colormap->ncol);
+
+  /* do first image. Remember to uncompress it if necessary */
+  erase_screen(last_data);
+  erase_screen(this_data);
+  last_gfi = 0;
+
+  /* PRECONDITION: last_data, previous_data -- garbage
+     this_data -- equal to image data after disposal of previous image
+     next_data -- equal to image data for next image if next_image_valid */
+  for (image_index = 0; image_index < gfs->nimages; image_index++) {
+    Gif_Image *gfi = gfs->images[image_index];
+    Gif_OptData *subimage;
+    if (check_progress("analyze", image_index, gfs->nimages))
+      break;
+    subimage = new_opt_data();
+
+    /* save previous data if necessary */
+    if (gfi->disposal == GIF_DISPOSAL_PREVIOUS) {
+      if (!previous_data)
+	previous_data = Gif_NewArray(OPT_PIXEL, screen_size);
+      memcpy(previous_data, this_data, sizeof(OPT_PIXEL) * screen_size);
+    }
+
+    /* set this_data equal to the current image */
+    if (next_data_valid) {
+      OPT_PIXEL *temp = this_data;
+      this_data = next_data;
+      next_data = temp;
+      next_data_valid = 0;
+    } else
+      apply_frame(this_data, gfi, 0, save_uncompressed);
+
+    if (optimize_flags & GT_OPT_FOLDLOOPS)
+      subimage->screen_hash = hash_screen(this_data);
+
+    /* find minimum area of difference between this image and last image */
+    subimage->disposal = GIF_DISPOSAL_ASIS;
+    if (image_index > 0)
+      find_difference_bounds(subimage, gfi, last_gfi);
+    else {
+      Gif_OptBounds ob = safe_bounds(gfi);
+      subimage->left = ob.left;
+      subimage->top = ob.top;
+      subimage->width = ob.width;
+      subimage->height = ob.height;
+    }
+
+    /* might need to expand difference border if transparent background &
+       background disposal */
+    if ((gfi->disposal == GIF_DISPOSAL_BACKGROUND
+	 || gfi->disposal == GIF_DISPOSAL_PREVIOUS)
+	&& background == TRANSP
+	&& image_index < gfs->nimages - 1) {
+      /* set up next_data */
+      Gif_Image *next_gfi = gfs->images[image_index + 1];
+      apply_frame_disposal(next_data, this_data, previous_data, gfi);
+      apply_frame(next_data, next_gfi, 0, save_uncompressed);
+      next_data_valid = 1;
+      /* expand border as necessary */
+      if (expand_difference_bounds(subimage, gfi))
+	subimage->disposal = GIF_DISPOSAL_BACKGROUND;
+    }
+
+    fix_difference_bounds(subimage);
+
+    /* set map of used colors */
+    {
+      int use_transparency = (optimize_flags & GT_OPT_MASK) > 1 && image_index > 0;
+      if (image_index == 0 && background == TRANSP)
+	use_transparency = 2;
+      get_used_colors(subimage, use_transparency);
+    }
+
+    gfi->user_data = subimage;
+    last_gfi = gfi;
+
+    /* Apply optimized disposal to last_data and unoptimized disposal to
+       this_data. Before 9.Dec.1998 I applied unoptimized disposal uniformly
+       to both. This led to subtle bugs. After all, to determine bounds, we
+       want to compare the current image (only obtainable through unoptimized
+       disposal) with what WILL be left after the previous OPTIMIZED image's
+       disposal. This fix is repeated in create_new_image_data */
+    if (subimage->disposal == GIF_DISPOSAL_BACKGROUND)
+      fill_data_area_subimage(last_data, background, subimage);
+    else
+      copy_data_area_subimage(last_data, this_data, subimage);
+
+    if (last_gfi->disposal == GIF_DISPOSAL_BACKGROUND)
+      fill_data_area(this_data, background, last_gfi);
+    else if (last_gfi->disposal == GIF_DISPOSAL_PREVIOUS) {
+      OPT_PIXEL *temp = previous_data;
+      previous_data = this_data;
+      this_data = temp;
+    }
+  }
+
+  Gif_DeleteArray(next_data);
+  if (previous_data)
+    Gif_DeleteArray(previous_data);
+  Gif_DeleteArray(need_scratch);
+  Gif_DeleteArray(need_touched);
+  need_scratch = 0;
+  need_touched = 0;
+}
+
+
+/*****
+ * CONFIRM A REPEATING CYCLE
+ **/
+
+static void
+dispose_frame(OPT_PIXEL *dst, OPT_PIXEL *previous, Gif_Image *gfi)
+{
+  if (gfi->disposal == GIF_DISPOSAL_BACKGROUND)
+    fill_data_area(dst, background, gfi);
+  else if (gfi->disposal == GIF_DISPOSAL_PREVIOUS)
+    memcpy(dst, previous, sizeof(OPT_PIXEL) * screen_width * screen_height);
+}
+
+/* screens_repeat: Return 1 if every composited screen equals the screen
+   'period' frames earlier. One screen plays the animation from the start
+   while the other plays it from frame 'period', in step. */
+
+static int
+screens_repeat(Gif_Stream *gfs, int period, int save_uncompressed)
+{
+  int screen_size = screen_width * screen_height, i, same = 1;
+  OPT_PIXEL *first = Gif_NewArray(OPT_PIXEL, screen_size * 4);
+  OPT_PIXEL *later = first + screen_size;
+  OPT_PIXEL *first_previous = later + screen_size;
+  OPT_PIXEL *later_previous = first_previous + screen_size;
+  if (!first)
+    return 0;
+
+  erase_screen(later);
+  for (i = 0; i < period; i++) {
+    Gif_Image *gfi = gfs->images[i];
+    if (gfi->disposal == GIF_DISPOSAL_PREVIOUS)
+      memcpy(later_previous, later, sizeof(OPT_PIXEL) * screen_size);
+    apply_frame(later, gfi, 0, save_uncompressed);
+    dispose_frame(later, later_previous, gfi);
+  }
+
+  erase_screen(first);
+  for (i = period; i < gfs->nimages && same; i++) {
+    Gif_Image *first_gfi = gfs->images[i - period], *gfi = gfs->images[i];
+    if (first_gfi->disposal == GIF_DISPOSAL_PREVIOUS)
+      memcpy(first_previous, first, sizeof(OPT_PIXEL) * screen_size);
+    if (gfi->disposal == GIF_DISPOSAL_PREVIOUS)
+      memcpy(later_previous, later, sizeof(OPT_PIXEL) * screen_size);
+    apply_frame(first, first_gfi, 0, save_uncompressed);
+    apply_frame(later, gfi, 0, save_uncompressed);
+    same = memcmp(first, later, sizeof(OPT_PIXEL) * screen_size) == 0;
+    dispose_frame(first, first_previous, first_gfi);
+    dispose_frame(later, later_previous, gfi);
+  }
+
+  Gif_DeleteArray(first);
+  return same;
+}
+
+
+/*****
+ * CREATE OUTPUT FRAME DATA
+ **/
+
+/* simple_frame_data: just copy the data from the image into the frame data.
+   No funkiness, no transparency, nothing */
+
+static void
+simple_frame_data(Gif_Image *gfi, uint8_t *map)
+{
+  Gif_OptBounds ob = safe_bounds(gfi);
+  int x, y, scan_width = gfi->width;
+
+  for (y = 0; y < ob.height; y++) {
+    OPT_PIXEL *from = this_data + screen_width * (y + ob.top) + ob.left;
+    uint8_t *into = gfi->image_data + y * scan_width;
+    for (x = 0; x < ob.width; x++)
+      *into++ = map[*from++];
+  }
+}
+
+
+/* transp_frame_data: copy the frame data into the actual image, using
+   transparency occasionally according to a heuristic described below */
+
+static void
+transp_frame_data(Gif_Stream *gfs, Gif_Image *gfi, uint8_t *map,
+		  int optimize_flags, Gif_CompressInfo *gcinfo)
+{
+  Gif_OptBounds ob = safe_bounds(gfi);
+  int x, y, transparent = gfi->transparent;
+  OPT_PIXEL *last = 0;
+  OPT_PIXEL *cur = 0;
+  uint8_t *data, *begin_same;
+  uint8_t *t2_data = 0, *last_for_t2;
+  int nsame;
+
+  /* First, try w/o transparency. Compare this to the result using
+     transparency and pick the better of the two. */
+  simple_frame_data(gfi, map);
+  Gif_FullCompressImage(gfs, gfi, gcinfo);
+  gcinfo->flags |= GIF_WRITE_SHRINK;
+
+  /* Actually copy data to frame.
+
+     Use transparency if possible to shrink the size of the written GIF.
+
+     The written GIF will be small if patterns (sequences of pixel values)
+     recur in the image.
+     We could conceivably use transparency to produce THE OPTIMAL image,
+     with the most recurring patterns of the best kinds; but this would
+     be very hard (wouldn't it?). Instead, we settle for a heuristic:
+     we try and create RUNS. (Since we *try* to create them, they will
+     presumably recur!) A RUN is a series of adjacent pixels all with the
+     same value.
+
+     By & large, we just use the regular image's values. However, we might
+     create a transparent run *not in* the regular image, if TWO OR MORE
+     adjacent runs OF DIFFERENT COLORS *could* be made transparent.
+
+     (An area can be made transparent if the corresponding area in the previous
+     frame had the same colors as the area does now.)
+
+     Why? If only one run (say of color C) could be transparent, we get no
+     large immediate advantage from making it transparent (it'll be a run of
+     the same length regardless). Also, we might LOSE: what if the run was
+     adjacent to some more of color C, which couldn't be made transparent? If
+     we use color C (instead of the transparent color), then we get a longer
+     run.
+
+     This simple heuristic does a little better than Gifwizard's (6/97)
+     on some images, but does *worse than nothing at all* on others.
+
+     However, it DOES do better than the complicated, greedy algorithm that
+     preceded it; and now we pick either the transparency-optimized version or
+     the normal version, whichever compresses smaller, for the best of both
+     worlds. (9/98)
+
+     On several images, making SINGLE color runs transparent wins over the
+     previous heuristic, so try both at optimize level 3 or above (the cost is
+     ~30%). (2/11) */
+
+    data = begin_same = last_for_t2 = gfi->image_data;
+    nsame = 0;
+
+    for (y = 0; y < ob.height; ++y) {
+	last = last_data + screen_width * (y + ob.top) + ob.left;
+	cur = this_data + screen_width * (y + ob.top) + ob.left;
+	for (x = 0; x < ob.width; ++x) {
+	    if (*cur != *last && map[*cur] != transparent) {
+		if (nsame == 1 && data[-1] != transparent
+		    && (optimize_flags & GT_OPT_MASK) > 2) {
+		    if (!t2_data)
+			t2_data = Gif_NewArray(uint8_t, ob.width * ob.height);
+		    memcpy(t2_data + (last_for_t2 - gfi->image_data),
+			   last_for_t2, begin_same - last_for_t2);
+		    memset(t2_data + (begin_same - gfi->image_data),
+			   transparent, data - begin_same);
+		    last_for_t2 = data;
+		}
+		nsame = 0;
+	    } else if (nsame == 0) {
+		begin_same = data;
+		++nsame;
+	    } else if (nsame == 1 && map[*cur] != data[-1]) {
+		memset(begin_same, transparent, data - begin_same);
+		++nsame;
+	    }
+	    if (nsame > 1)
+		*data = transparent;
+	    else
+		*data = map[*cur];
+	    ++data, ++cur, ++last;
+	}
+    }
+
+    if (t2_data)
+	memcpy(t2_data + (last_for_t2 - gfi->image_data),
+	       last_for_t2, data - last_for_t2);
+
+
+    /* Now, try compressed transparent version(s) and pick the better of the
+       two (or three). */
+    Gif_FullCompressImage(gfs, gfi, gcinfo);
+    if (t2_data) {
+	Gif_SetUncompressedImage(gfi, t2_data, Gif_DeleteArrayFunc, 0);
+        Gif_FullCompressImage(gfs, gfi, gcinfo);
+    }
+    Gif_ReleaseUncompressedImage(gfi);
+
+    gcinfo->flags &= ~GIF_WRITE_SHRINK;
+}
+
+
+/*****
+ * CREATE NEW IMAGE DATA
+ **/
+
+/* last == what last image ended up looking like
+   this == what new image should look like
+
+   last = apply O1 + dispose O1 + ... + apply On-1 + dispose On-1
+   this = apply U1 + dispose U1 + ... + apply Un-1 + dispose Un-1 + apply Un
+
+   invariant: apply O1 + dispose O1 + ... + apply Ok
+   === apply U1 + dispose U1 + ... + apply Uk */
+
+/* passthrough_frame: Under a time budget, a frame may be written as it
+   came in, skipping optimization and compression. That works only if the
+   original frame draws this_data over last_data, and leaves behind what the
+   optimized frame would have, so later frames still fit. On success,
+   'scratch' starts with the screen the frame leaves behind. 'scratch' holds
+   two screens. */
+
+static int
+passthrough_frame(Gif_Image *gfi, Gif_OptData *opt, OPT_PIXEL *scratch)
+{
+  uint32_t screen_size = screen_width * screen_height;
+  OPT_PIXEL *after = scratch, *optimized_after = scratch + screen_size;
+
+  memcpy(after, last_data, sizeof(OPT_PIXEL) * screen_size);
+  apply_frame(after, gfi, 0, 0);
+  if (memcmp(after, this_data, sizeof(OPT_PIXEL) * screen_size) != 0)
+    return 0;
+
+  memcpy(optimized_after, last_data, sizeof(OPT_PIXEL) * screen_size);
+  if (opt->disposal == GIF_DISPOSAL_BACKGROUND)
+    fill_data_area_subimage(optimized_after, background, opt);
+  else
+    copy_data_area_subimage(optimized_after, this_data, opt);
+
+  if (gfi->disposal == GIF_DISPOSAL_BACKGROUND)
+    fill_data_area(after, background, gfi);
+  else if (gfi->disposal == GIF_DISPOSAL_PREVIOUS)
+    memcpy(after, last_data, sizeof(OPT_PIXEL) * screen_size);
+  return memcmp(after, optimized_after, sizeof(OPT_PIXEL) * screen_size) == 0;
+}
+
+static void
+create_new_image_data(Gif_Stream *gfs, int optimize_flags)
+{
+  Gif_Image cur_unopt_gfi;	/* placehoder; maintains pre-optimization
+				   image size so we can apply background
+				   disposal */
+  int screen_size = screen_width * screen_height;
+  OPT_PIXEL *previous_data = 0;
+  OPT_PIXEL *pass_scratch = 0;
+  Gif_CompressInfo gcinfo = gif_write_info;
+
+  gfs->global = out_global_map;
+  start_progressive(gfs);
+
+  /* do first image. Remember to uncompress it if necessary */
+  erase_screen(last_data);
+  erase_screen(this_data);
+
+  image_index = resume_checkpoint(gfs, last_data, this_data,
+				  sizeof(OPT_PIXEL));
+  for (; image_index < gfs->nimages; image_index++) {
+    Gif_Image *cur_gfi = gfs->images[image_index];
+    Gif_OptData *opt = (Gif_OptData *)cur_gfi->user_data;
+    int was_compressed = (cur_gfi->img == 0);
+    int level;
+    double budget_left = 0;
+    if (check_progress("optimize", image_index, gfs->nimages))
+      break;
+    level = choose_effort(gfs, &budget_left);
+
+    /* save previous data if necessary */
+    if (cur_gfi->disposal == GIF_DISPOSAL_PREVIOUS) {
+      previous_data = Gif_NewArray(OPT_PIXEL, screen_size);
+      copy_data_area(previous_data, this_data, cur_gfi);
+    }
+
+    /* set up this_data to be equal to the current image */
+    apply_frame(this_data, cur_gfi, 0, 0);
+
+    /* save actual bounds and disposal from unoptimized version so we can
+       apply the disposal correctly next time through */
+    cur_unopt_gfi = *cur_gfi;
+
+    /* out of time: keep the frame as it is, if we can */
+    if (level == 0) {
+      if (!pass_scratch)
+	pass_scratch = Gif_NewArray(OPT_PIXEL, 2 * screen_size);
+      if (passthrough_frame(cur_gfi, opt, pass_scratch)) {
+	/* the global colormap is changing under it */
+	if (!cur_gfi->local)
+	  cur_gfi->local = Gif_CopyColormap(in_global_map);
+	if (cur_gfi->compressed)
+	  Gif_ReleaseUncompressedImage(cur_gfi);
+	memcpy(last_data, pass_scratch, sizeof(OPT_PIXEL) * screen_size);
+	goto frame_done;
+      }
+      level = 1;
+    }
+    gcinfo.flags = gif_write_info.flags;
+    if (level >= 3)
+      gcinfo.flags |= GIF_WRITE_OPTIMIZE;
+    if (level >= 4)
+      gcinfo.flags |= GIF_WRITE_FLEXIBLE;
+
+    /* set bounds and disposal from optdata */
+    Gif_ReleaseUncompressedImage(cur_gfi);
+    cur_gfi->left = opt->left;
+    cur_gfi->top = opt->top;
+    cur_gfi->width = opt->width;
+    cur_gfi->height = opt->height;
+    cur_gfi->disposal = opt->disposal;
+    if (image_index > 0)
+	cur_gfi->interlace = 0;
+
+    /* find the new image's colormap and then make new data */
+    {
+      uint8_t *map = prepare_colormap(cur_gfi, opt);
+      uint8_t *data = Gif_NewArray(uint8_t, cur_gfi->width * cur_gfi->height);
+      Gif_SetUncompressedImage(cur_gfi, data, Gif_DeleteArrayFunc, 0);
+
+      /* don't use transparency on first frame */
+      if (level > 1 && image_index > 0 && cur_gfi->transparent >= 0)
+	transp_frame_data(gfs, cur_gfi, map,
+			  (optimize_flags & ~GT_OPT_MASK) | level, &gcinfo);
+      else
+	simple_frame_data(cur_gfi, map);
+
+      if (cur_gfi->img) {
+	if (was_compressed || level > 1) {
+	  Gif_FullCompressImage(gfs, cur_gfi, &gcinfo);
+	  Gif_ReleaseUncompressedImage(cur_gfi);
+	} else			/* bug fix 22.May.2001 */
+	  Gif_ReleaseCompressedImage(cur_gfi);
+      }
+
+      Gif_DeleteArray(map);
+    }
+
+    /* Set up last_data and this_data. last_data must contain this_data + new
+       disposal. this_data must contain this_data + old disposal. */
+    if (cur_gfi->disposal == GIF_DISPOSAL_NONE
+	|| cur_gfi->disposal == GIF_DISPOSAL_ASIS)
+      copy_data_area(last_data, this_data, cur_gfi);
+    else if (cur_gfi->disposal == GIF_DISPOSAL_BACKGROUND)
+      fill_data_area(last_data, background, cur_gfi);
+    else
+      assert(0 && "optimized frame has strange disposal");
+
+  frame_done:
+    delete_opt_data(opt);
+    cur_gfi->user_data = 0;
+    record_effort(level, budget_left);
+
+    if (cur_unopt_gfi.disposal == GIF_DISPOSAL_BACKGROUND)
+      fill_data_area(this_data, background, &cur_unopt_gfi);
+    else if (cur_unopt_gfi.disposal == GIF_DISPOSAL_PREVIOUS) {
+      copy_data_area(this_data, previous_data, &cur_unopt_gfi);
+      Gif_DeleteArray(previous_data);
+    }
+
+    progressive_frame(gfs, optimize_flags);
+    checkpoint_frame(gfs, last_data, this_data, sizeof(OPT_PIXEL));
+  }
+
+  Gif_DeleteArray(pass_scratch);
+}
+
+
+/*****
+ * DRIVER
+ **/
+
+static void
+optimize_screens(Gif_Stream *gfs, int optimize_flags, int save_uncompressed,
+		 int subimages_cached)
+{
+  int screen_size = screen_width * screen_height;
+  last_data = Gif_NewArray(OPT_PIXEL, screen_size);
+  this_data = Gif_NewArray(OPT_PIXEL, screen_size);
+
+  if (!subimages_cached) {
+    create_subimages(gfs, optimize_flags, save_uncompressed);
+    if (analysis_cache_dir && !processing_canceled)
+      store_cached_subimages(gfs);
+  }
+  if (!processing_canceled) {
+    if (optimize_flags & GT_OPT_FOLDLOOPS)
+      fold_loops(gfs, screens_repeat, save_uncompressed);
+    create_out_global_map(gfs);
+    create_new_image_data(gfs, optimize_flags);
+  }
+
+  Gif_DeleteArray(last_data);
+  Gif_DeleteArray(this_data);
+}
+
+#undef last_data
+#undef this_data
+#undef next_data
+#undef copy_data_area
+#undef copy_data_area_subimage
+#undef fill_data_area
+#undef fill_data_area_subimage
+#undef erase_screen
+#undef apply_frame
+#undef apply_frame_disposal
+#undef find_difference_bounds
+#undef expand_difference_bounds
+#undef get_used_colors
+#undef hash_screen
+#undef create_subimages
+#undef dispose_frame
+#undef screens_repeat
+#undef simple_frame_data
+#undef transp_frame_data
+#undef passthrough_frame
+#undef create_new_image_data
+#undef optimize_screens
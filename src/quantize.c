@@ -96,6 +96,95 @@ pixel_sort_compare(const void *va, const void *vb)
 }
 
 
+/* A cached histogram holds the histogram size, then two words per color:
+   haspixel and RGB packed as 0xHHRRGGBB, and the pixel count. It also holds
+   the marks histogram() leaves in the stream's colormaps, two words per
+   color, for the global colormap and then each image's local colormap;
+   later passes may copy those colors, marks included. */
+
+static int
+cached_histogram_marks(Gif_Stream *gfs)
+{
+  int i, n = gfs->global ? gfs->global->ncol : 0;
+  for (i = 0; i < gfs->nimages; i++)
+    if (gfs->images[i]->local)
+      n += gfs->images[i]->local->ncol;
+  return n;
+}
+
+static uint32_t *
+cached_colormap_marks(Gif_Colormap *gfcm, uint32_t *words, int restore)
+{
+  int i;
+  for (i = 0; gfcm && i < gfcm->ncol; i++, words += 2)
+    if (restore) {
+      gfcm->col[i].haspixel = words[0];
+      gfcm->col[i].pixel = words[1];
+    } else {
+      words[0] = gfcm->col[i].haspixel;
+      words[1] = gfcm->col[i].pixel;
+    }
+  return words;
+}
+
+static Gif_Color *
+load_cached_histogram(Gif_Stream *gfs, uint64_t digest, int *nhist_store)
+{
+  uint32_t size, *words;
+  Gif_Color *linear;
+  int i, n;
+  uint8_t *data = analysis_cache_load(digest, "hist", 0, &size);
+  if (!data)
+    return 0;
+
+  words = (uint32_t *) data;
+  n = size >= 4 ? words[0] : -1;
+  if (size % 8 != 4 || n > (int) (size / 8)
+      || (size / 8) - n != (uint32_t) cached_histogram_marks(gfs)) {
+    Gif_DeleteArray(data);
+    return 0;
+  }
+
+  linear = Gif_NewArray(Gif_Color, n + 1);
+  for (i = 0, words++; i < n; i++, words += 2) {
+    linear[i].haspixel = words[0] >> 24;
+    linear[i].red = words[0] >> 16;
+    linear[i].green = words[0] >> 8;
+    linear[i].blue = words[0];
+    linear[i].pixel = words[1];
+  }
+  words = cached_colormap_marks(gfs->global, words, 1);
+  for (i = 0; i < gfs->nimages; i++)
+    words = cached_colormap_marks(gfs->images[i]->local, words, 1);
+
+  Gif_DeleteArray(data);
+  *nhist_store = n;
+  return linear;
+}
+
+static void
+store_cached_histogram(Gif_Stream *gfs, uint64_t digest,
+		       const Gif_Color *linear, int n)
+{
+  uint32_t size = 4 + 8 * (n + cached_histogram_marks(gfs));
+  uint32_t *data = (uint32_t *) Gif_NewArray(uint8_t, size);
+  uint32_t *words = data;
+  int i;
+
+  *words++ = n;
+  for (i = 0; i < n; i++, words += 2) {
+    words[0] = ((uint32_t) linear[i].haspixel << 24) | (linear[i].red << 16)
+      | (linear[i].green << 8) | linear[i].blue;
+    words[1] = linear[i].pixel;
+  }
+  words = cached_colormap_marks(gfs->global, words, 0);
+  for (i = 0; i < gfs->nimages; i++)
+    words = cached_colormap_marks(gfs->images[i]->local, words, 0);
+
+  analysis_cache_store(digest, "hist", 0, (uint8_t *) data, size);
+  Gif_DeleteArray(data);
+}
+
 Gif_Color *
 histogram(Gif_Stream *gfs, int *nhist_store)
 {
@@ -104,12 +193,19 @@ histogram(Gif_Stream *gfs, int *nhist_store)
   Gif_Color transparent_color;
   unsigned long ntransparent = 0;
   unsigned long nbackground = 0;
+  uint64_t digest = 0;
   int x, y, i;
 
   unmark_colors(gfs->global);
   for (i = 0; i < gfs->nimages; i++)
     unmark_colors(gfs->images[i]->local);
 
+  if (analysis_cache_dir) {
+    digest = stream_digest(gfs);
+    if ((linear = load_cached_histogram(gfs, digest, nhist_store)))
+      return linear;
+  }
+
   init_histogram(&hist, 0);
 
   /* Count pixels. Be careful about values which are outside the range of the
@@ -127,15 +223,22 @@ histogram(Gif_Stream *gfs, int *nhist_store)
     /* unoptimize the image if necessary */
     if (only_compressed)
       Gif_UncompressImage(gfi);
+    Gif_ApplyIndexMap(gfi);
 
     /* sweep over the image data, counting pixels */
     for (x = 0; x < 256; x++)
       count[x] = 0;
-    for (y = 0; y < gfi->height; y++) {
-      uint8_t *data = gfi->img[y];
-      for (x = 0; x < gfi->width; x++, data++)
+    if (Gif_ImageDense(gfi)) {
+      const uint8_t *data = Gif_ImagePixels(gfi);
+      const uint8_t *end = data + gfi->width * gfi->height;
+      for (; data != end; data++)
 	count[*data]++;
-    }
+    } else
+      for (y = 0; y < gfi->height; y++) {
+	uint8_t *data = gfi->img[y];
+	for (x = 0; x < gfi->width; x++, data++)
+	  count[*data]++;
+      }
 
     /* add counted colors to global histogram */
     col = gfcm->col;
@@ -190,6 +293,8 @@ histogram(Gif_Stream *gfs, int *nhist_store)
 
   delete_histogram(&hist);
   *nhist_store = i;
+  if (analysis_cache_dir)
+    store_cached_histogram(gfs, digest, linear, i);
   return linear;
 }
 
@@ -536,15 +641,24 @@ colormap_flat_diversity(Gif_Color *hist, int nhist, int adapt_size)
 }
 
 
+typedef struct color_hash_item color_hash_item;
 struct color_hash_item {
-  uint8_t red;
-  uint8_t green;
-  uint8_t blue;
+  uint32_t rgb;
   uint32_t pixel;
   color_hash_item *next;
 };
-#define COLOR_HASH_SIZE 20023
-#define COLOR_HASH_CODE(r, g, b)	((uint32_t)(r * 33023 + g * 30013 + b * 27011) % COLOR_HASH_SIZE)
+
+/* The color hash grows with its contents: dithering a large truecolor image
+   can look up a new color at nearly every pixel. */
+struct color_hash {
+  color_hash_item **bucket;
+  uint32_t mask;
+  int shift;
+  int nitems;
+};
+#define COLOR_HASH_INITIAL_BITS	14
+#define COLOR_HASH_RGB(r, g, b)	(((uint32_t) (r) << 16) | ((g) << 8) | (b))
+#define COLOR_HASH_CODE(hash, rgb)	(((rgb) * 2654435761U) >> (hash)->shift)
 
 
 /*****
@@ -555,19 +669,52 @@ static color_hash_item *hash_item_alloc_list;
 static int hash_item_alloc_left;
 #define HASH_ITEM_ALLOC_AMOUNT 512
 
-static color_hash_item **
+static color_hash *
 new_color_hash(void)
 {
-  int i;
-  color_hash_item **hash = Gif_NewArray(color_hash_item *, COLOR_HASH_SIZE);
-  for (i = 0; i < COLOR_HASH_SIZE; i++)
-    hash[i] = 0;
+  uint32_t i;
+  color_hash *hash = Gif_New(color_hash);
+  hash->mask = (1U << COLOR_HASH_INITIAL_BITS) - 1;
+  hash->shift = 32 - COLOR_HASH_INITIAL_BITS;
+  hash->nitems = 0;
+  hash->bucket = Gif_NewArray(color_hash_item *, hash->mask + 1);
+  for (i = 0; i <= hash->mask; i++)
+    hash->bucket[i] = 0;
   return hash;
 }
 
+static void
+delete_color_hash(color_hash *hash)
+{
+  Gif_DeleteArray(hash->bucket);
+  Gif_Delete(hash);
+}
+
+static void
+grow_color_hash(color_hash *hash)
+{
+  color_hash_item **old_bucket = hash->bucket;
+  uint32_t i, old_mask = hash->mask;
+  hash->mask = hash->mask * 2 + 1;
+  hash->shift--;
+  hash->bucket = Gif_NewArray(color_hash_item *, hash->mask + 1);
+  for (i = 0; i <= hash->mask; i++)
+    hash->bucket[i] = 0;
+  for (i = 0; i <= old_mask; i++) {
+    color_hash_item *trav = old_bucket[i], *next;
+    for (; trav; trav = next) {
+      uint32_t hash_code = COLOR_HASH_CODE(hash, trav->rgb);
+      next = trav->next;
+      trav->next = hash->bucket[hash_code];
+      hash->bucket[hash_code] = trav;
+    }
+  }
+  Gif_DeleteArray(old_bucket);
+}
+
 
 static color_hash_item *
-new_color_hash_item(uint8_t red, uint8_t green, uint8_t blue)
+new_color_hash_item(uint32_t rgb)
 {
   color_hash_item *chi;
   if (hash_item_alloc_left <= 0) {
@@ -580,10 +727,7 @@ new_color_hash_item(uint8_t red, uint8_t green, uint8_t blue)
 
   --hash_item_alloc_left;
   chi = &hash_item_alloc_list[hash_item_alloc_left];
-  chi->red = red;
-  chi->green = green;
-  chi->blue = blue;
-  chi->next = 0;
+  chi->rgb = rgb;
   return chi;
 }
 
@@ -602,24 +746,27 @@ free_all_color_hash_items(void)
 
 static int
 hash_color(int red, int green, int blue,
-	   color_hash_item **hash, Gif_Colormap *new_cm)
+	   color_hash *hash, Gif_Colormap *new_cm)
 {
-  uint32_t hash_code = COLOR_HASH_CODE(red, green, blue);
-  color_hash_item *prev = 0, *trav;
+  uint32_t rgb = COLOR_HASH_RGB(red, green, blue);
+  uint32_t hash_code = COLOR_HASH_CODE(hash, rgb);
+  color_hash_item *trav;
 
   /* Is new_cm grayscale? We cache the answer here. */
   static Gif_Colormap *cached_new_cm;
   static int new_cm_grayscale;
 
-  for (trav = hash[hash_code]; trav; prev = trav, trav = trav->next)
-    if (trav->red == red && trav->green == green && trav->blue == blue)
+  for (trav = hash->bucket[hash_code]; trav; trav = trav->next)
+    if (trav->rgb == rgb)
       return trav->pixel;
 
-  trav = new_color_hash_item(red, green, blue);
-  if (prev)
-    prev->next = trav;
-  else
-    hash[hash_code] = trav;
+  if (++hash->nitems > (int) hash->mask) {
+    grow_color_hash(hash);
+    hash_code = COLOR_HASH_CODE(hash, rgb);
+  }
+  trav = new_color_hash_item(rgb);
+  trav->next = hash->bucket[hash_code];
+  hash->bucket[hash_code] = trav;
 
   /* calculate whether new_cm is grayscale */
   if (new_cm != cached_new_cm) {
@@ -684,7 +831,7 @@ hash_color(int red, int green, int blue,
 void
 colormap_image_posterize(Gif_Image *gfi, uint8_t *new_data,
 			 Gif_Colormap *old_cm, Gif_Colormap *new_cm,
-			 color_hash_item **hash, uint32_t *histogram)
+			 color_hash *hash, uint32_t *histogram)
 {
   int ncol = old_cm->ncol;
   Gif_Color *col = old_cm->col;
@@ -718,18 +865,23 @@ colormap_image_posterize(Gif_Image *gfi, uint8_t *new_data,
 #define DITHER_SCALE_M1	(DITHER_SCALE-1)
 #define N_RANDOM_VALUES	512
 
-void
-colormap_image_floyd_steinberg(Gif_Image *gfi, uint8_t *all_new_data,
-			       Gif_Colormap *old_cm, Gif_Colormap *new_cm,
-			       color_hash_item **hash, uint32_t *histogram)
+/* Dither the 'width' x 'height' area of gfi at ('left', 'top').
+
+   The error rows interleave red, green, and blue, so each pixel touches
+   three adjacent words per row. The divisions truncate toward zero, like
+   the original per-channel code, so output is unchanged. */
+static void
+dither_floyd_steinberg(Gif_Image *gfi, uint8_t *all_new_data,
+		       Gif_Colormap *old_cm, Gif_Colormap *new_cm,
+		       color_hash *hash, uint32_t *histogram,
+		       int left, int top, int width, int height)
 {
   static int32_t *random_values = 0;
 
-  int width = gfi->width;
   int dither_direction = 0;
   int transparent = gfi->transparent;
   int i, j;
-  int32_t *r_err, *g_err, *b_err, *r_err1, *g_err1, *b_err1;
+  int32_t *err, *err1;
   Gif_Color *col = old_cm->col;
   Gif_Color *new_col = new_cm->col;
 
@@ -738,12 +890,8 @@ colormap_image_floyd_steinberg(Gif_Image *gfi, uint8_t *all_new_data,
 
   /* Initialize Floyd-Steinberg error vectors to small random values, so we
      don't get artifacts on the top row */
-  r_err = Gif_NewArray(int32_t, width + 2);
-  g_err = Gif_NewArray(int32_t, width + 2);
-  b_err = Gif_NewArray(int32_t, width + 2);
-  r_err1 = Gif_NewArray(int32_t, width + 2);
-  g_err1 = Gif_NewArray(int32_t, width + 2);
-  b_err1 = Gif_NewArray(int32_t, width + 2);
+  err = Gif_NewArray(int32_t, (width + 2) * 3);
+  err1 = Gif_NewArray(int32_t, (width + 2) * 3);
   /* Use the same random values on each call in an attempt to minimize
      "jumping dithering" effects on animations */
   if (!random_values) {
@@ -751,105 +899,176 @@ colormap_image_floyd_steinberg(Gif_Image *gfi, uint8_t *all_new_data,
     for (i = 0; i < N_RANDOM_VALUES; i++)
       random_values[i] = RANDOM() % (DITHER_SCALE_M1 * 2) - DITHER_SCALE_M1;
   }
-  for (i = 0; i < gfi->width + 2; i++) {
-    int j = (i + gfi->left) * 3;
-    r_err[i] = random_values[ (j + 0) % N_RANDOM_VALUES ];
-    g_err[i] = random_values[ (j + 1) % N_RANDOM_VALUES ];
-    b_err[i] = random_values[ (j + 2) % N_RANDOM_VALUES ];
-  }
-  /* *_err1 initialized below */
+  for (i = 0; i < (width + 2) * 3; i++)
+    err[i] = random_values[ ((gfi->left + left) * 3 + i) % N_RANDOM_VALUES ];
+  /* err1 initialized below */
 
   /* Do the image! */
-  for (j = 0; j < gfi->height; j++) {
+  for (j = 0; j < height; j++) {
     int d0, d1, d2, d3;		/* used for error diffusion */
+    int step;
     uint8_t *data, *new_data;
     int x;
 
     if (dither_direction) {
-      x = width - 1;
-      d0 = 0, d1 = 2, d2 = 1, d3 = 0;
+      x = width - 1, step = -1;
+      d0 = 0, d1 = 6, d2 = 3, d3 = 0;
     } else {
-      x = 0;
-      d0 = 2, d1 = 0, d2 = 1, d3 = 2;
+      x = 0, step = 1;
+      d0 = 6, d1 = 0, d2 = 3, d3 = 6;
     }
-    data = &gfi->img[j][x];
-    new_data = all_new_data + j * width + x;
+    data = &gfi->img[top + j][left + x];
+    new_data = all_new_data + (top + j) * gfi->width + left + x;
 
-    for (i = 0; i < width + 2; i++)
-      r_err1[i] = g_err1[i] = b_err1[i] = 0;
+    memset(err1, 0, sizeof(int32_t) * (width + 2) * 3);
 
     /* Do a single row */
-    while (x >= 0 && x < width) {
-      int e, use_r, use_g, use_b;
+    for (; x >= 0 && x < width; x += step, data += step, new_data += step) {
+      int32_t *e0 = err + x * 3, *e1 = err1 + x * 3;
+      int use[3], c;
+      Gif_Color *want, *got;
 
       /* the transparent color never gets adjusted */
       if (*data == transparent)
-	goto next;
+	continue;
 
       /* use Floyd-Steinberg errors to adjust actual color */
-      use_r = col[*data].red + r_err[x+1] / DITHER_SCALE;
-      use_g = col[*data].green + g_err[x+1] / DITHER_SCALE;
-      use_b = col[*data].blue + b_err[x+1] / DITHER_SCALE;
-      use_r = max(use_r, 0);  use_r = min(use_r, 255);
-      use_g = max(use_g, 0);  use_g = min(use_g, 255);
-      use_b = max(use_b, 0);  use_b = min(use_b, 255);
-
-      *new_data = hash_color(use_r, use_g, use_b, hash, new_cm);
+      want = &col[*data];
+      use[0] = want->red + e0[3] / DITHER_SCALE;
+      use[1] = want->green + e0[4] / DITHER_SCALE;
+      use[2] = want->blue + e0[5] / DITHER_SCALE;
+      for (c = 0; c < 3; c++)
+	use[c] = use[c] < 0 ? 0 : (use[c] > 255 ? 255 : use[c]);
+
+      *new_data = hash_color(use[0], use[1], use[2], hash, new_cm);
       histogram[*new_data]++;
 
       /* calculate and propagate the error between desired and selected color.
 	 Assume that, with a large scale (1024), we don't need to worry about
 	 image artifacts caused by error accumulation (the fact that the
 	 error terms might not sum to the error). */
-      e = (use_r - new_col[*new_data].red) * DITHER_SCALE;
-      if (e) {
-	r_err [x+d0] += (e * 7) / 16;
-	r_err1[x+d1] += (e * 3) / 16;
-	r_err1[x+d2] += (e * 5) / 16;
-	r_err1[x+d3] += e / 16;
-      }
-
-      e = (use_g - new_col[*new_data].green) * DITHER_SCALE;
-      if (e) {
-	g_err [x+d0] += (e * 7) / 16;
-	g_err1[x+d1] += (e * 3) / 16;
-	g_err1[x+d2] += (e * 5) / 16;
-	g_err1[x+d3] += e / 16;
-      }
-
-      e = (use_b - new_col[*new_data].blue) * DITHER_SCALE;
-      if (e) {
-	b_err [x+d0] += (e * 7) / 16;
-	b_err1[x+d1] += (e * 3) / 16;
-	b_err1[x+d2] += (e * 5) / 16;
-	b_err1[x+d3] += e / 16;
+      got = &new_col[*new_data];
+      use[0] -= got->red;
+      use[1] -= got->green;
+      use[2] -= got->blue;
+      for (c = 0; c < 3; c++) {
+	int32_t e = use[c] * DITHER_SCALE;
+	e0[d0 + c] += (e * 7) / 16;
+	e1[d1 + c] += (e * 3) / 16;
+	e1[d2 + c] += (e * 5) / 16;
+	e1[d3 + c] += e / 16;
       }
-
-     next:
-      if (dither_direction)
-	x--, data--, new_data--;
-      else
-	x++, data++, new_data++;
     }
     /* Did a single row */
 
     /* change dithering directions */
     {
-      int32_t *temp;
-      temp = r_err; r_err = r_err1; r_err1 = temp;
-      temp = g_err; g_err = g_err1; g_err1 = temp;
-      temp = b_err; b_err = b_err1; b_err1 = temp;
+      int32_t *temp = err;
+      err = err1;
+      err1 = temp;
       dither_direction = !dither_direction;
     }
   }
 
   /* delete temporary storage */
-  Gif_DeleteArray(r_err);
-  Gif_DeleteArray(g_err);
-  Gif_DeleteArray(b_err);
-  Gif_DeleteArray(r_err1);
-  Gif_DeleteArray(g_err1);
-  Gif_DeleteArray(b_err1);
+  Gif_DeleteArray(err);
+  Gif_DeleteArray(err1);
+}
+
+void
+colormap_image_floyd_steinberg(Gif_Image *gfi, uint8_t *new_data,
+			       Gif_Colormap *old_cm, Gif_Colormap *new_cm,
+			       color_hash *hash, uint32_t *histogram)
+{
+  dither_floyd_steinberg(gfi, new_data, old_cm, new_cm, hash, histogram,
+			 0, 0, gfi->width, gfi->height);
+}
+
+
+/* Incremental dithering remembers, for each screen pixel, the last input
+   color dithered there (as 0x1RRGGBB, or 0 for none) and the color it got.
+   A frame reuses those results wherever its input is unchanged, and only
+   dithers the area that changed, plus a margin where the new error
+   diffusion can blend in. Static regions thus keep the same dither pattern
+   from frame to frame, and the optimizer can replace them with
+   transparency. */
+
+#define DITHER_MARGIN	2
+
+static uint32_t *dither_screen_in;
+static uint8_t *dither_screen_out;
+static int dither_screen_width;
+static int dither_screen_height;
+
+#define DITHER_KEY(c)	(0x1000000U | ((c)->red << 16) | ((c)->green << 8) \
+			 | (c)->blue)
+
+void
+colormap_image_floyd_steinberg_incremental
+	(Gif_Image *gfi, uint8_t *new_data,
+	 Gif_Colormap *old_cm, Gif_Colormap *new_cm,
+	 color_hash *hash, uint32_t *histogram)
+{
+  int transparent = gfi->transparent;
+  Gif_Color *col = old_cm->col, *new_col = new_cm->col;
+  int x, y;
+  int left = gfi->width, top = gfi->height, right = 0, bottom = 0;
+
+  if (!dither_screen_in) {
+    int size = dither_screen_width * dither_screen_height;
+    dither_screen_in = Gif_NewArray(uint32_t, size);
+    dither_screen_out = Gif_NewArray(uint8_t, size);
+    memset(dither_screen_in, 0, sizeof(uint32_t) * size);
+  }
+
+  /* find the changed area */
+  for (y = 0; y < gfi->height; y++) {
+    uint8_t *data = gfi->img[y];
+    uint32_t *in = dither_screen_in + dither_screen_width * (gfi->top + y)
+      + gfi->left;
+    uint8_t *out = dither_screen_out + dither_screen_width * (gfi->top + y)
+      + gfi->left;
+    for (x = 0; x < gfi->width; x++, data++)
+      if (*data != transparent
+	  && (in[x] != DITHER_KEY(&col[*data])
+	      || new_col[out[x]].haspixel == 255)) {
+	left = min(left, x);
+	right = max(right, x + 1);
+	top = min(top, y);
+	bottom = max(bottom, y + 1);
+      }
+  }
+
+  /* dither it */
+  if (left < right) {
+    left = max(left - DITHER_MARGIN, 0);
+    top = max(top - DITHER_MARGIN, 0);
+    right = min(right + DITHER_MARGIN, (int) gfi->width);
+    bottom = min(bottom + DITHER_MARGIN, (int) gfi->height);
+    dither_floyd_steinberg(gfi, new_data, old_cm, new_cm, hash, histogram,
+			   left, top, right - left, bottom - top);
+  }
+
+  /* reuse the rest, and remember the results */
+  for (y = 0; y < gfi->height; y++) {
+    uint8_t *data = gfi->img[y];
+    uint8_t *new_row = new_data + y * gfi->width;
+    uint32_t *in = dither_screen_in + dither_screen_width * (gfi->top + y)
+      + gfi->left;
+    uint8_t *out = dither_screen_out + dither_screen_width * (gfi->top + y)
+      + gfi->left;
+    int dithered = y >= top && y < bottom;
+    for (x = 0; x < gfi->width; x++)
+      if (data[x] != transparent) {
+	if (!dithered || x < left || x >= right) {
+	  new_row[x] = out[x];
+	  histogram[out[x]]++;
+	} else {
+	  in[x] = DITHER_KEY(&col[data[x]]);
+	  out[x] = new_row[x];
+	}
+      }
+  }
 }
 
 
@@ -917,17 +1136,71 @@ try_assign_transparency(Gif_Image *gfi, Gif_Colormap *old_cm, uint8_t *new_data,
   return 0;
 }
 
+typedef struct Gt_IndexMapStage {
+  Gif_Stream *gfs;
+  const uint8_t *index_map;
+  const int *map;
+} Gt_IndexMapStage;
+
+/* Apply the final palette order to one frame. Frames are independent
+   here, so this runs as a frame task. */
+static int
+index_map_frame_task(int frame, void *thunk)
+{
+  Gt_IndexMapStage *ims = (Gt_IndexMapStage *)thunk;
+  Gif_Image *gfi = ims->gfs->images[frame];
+  int only_compressed = (gfi->img == 0);
+  int x, y;
+  if (only_compressed)
+    Gif_UncompressImage(gfi);
+
+  if (!Gif_ComposeIndexMap(gfi, ims->index_map) && gfi->img)
+    /* no memory for the index map; remap the pixels now */
+    for (y = 0; y < gfi->height; y++) {
+      uint8_t *data = gfi->img[y];
+      for (x = 0; x < gfi->width; x++, data++)
+	*data = ims->index_map[*data];
+    }
+  if (gfi->transparent >= 0)
+    gfi->transparent = ims->map[gfi->transparent];
+
+  if (only_compressed) {
+    Gif_FullCompressImage(ims->gfs, gfi, &gif_write_info);
+    Gif_ReleaseUncompressedImage(gfi);
+  }
+  return 1;
+}
+
+/* colormap_stream: Change every frame to use 'new_cm'. The remapping pass
+   visits frames in order on one thread, because each frame depends on the
+   ones before it: frames share the color hash, which grows as colors are
+   looked up; a frame that needs a transparent slot may add a color to
+   new_cm for later frames; --dither=incremental carries its screen from
+   frame to frame; and a compressed frame is recompressed against its old
+   colormap, which is freed before the next frame. The final pass, which
+   applies the popularity order, is independent per frame and runs as a
+   frame task. */
+
 void
 colormap_stream(Gif_Stream *gfs, Gif_Colormap *new_cm,
 		colormap_image_func image_changer)
 {
-  color_hash_item **hash = new_color_hash();
+  color_hash *hash = new_color_hash();
   int background_transparent = gfs->images[0]->transparent >= 0;
   Gif_Color *new_col = new_cm->col;
   int new_ncol = new_cm->ncol;
   int imagei, j;
   int compress_new_cm = 1;
 
+  /* size the incremental dithering state to cover every frame */
+  dither_screen_width = gfs->screen_width;
+  dither_screen_height = gfs->screen_height;
+  for (imagei = 0; imagei < gfs->nimages; imagei++) {
+    Gif_Image *gfi = gfs->images[imagei];
+    dither_screen_width = max(dither_screen_width, gfi->left + gfi->width);
+    dither_screen_height = max(dither_screen_height, gfi->top + gfi->height);
+  }
+
   /* make sure colormap has enough space */
   if (new_cm->capacity < 256) {
     Gif_Color *x = Gif_NewArray(Gif_Color, 256);
@@ -947,6 +1220,10 @@ colormap_stream(Gif_Stream *gfs, Gif_Colormap *new_cm,
     Gif_Colormap *gfcm = gfi->local ? gfi->local : gfs->global;
     int only_compressed = (gfi->img == 0);
 
+    /* a canceled stream is thrown away, so skip straight to cleanup */
+    if (check_progress("colormap", imagei, gfs->nimages))
+      goto done;
+
     if (gfcm) {
       /* If there was an old colormap, change the image data */
       uint8_t *new_data = Gif_NewArray(uint8_t, gfi->width * gfi->height);
@@ -1028,6 +1305,9 @@ colormap_stream(Gif_Stream *gfs, Gif_Colormap *new_cm,
 
   if (compress_new_cm) {
     int map[256];
+    uint8_t index_map[256];
+    Gt_IndexMapStage ims;
+    Gif_FrameTask *task;
 
     /* Gif_CopyColormap copies the 'pixel' values as well */
     new_col = gfs->global->col;
@@ -1046,30 +1326,33 @@ colormap_stream(Gif_Stream *gfs, Gif_Colormap *new_cm,
 	break;
       }
 
-    /* map the image data, transparencies, and background */
+    /* map the image data, transparencies, and background. Pixels are not
+       rewritten here: the map is recorded as each image's index map and
+       applied by the optimizer's or the writer's own pass over the pixels. */
+    for (j = 0; j < 256; j++)
+      index_map[j] = (j < new_cm->ncol ? map[j] : 0);
     gfs->background = map[gfs->background];
-    for (imagei = 0; imagei < gfs->nimages; imagei++) {
-      Gif_Image *gfi = gfs->images[imagei];
-      int only_compressed = (gfi->img == 0);
-      uint32_t size;
-      uint8_t *data;
-      if (only_compressed)
-	Gif_UncompressImage(gfi);
-
-      data = gfi->image_data;
-      for (size = gfi->width * gfi->height; size > 0; size--, data++)
-	*data = map[*data];
-      if (gfi->transparent >= 0)
-	gfi->transparent = map[gfi->transparent];
-
-      if (only_compressed) {
-	Gif_FullCompressImage(gfs, gfi, &gif_write_info);
-	Gif_ReleaseUncompressedImage(gfi);
-      }
-    }
+    ims.gfs = gfs;
+    ims.index_map = index_map;
+    ims.map = map;
+    task = Gif_NewFrameTask(gfs->nimages, gif_write_info.threads, 0,
+			    index_map_frame_task, &ims);
+    if (task)
+      Gif_FinishFrameTask(task);
+    else
+      for (imagei = 0; imagei < gfs->nimages; imagei++)
+	index_map_frame_task(imagei, &ims);
+    Gif_DeleteFrameTask(task);
   }
 
+  check_progress("colormap", gfs->nimages, gfs->nimages);
+
+ done:
   /* free storage */
   free_all_color_hash_items();
-  Gif_DeleteArray(hash);
+  delete_color_hash(hash);
+  Gif_DeleteArray(dither_screen_in);
+  Gif_DeleteArray(dither_screen_out);
+  dither_screen_in = 0;
+  dither_screen_out = 0;
 }
@@ -15,9 +15,15 @@
 #include <ctype.h>
 #include <assert.h>
 #include <errno.h>
+#if HAVE_GETTIMEOFDAY && HAVE_SYS_TIME_H
+# include <sys/time.h>
+#else
+# include <time.h>
+#endif
 
 const char *program_name = "gifsicle";
 static int verbose_pos = 0;
+static int verbose_progress_len = 0;
 int error_count = 0;
 int no_warnings = 0;
 
@@ -173,7 +179,23 @@ General options: Also --no-OPTION for info and verbose.\n\
   -o, --output FILE             Write output to FILE.\n\
   -w, --no-warnings             Don't report warnings.\n\
       --conserve-memory         Conserve memory at the expense of speed.\n\
+      --analysis-cache DIR      Reuse analysis results stored in DIR.\n\
+      --frame-cache             Write output as a mappable frame cache.\n\
+  -j, --threads[=N]             Decode and compress frames with N threads.\n\
+      --time-budget MS          Lower optimization effort to finish in MS ms.\n\
+      --progressive             Write frames as they are optimized.\n\
+      --checkpoint FILE         Save optimizer progress to FILE.\n\
+      --checkpoint-interval S   Save a checkpoint every S seconds.\n\
+      --resume                  Continue optimizing from the checkpoint.\n\
       --multifile               Support concatenated GIF files.\n\
+      --max-frame-pixels N      Reject inputs with a frame or screen larger\n\
+                                than N pixels.\n\
+      --max-frames N            Reject inputs with more than N frames.\n\
+      --max-pixels N            Reject inputs whose frames total more than N\n\
+                                pixels.\n\
+      --max-bytes N             Reject inputs with more than N bytes of image\n\
+                                data, compressed plus decoded.\n\
+      --max-read-time MS        Reject inputs that take over MS ms to read.\n\
 \n", program_name);
   printf("\
 Frame selections:               #num, #num1-num2, #num1-, #name\n\
@@ -220,7 +242,7 @@ Whole-GIF options: Also --no-OPTION.\n\
       --change-color COL1 COL2  Change COL1 to COL2 throughout.\n\
   -k, --colors N                Reduce the number of colors to N.\n\
       --color-method METHOD     Set method for choosing reduced colors.\n\
-  -f, --dither                  Dither image after changing colormap.\n\
+  -f, --dither[=METHOD]         Dither image after changing colormap.\n\
       --resize WxH              Resize the output GIF to WxH.\n\
       --resize-width W          Resize to width W and proportional height.\n\
       --resize-height H         Resize to height H and proportional width.\n\
@@ -239,10 +261,23 @@ than compressed GIFs. See http://www.lcdf.org/gifsicle for more information.\n")
 }
 
 
+static void
+erase_verbose_progress(void)
+{
+  int i;
+  for (i = 0; i < verbose_progress_len; i++)
+    fputc(' ', stderr);
+  for (i = 0; i < verbose_progress_len; i++)
+    fputc('\b', stderr);
+  verbose_progress_len = 0;
+}
+
 void
 verbose_open(char open, const char *name)
 {
   int l = strlen(name);
+  if (verbose_progress_len)
+    erase_verbose_progress();
   if (verbose_pos && verbose_pos + 3 + l > 79) {
     fputc('\n', stderr);
     verbose_pos = 0;
@@ -260,6 +295,8 @@ verbose_open(char open, const char *name)
 void
 verbose_close(char close)
 {
+  if (verbose_progress_len)
+    erase_verbose_progress();
   fputc(close, stderr);
   verbose_pos++;
 }
@@ -268,6 +305,8 @@ verbose_close(char close)
 void
 verbose_endline(void)
 {
+  if (verbose_progress_len)
+    erase_verbose_progress();
   if (verbose_pos) {
     fputc('\n', stderr);
     fflush(stderr);
@@ -276,6 +315,99 @@ verbose_endline(void)
 }
 
 
+/*****
+ * Progress and cancellation
+ **/
+
+int processing_canceled = 0;
+
+/* Show the current phase after the verbose output, then back the cursor up
+   so the next verbose text overwrites it. */
+static void
+verbose_progress(const char *phase, int done, int total)
+{
+  static int is_terminal = -1;
+  char buf[80];
+  int i, len;
+  if (is_terminal < 0) {
+    extern int isatty(int);
+    is_terminal = isatty(fileno(stderr)) != 0;
+  }
+  if (!is_terminal)
+    return;
+  len = sprintf(buf, " (%.40s %d/%d)", phase, done, total);
+  if (done >= total || verbose_pos + len > 79) {
+    erase_verbose_progress();
+    return;
+  }
+  fputs(buf, stderr);
+  for (i = len; i < verbose_progress_len; i++)
+    fputc(' ', stderr);
+  for (i = 0; i < len || i < verbose_progress_len; i++)
+    fputc('\b', stderr);
+  verbose_progress_len = len;
+  fflush(stderr);
+}
+
+/* The progress function gifsicle installs in gif_write_info. Returns
+   nonzero to cancel the current output. */
+int
+gifsicle_progress(const char *phase, int done, int total, void *thunk)
+{
+  (void) thunk;
+  if (verbosing)
+    verbose_progress(phase, done, total);
+  return processing_canceled;
+}
+
+/* Report progress through gif_write_info's progress function. Returns 1 if
+   the current output has been canceled; once it has, it stays canceled
+   until processing_canceled is reset. */
+int
+check_progress(const char *phase, int done, int total)
+{
+  if (!processing_canceled && gif_write_info.progress
+      && (*gif_write_info.progress)(phase, done, total,
+				    gif_write_info.progress_thunk))
+    processing_canceled = 1;
+  return processing_canceled;
+}
+
+
+/*****
+ * Time budget
+ **/
+
+unsigned long time_budget = 0;
+static double time_budget_start;
+
+double
+current_msec(void)
+{
+#if HAVE_GETTIMEOFDAY && HAVE_SYS_TIME_H
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec * 1000. + tv.tv_usec / 1000.;
+#else
+  return clock() / (CLOCKS_PER_SEC / 1000.);
+#endif
+}
+
+void
+start_time_budget(void)
+{
+  time_budget_start = current_msec();
+}
+
+/* Returns the milliseconds left in the --time-budget, negative once it is
+   overspent. Only meaningful when time_budget is set. */
+double
+time_budget_left(void)
+{
+  return time_budget - (current_msec() - time_budget_start);
+}
+
+
 /*****
  * Info functions
  **/
@@ -350,9 +482,9 @@ colormap_info(FILE *where, Gif_Colormap *gfcm, char *prefix)
 static void
 extension_info(FILE *where, Gif_Stream *gfs, Gif_Extension *gfex, int count)
 {
-  uint8_t *data = gfex->data;
+  uint8_t *data;
   uint32_t pos = 0;
-  uint32_t len = gfex->length;
+  uint32_t len;
 
   fprintf(where, "  extension %d: ", count);
   if (gfex->kind == 255) {
@@ -371,6 +503,10 @@ extension_info(FILE *where, Gif_Stream *gfs, Gif_Extension *gfex, int count)
     fprintf(where, " before #%d\n", gfex->position);
 
   /* Now, hexl the data. */
+  if (!Gif_UnpacketizeExtension(gfex))
+    return;
+  data = gfex->data;
+  len = gfex->length;
   while (len > 0) {
     uint32_t row = 16;
     uint32_t i;
@@ -1018,6 +1154,7 @@ copy_extension(Gif_Extension *src)
   if (!dest) return 0;
   dest->data = Gif_NewArray(uint8_t, src->length);
   dest->length = src->length;
+  dest->packetized = src->packetized;
   dest->free_data = Gif_DeleteArrayFunc;
   if (!dest->data) {
     Gif_DeleteExtension(dest);
@@ -1231,26 +1368,76 @@ handle_screen(Gif_Stream *dest, uint16_t width, uint16_t height)
     dest->screen_height = height;
 }
 
+/* Return an image to crop in place of 'gfi'. Its pixel rows point into
+   'gfi', so cropping it copies no pixels; it must be deleted before 'gfi'
+   is released. */
+static Gif_Image *
+crop_view_image(Gif_Image *gfi)
+{
+  Gif_Image *view;
+  int i;
+
+  Gif_UncompressImage(gfi);
+  if (!gfi->img || gfi->index_map)
+    return Gif_CopyImage(gfi);
+
+  view = Gif_NewImage();
+  view->identifier = Gif_CopyString(gfi->identifier);
+  if (gfi->comment) {
+    view->comment = Gif_NewComment();
+    merge_comments(view->comment, gfi->comment);
+  }
+  view->local = Gif_CopyColormap(gfi->local);
+  view->transparent = gfi->transparent;
+  view->delay = gfi->delay;
+  view->disposal = gfi->disposal;
+  view->left = gfi->left;
+  view->top = gfi->top;
+  view->width = gfi->width;
+  view->height = gfi->height;
+  view->interlace = gfi->interlace;
+
+  view->img = Gif_NewArray(uint8_t *, gfi->height + 1);
+  for (i = 0; i < gfi->height; i++)
+    view->img[i] = gfi->img[i];
+  view->img[gfi->height] = 0;
+  view->free_image_data = 0;
+  view->stride = gfi->stride;
+  return view;
+}
+
 static void
-handle_flip_and_screen(Gif_Stream *dest, Gif_Image *desti, Gt_Frame *fr)
+handle_flip_and_screen(Gif_Stream *dest, Gif_Image *desti, Gt_Frame *fr,
+		       int defer_orientation)
 {
   Gif_Stream *gfs = fr->stream;
 
   uint16_t screen_width = gfs->screen_width;
   uint16_t screen_height = gfs->screen_height;
-
-  if (fr->flip_horizontal)
-    flip_image(desti, screen_width, screen_height, 0);
-  if (fr->flip_vertical)
-    flip_image(desti, screen_width, screen_height, 1);
-
-  if (fr->rotation == 1)
-    rotate_image(desti, screen_width, screen_height, 1);
-  else if (fr->rotation == 2) {
-    flip_image(desti, screen_width, screen_height, 0);
-    flip_image(desti, screen_width, screen_height, 1);
-  } else if (fr->rotation == 3)
-    rotate_image(desti, screen_width, screen_height, 3);
+  int norient = fr->flip_horizontal + fr->flip_vertical
+    + (fr->rotation == 2 ? 2 : fr->rotation != 0);
+
+  /* Several steps, or a scale to follow: orient in one pass over the
+     pixels, or leave the orientation for scale_image to combine with the
+     scaling. */
+  if ((defer_orientation || norient > 1)
+      && orient_image(desti, screen_width, screen_height, fr->flip_horizontal,
+		      fr->flip_vertical, fr->rotation, defer_orientation))
+    /* done */;
+  else {
+    if (fr->flip_horizontal)
+      flip_image(desti, screen_width, screen_height, 0);
+    if (fr->flip_vertical)
+      flip_image(desti, screen_width, screen_height, 1);
+
+    if (fr->rotation == 1)
+      rotate_image(desti, screen_width, screen_height, 1);
+    else if (fr->rotation == 2) {
+      flip_image(desti, screen_width, screen_height, 0);
+      flip_image(desti, screen_width, screen_height, 1);
+    } else if (fr->rotation == 3)
+      rotate_image(desti, screen_width, screen_height, 3);
+  }
 
   /* handle screen size, which might have height & width exchanged */
   if (fr->rotation == 1 || fr->rotation == 3)
@@ -1419,6 +1606,31 @@ apply_frame_transparent(Gif_Image *gfi, Gt_Frame *fr)
     return old_transparent;
 }
 
+static void
+swap_colormap_marks(Gif_Colormap *gfcm, uint8_t *marks)
+{
+  int i;
+  uint8_t t;
+  for (i = 0; i < gfcm->ncol; i++) {
+    t = gfcm->col[i].haspixel;
+    gfcm->col[i].haspixel = marks[i];
+    marks[i] = t;
+  }
+}
+
+/* Decoding frames is the bulk of merging, and each frame decodes on its
+   own. When the decoded pixels will be kept anyway, frames are decoded by
+   a frame task ahead of the color-marking pass. The thunk is an array of
+   images to decode, with null entries for frames to skip. */
+int
+uncompress_frame_task(int i, void *thunk)
+{
+  Gif_Image **decode = (Gif_Image **) thunk;
+  if (decode[i])
+    Gif_UncompressImage(decode[i]);
+  return 1;
+}
+
 Gif_Stream *
 merge_frame_interval(Gt_Frameset *fset, int f1, int f2,
 		     Gt_OutputData *output_data, int compress_immediately,
@@ -1427,6 +1639,9 @@ merge_frame_interval(Gt_Frameset *fset, int f1, int f2,
   Gif_Stream *dest = Gif_NewStream();
   Gif_Colormap *global = Gif_NewFullColormap(256, 256);
   int i, same_compressed_ok, all_same_compressed_ok;
+  Gif_Image **decode = 0;
+  Gif_FrameTask *decode_task = 0;
+  uint8_t *marks = 0;
 
   global->ncol = 0;
   dest->global = global;
@@ -1489,13 +1704,51 @@ merge_frame_interval(Gt_Frameset *fset, int f1, int f2,
     if (merger[i]->crop && !merger[i]->crop->ready)
       analyze_crop(nmerger, merger[i]->crop, compress_immediately);
 
-  /* mark used colors */
+  /* decode frames in parallel; skip images used by more than one frame
+     (refcount > 2), since two workers mustn't decode the same image */
+  if (!compress_immediately && gif_write_info.threads > 1) {
+    decode = Gif_NewArray(Gif_Image *, nmerger);
+    for (i = 0; i < nmerger; ++i) {
+      Gif_Image *gfi = merger[i]->image;
+      if (!gfi->img && gfi->compressed && gfi->refcount == 2)
+	decode[i] = gfi;
+      else
+	decode[i] = 0;
+    }
+    decode_task = Gif_NewFrameTask(nmerger, gif_write_info.threads, 0,
+				   uncompress_frame_task, decode);
+  }
+
+  /* mark used colors. A local colormap shared by several frames (or with
+     the global colormap) must be marked with each frame's colors alone.
+     Those frames' marks live in a table, 257 bytes per frame with a final
+     byte that says whether the row is used; they are swapped into the
+     colormap while the frame is merged, and back out afterwards. Without
+     memory for the table, the frames share marks, which only costs
+     colormap space. The 'pixel' mappings stay shared. */
   for (i = 0; i < nmerger; ++i) {
-      int old_transp = apply_frame_transparent(merger[i]->image, merger[i]);
+      Gif_Colormap *local = merger[i]->image->local;
+      int old_transp;
+      if (decode_task)
+	  Gif_WaitFrameTask(decode_task, i);
+      if (local && local->refcount > 1 && !marks)
+	  if ((marks = Gif_NewArray(uint8_t, nmerger * 257)))
+	      memset(marks, 0, nmerger * 257);
+      if (local && local->refcount > 1 && marks) {
+	  swap_colormap_marks(local, marks + i * 257);
+	  unmark_colors(local);
+      }
+      old_transp = apply_frame_transparent(merger[i]->image, merger[i]);
       mark_used_colors(merger[i]->stream, merger[i]->image, merger[i]->crop,
                        compress_immediately);
       merger[i]->image->transparent = old_transp;
+      if (local && local->refcount > 1 && marks) {
+	  swap_colormap_marks(local, marks + i * 257);
+	  marks[i * 257 + 256] = 1;
+      }
   }
+  Gif_DeleteFrameTask(decode_task);
+  Gif_DeleteArray(decode);
 
   /* copy stream-wide information from output_data */
   if (output_data->loopcount > -2)
@@ -1529,11 +1782,14 @@ merge_frame_interval(Gt_Frameset *fset, int f1, int f2,
       fr->extensions = 0;
     }
 
-    /* Make a copy of the image and crop it if we're cropping */
+    /* Swap in this frame's marks in a shared colormap */
+    if (marks && marks[i * 257 + 256])
+      swap_colormap_marks(fr->image->local, marks + i * 257);
+
+    /* Make a view of the image and crop it if we're cropping */
     if (fr->crop) {
       int preserve_total_crop;
-      srci = Gif_CopyImage(fr->image);
-      Gif_UncompressImage(srci);
+      srci = crop_view_image(fr->image);
 
       /* Zero-delay frames are a special case.  You might think it was OK to
 	 get rid of totally-cropped delay-0 frames, but many browsers treat
@@ -1565,6 +1821,11 @@ merge_frame_interval(Gt_Frameset *fset, int f1, int f2,
     if ((fr->interlacing >= 0 && fr->interlacing != srci->interlace)
 	|| fr->flip_horizontal || fr->flip_vertical || fr->rotation)
       same_compressed_ok = 0;
+    /* Frames kept uncompressed would just decode the copied data again,
+       and the source pixels are already here; copy those instead. (Under a
+       time budget, the optimizer may still want the compressed data.) */
+    if (compress_immediately <= 0 && srci->img && !time_budget)
+      same_compressed_ok = 0;
 
     desti = merge_image(dest, fr->stream, srci, same_compressed_ok);
 
@@ -1572,7 +1833,9 @@ merge_frame_interval(Gt_Frameset *fset, int f1, int f2,
 
     /* Flipping and rotating, and also setting the screen size */
     if (fr->flip_horizontal || fr->flip_vertical || fr->rotation)
-      handle_flip_and_screen(dest, desti, fr);
+      handle_flip_and_screen(dest, desti, fr,
+			     output_data->scaling != GT_SCALING_NONE
+			     && compress_immediately <= 0);
     else
       handle_screen(dest, fr->stream->screen_width, fr->stream->screen_height);
 
@@ -1613,9 +1876,12 @@ merge_frame_interval(Gt_Frameset *fset, int f1, int f2,
 	Gif_ReleaseUncompressedImage(desti);
       } else if (desti->compressed)
 	Gif_ReleaseCompressedImage(desti);
-    } else if (compress_immediately <= 0) {
+    } else if (compress_immediately <= 0 && desti->compressed) {
+      /* (no compressed data if the orientation waits for scale_image) */
       Gif_UncompressImage(desti);
-      Gif_ReleaseCompressedImage(desti);
+      /* under a time budget, the optimizer may pass the frame through */
+      if (!time_budget)
+	Gif_ReleaseCompressedImage(desti);
     }
 
    merge_frame_done:
@@ -1628,7 +1894,10 @@ merge_frame_interval(Gt_Frameset *fset, int f1, int f2,
     } else
 	fr->transparent.haspixel = 0;
 
-    /* Destroy the copied, cropped image if necessary */
+    if (marks && marks[i * 257 + 256])
+      swap_colormap_marks(fr->image->local, marks + i * 257);
+
+    /* Destroy the cropped view if necessary */
     if (fr->crop)
       Gif_DeleteImage(srci);
 
@@ -1649,6 +1918,7 @@ merge_frame_interval(Gt_Frameset *fset, int f1, int f2,
     fr->stream = 0;
   }
   /** END MERGE LOOP **/
+  Gif_DeleteArray(marks);
 
   /* Cropping the whole output? */
   if (merger[0]->crop && merger[0]->crop == merger[nmerger - 1]->crop) {
@@ -356,6 +356,9 @@ calculate_min_code_bits(Gif_Stream *gfs, Gif_Image *gfi, Gif_Writer *grr)
 {
   int colors_used = -1, min_code_bits, i;
 
+  /* this writer doesn't fuse index maps; apply any pending map first */
+  Gif_ApplyIndexMap(gfi);
+
   if (grr->gcinfo.flags & GIF_WRITE_CAREFUL_MIN_CODE_SIZE) {
     /* calculate m_c_b based on colormap */
     if (grr->local_size > 0)
@@ -691,70 +694,72 @@ write_generic_extension(Gif_Extension *gfex, Gif_Writer *grr)
       gifputblock((uint8_t *)gfex->application, len, grr);
     }
   }
-  while (pos + 255 < gfex->length) {
-    gifputbyte(255, grr);
-    gifputblock(gfex->data + pos, 255, grr);
-    pos += 255;
-  }
-  if (pos < gfex->length) {
-    uint32_t len = gfex->length - pos;
-    gifputbyte(len, grr);
-    gifputblock(gfex->data + pos, len, grr);
+  if (gfex->packetized) {	/* already in sub-blocks */
+    while (pos < gfex->length) {
+      uint16_t amt = (gfex->length - pos > 0x7000 ? 0x7000
+		      : gfex->length - pos);
+      gifputblock(gfex->data + pos, amt, grr);
+      pos += amt;
+    }
+  } else {
+    while (pos + 255 < gfex->length) {
+      gifputbyte(255, grr);
+      gifputblock(gfex->data + pos, 255, grr);
+      pos += 255;
+    }
+    if (pos < gfex->length) {
+      uint32_t len = gfex->length - pos;
+      gifputbyte(len, grr);
+      gifputblock(gfex->data + pos, len, grr);
+    }
   }
   gifputbyte(0, grr);
 }
 
 
-static int
-write_gif(Gif_Stream *gfs, Gif_Writer *grr)
+static void
+write_gif_header(Gif_Stream *gfs, Gif_Writer *grr)
 {
-  int ok = 0;
+  uint8_t isgif89a = 0;
   int i;
-  Gif_Image *gfi;
-  Gif_Extension *gfex = gfs->extensions;
-  Gif_Context gfc;
-
-  gfc.rle_next = Gif_NewArray(Gif_Code, GIF_MAX_CODE + 1);
-  if (!gfc.rle_next)
-    goto done;
-
-  {
-    uint8_t isgif89a = 0;
-    if (gfs->comment || gfs->loopcount > -1)
+  if (gfs->comment || gfs->loopcount > -1)
+    isgif89a = 1;
+  for (i = 0; i < gfs->nimages && !isgif89a; i++) {
+    Gif_Image *gfi = gfs->images[i];
+    if (gfi->identifier || gfi->transparent != -1 || gfi->disposal ||
+	gfi->delay || gfi->comment)
       isgif89a = 1;
-    for (i = 0; i < gfs->nimages && !isgif89a; i++) {
-      gfi = gfs->images[i];
-      if (gfi->identifier || gfi->transparent != -1 || gfi->disposal ||
-	  gfi->delay || gfi->comment)
-	isgif89a = 1;
-    }
-    if (isgif89a)
-      gifputblock((uint8_t *)"GIF89a", 6, grr);
-    else
-      gifputblock((uint8_t *)"GIF87a", 6, grr);
   }
+  if (isgif89a)
+    gifputblock((uint8_t *)"GIF89a", 6, grr);
+  else
+    gifputblock((uint8_t *)"GIF87a", 6, grr);
 
   write_logical_screen_descriptor(gfs, grr);
 
   if (gfs->loopcount > -1)
     write_netscape_loop_extension(gfs->loopcount, grr);
+}
 
-  for (i = 0; i < gfs->nimages; i++) {
-    Gif_Image *gfi = gfs->images[i];
-    while (gfex && gfex->position == i) {
-      write_generic_extension(gfex, grr);
-      gfex = gfex->next;
-    }
-    if (gfi->comment)
-      write_comment_extensions(gfi->comment, grr);
-    if (gfi->identifier)
-      write_name_extension(gfi->identifier, grr);
-    if (gfi->transparent != -1 || gfi->disposal || gfi->delay)
-      write_graphic_control_extension(gfi, grr);
-    if (!write_image(gfs, gfi, &gfc, grr))
-      goto done;
+static void
+write_image_extensions(Gif_Image *gfi, int i, Gif_Extension **gfexp,
+		       Gif_Writer *grr)
+{
+  while (*gfexp && (*gfexp)->position == i) {
+    write_generic_extension(*gfexp, grr);
+    *gfexp = (*gfexp)->next;
   }
+  if (gfi->comment)
+    write_comment_extensions(gfi->comment, grr);
+  if (gfi->identifier)
+    write_name_extension(gfi->identifier, grr);
+  if (gfi->transparent != -1 || gfi->disposal || gfi->delay)
+    write_graphic_control_extension(gfi, grr);
+}
 
+static void
+write_gif_trailer(Gif_Stream *gfs, Gif_Extension *gfex, Gif_Writer *grr)
+{
   while (gfex) {
     write_generic_extension(gfex, grr);
     gfex = gfex->next;
@@ -763,6 +768,38 @@ write_gif(Gif_Stream *gfs, Gif_Writer *grr)
     write_comment_extensions(gfs->comment, grr);
 
   gifputbyte(';', grr);
+}
+
+
+static int
+write_gif(Gif_Stream *gfs, Gif_Writer *grr)
+{
+  int ok = 0;
+  int i;
+  Gif_Extension *gfex = gfs->extensions;
+  Gif_Context gfc;
+
+  gfc.rle_next = Gif_NewArray(Gif_Code, GIF_MAX_CODE + 1);
+  if (!gfc.rle_next)
+    goto done;
+
+  write_gif_header(gfs, grr);
+
+  for (i = 0; i < gfs->nimages; i++) {
+    Gif_Image *gfi = gfs->images[i];
+    if (grr->gcinfo.progress
+	&& (*grr->gcinfo.progress)("write", i, gfs->nimages,
+				   grr->gcinfo.progress_thunk))
+      goto done;
+    write_image_extensions(gfi, i, &gfex, grr);
+    if (!write_image(gfs, gfi, &gfc, grr))
+      goto done;
+  }
+
+  write_gif_trailer(gfs, gfex, grr);
+  if (grr->gcinfo.progress)
+    (*grr->gcinfo.progress)("write", gfs->nimages, gfs->nimages,
+			    grr->gcinfo.progress_thunk);
   ok = 1;
 
  done:
@@ -786,6 +823,59 @@ Gif_FullWriteFile(Gif_Stream *gfs, const Gif_CompressInfo *gcinfo, FILE *f)
 }
 
 
+struct Gif_IncrementalWriter {
+  Gif_Writer grr;
+  Gif_Context gfc;
+  Gif_Extension *gfex;
+  int nimages;
+};
+
+Gif_IncrementalWriter *
+Gif_IncrementalWriteFileInit(Gif_Stream *gfs, const Gif_CompressInfo *gcinfo,
+			     FILE *f)
+{
+  Gif_IncrementalWriter *giw = Gif_New(Gif_IncrementalWriter);
+  if (!giw)
+    return 0;
+  giw->gfc.rle_next = Gif_NewArray(Gif_Code, GIF_MAX_CODE + 1);
+  if (!giw->gfc.rle_next) {
+    Gif_Delete(giw);
+    return 0;
+  }
+  giw->grr.f = f;
+  giw->grr.byte_putter = file_byte_putter;
+  giw->grr.block_putter = file_block_putter;
+  if (gcinfo)
+    giw->grr.gcinfo = *gcinfo;
+  else
+    Gif_InitCompressInfo(&giw->grr.gcinfo);
+  giw->gfex = gfs->extensions;
+  giw->nimages = 0;
+  write_gif_header(gfs, &giw->grr);
+  return giw;
+}
+
+int
+Gif_IncrementalWriteImage(Gif_IncrementalWriter *giw, Gif_Stream *gfs,
+			  Gif_Image *gfi)
+{
+  write_image_extensions(gfi, giw->nimages, &giw->gfex, &giw->grr);
+  giw->nimages++;
+  return write_image(gfs, gfi, &giw->gfc, &giw->grr);
+}
+
+int
+Gif_IncrementalWriteComplete(Gif_IncrementalWriter *giw, Gif_Stream *gfs,
+			     int complete)
+{
+  if (complete)
+    write_gif_trailer(gfs, giw->gfex, &giw->grr);
+  Gif_DeleteArray(giw->gfc.rle_next);
+  Gif_Delete(giw);
+  return complete;
+}
+
+
 #undef Gif_CompressImage
 #undef Gif_WriteFile
 
@@ -13,6 +13,9 @@
 /* Define if GIF LZW compression is off. */
 /* #undef GIF_UNGIF */
 
+/* Define to 1 if you have the `gettimeofday' function. */
+/* #undef HAVE_GETTIMEOFDAY */
+
 /* Define to 1 if you have the <inttypes.h> header file. */
 /* #undef HAVE_INTTYPES_H */
 
@@ -22,6 +25,12 @@
 /* Define to 1 if you have the `mkstemp' function. */
 /* #undef HAVE_MKSTEMP */
 
+/* Define to 1 if you have the `mmap' function. */
+/* #undef HAVE_MMAP */
+
+/* Define if POSIX threads are available. */
+/* #undef HAVE_PTHREAD */
+
 /* Define to 1 if you have the <stdint.h> header file. */
 /* #undef HAVE_STDINT_H */
 
@@ -43,6 +52,12 @@
 /* Define to 1 if you have the <sys/select.h> header file. */
 /* #undef HAVE_SYS_SELECT_H */
 
+/* Define to 1 if you have the <sys/mman.h> header file. */
+/* #undef HAVE_SYS_MMAN_H */
+
+/* Define to 1 if you have the <sys/time.h> header file. */
+/* #undef HAVE_SYS_TIME_H */
+
 /* Define to 1 if you have the <sys/stat.h> header file. */
 /* #undef HAVE_SYS_STAT_H */
 
@@ -143,9 +158,10 @@ extern "C" {
 # include <stddef.h>
 # define xmalloc(s)		fail_die_malloc((s),__FILE__,__LINE__)
 # define xrealloc(p,s)		fail_die_realloc((p),(s),__FILE__,__LINE__)
-# define xfree			free
+# define xfree			Gif_Free
 void *fail_die_malloc(size_t, const char *, int);
 void *fail_die_realloc(void *, size_t, const char *, int);
+void Gif_Free(void *);
 #endif
 
 /* Prototype strerror if we don't have it. */
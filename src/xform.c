@@ -63,15 +63,40 @@ delete_color_transforms(Gt_ColorTransform *list, color_transform_func func)
 void
 apply_color_transforms(Gt_ColorTransform *list, Gif_Stream *gfs)
 {
-  int i;
+  int i, j, ncm = 0, cap = 16;
   Gt_ColorTransform *xform;
-  for (xform = list; xform; xform = xform->next) {
-    if (gfs->global)
-      xform->func(gfs->global, xform->data);
-    for (i = 0; i < gfs->nimages; i++)
-      if (gfs->images[i]->local)
-	xform->func(gfs->images[i]->local, xform->data);
+  Gif_Colormap **cms, **table;
+  if (!list)
+    return;
+
+  /* Frames may share colormaps; transform each distinct colormap once.
+     Colormaps are collected in order, and a hash table, keyed by the
+     hash the reader uses to share colormaps, finds repeats. */
+  while (cap < 2 * (gfs->nimages + 1))
+    cap *= 2;
+  cms = Gif_NewArray(Gif_Colormap *, gfs->nimages + 1);
+  table = Gif_NewArray(Gif_Colormap *, cap);
+  if (!cms || !table)
+    fatal_error("out of memory");
+  for (j = 0; j < cap; j++)
+    table[j] = 0;
+
+  for (i = -1; i < gfs->nimages; i++) {
+    Gif_Colormap *gfcm = i < 0 ? gfs->global : gfs->images[i]->local;
+    if (!gfcm)
+      continue;
+    for (j = Gif_ColormapHash(gfcm) & (cap - 1); table[j] && table[j] != gfcm;
+	 j = (j + 1) & (cap - 1))
+      /* nada */;
+    if (!table[j])
+      table[j] = cms[ncm++] = gfcm;
   }
+
+  for (xform = list; xform; xform = xform->next)
+    for (j = 0; j < ncm; j++)
+      xform->func(cms[j], xform->data);
+  Gif_DeleteArray(cms);
+  Gif_DeleteArray(table);
 }
 
 
@@ -254,8 +279,11 @@ crop_image(Gif_Image *gfi, Gt_Crop *crop, int preserve_total_crop)
     img = 0;
   }
 
+  /* cropped rows keep the original stride */
   Gif_DeleteArray(gfi->img);
   gfi->img = img;
+  if (!img)
+    gfi->stride = 0;
   gfi->width = c.w;
   gfi->height = c.h;
   return gfi->img != 0;
@@ -288,13 +316,26 @@ flip_image(Gif_Image *gfi, int screen_width, int screen_height, int is_vert)
     Gif_DeleteArray(buffer);
   }
 
-  /* vertical flips */
+  /* vertical flips: swap row contents of contiguous images, so the
+     layout stays contiguous; otherwise, or if there's no memory for that,
+     swap row pointers */
   if (is_vert) {
-    uint8_t **buffer = Gif_NewArray(uint8_t *, height);
-    memcpy(buffer, img, height * sizeof(uint8_t *));
-    for (y = 0; y < height; y++)
-      img[y] = buffer[height - y - 1];
+    uint8_t *buffer = 0, *t;
+    if (Gif_ImageContiguous(gfi))
+      buffer = Gif_NewArray(uint8_t, width);
+    for (y = 0; y < height / 2; y++)
+      if (buffer) {
+	memcpy(buffer, img[y], width);
+	memcpy(img[y], img[height - y - 1], width);
+	memcpy(img[height - y - 1], buffer, width);
+      } else {
+	t = img[y];
+	img[y] = img[height - y - 1];
+	img[height - y - 1] = t;
+      }
     gfi->top = screen_height - (gfi->top + height);
+    if (!buffer)
+      gfi->stride = 0;
     Gif_DeleteArray(buffer);
   }
 }
@@ -312,18 +353,34 @@ rotate_image(Gif_Image *gfi, int screen_width, int screen_height, int rotation)
   /* this function can only rotate by 90 or 270 degrees */
   assert(rotation == 1 || rotation == 3);
 
-  if (rotation == 1) {
+  if (Gif_ImageContiguous(gfi)) {
+    /* walk columns of the contiguous buffer directly */
+    const uint8_t *base = Gif_ImagePixels(gfi);
+    uint32_t stride = gfi->stride;
+    if (rotation == 1)
+      for (x = 0; x < width; x++)
+	for (y = height - 1; y >= 0; y--)
+	  *trav++ = base[y * stride + x];
+    else
+      for (x = width - 1; x >= 0; x--)
+	for (y = 0; y < height; y++)
+	  *trav++ = base[y * stride + x];
+  } else if (rotation == 1) {
     for (x = 0; x < width; x++)
       for (y = height - 1; y >= 0; y--)
 	*trav++ = img[y][x];
+  } else {
+    for (x = width - 1; x >= 0; x--)
+      for (y = 0; y < height; y++)
+	*trav++ = img[y][x];
+  }
+
+  if (rotation == 1) {
     x = gfi->left;
     gfi->left = screen_height - (gfi->top + height);
     gfi->top = x;
 
   } else {
-    for (x = width - 1; x >= 0; x--)
-      for (y = 0; y < height; y++)
-	*trav++ = img[y][x];
     y = gfi->top;
     gfi->top = screen_width - (gfi->left + width);
     gfi->left = y;
@@ -336,6 +393,174 @@ rotate_image(Gif_Image *gfi, int screen_width, int screen_height, int rotation)
 }
 
 
+/*****
+ * combined flip, rotate and scale
+ **/
+
+/* A frame's flips and rotation composed into one linear map from output
+   coordinates (x,y) to coordinates in the unoriented source pixels:
+   source x == ax*x + bx*y + cx, source y == ay*x + by*y + cy. When a resize
+   follows, the map and the source pixels wait in the image's user_data, and
+   scale_image produces the final pixels in one gather. */
+typedef struct Gt_Orientation {
+  Gif_Image *source;
+  int ax, bx, cx;
+  int ay, by, cy;
+} Gt_Orientation;
+
+static void
+delete_orientation(void *thunk)
+{
+  Gt_Orientation *o = (Gt_Orientation *)thunk;
+  Gif_DeleteImage(o->source);
+  Gif_Delete(o);
+}
+
+static Gt_Orientation *
+pending_orientation(Gif_Image *gfi)
+{
+  if (gfi->user_data && gfi->free_user_data == delete_orientation)
+    return (Gt_Orientation *)gfi->user_data;
+  else
+    return 0;
+}
+
+static void
+orient_flip(Gif_Image *gfi, Gt_Orientation *o, int screen_width,
+	    int screen_height, int is_vert)
+{
+  if (!is_vert) {
+    int w1 = gfi->width - 1;
+    o->cx += o->ax * w1, o->ax = -o->ax;
+    o->cy += o->ay * w1, o->ay = -o->ay;
+    gfi->left = screen_width - (gfi->left + gfi->width);
+  } else {
+    int h1 = gfi->height - 1;
+    o->cx += o->bx * h1, o->bx = -o->bx;
+    o->cy += o->by * h1, o->by = -o->by;
+    gfi->top = screen_height - (gfi->top + gfi->height);
+  }
+}
+
+static void
+orient_rotate(Gif_Image *gfi, Gt_Orientation *o, int screen_width,
+	      int screen_height, int rotation)
+{
+  int t, left = gfi->left;
+  if (rotation == 1) {
+    int h1 = gfi->height - 1;
+    t = o->ax, o->ax = -o->bx, o->cx += o->bx * h1, o->bx = t;
+    t = o->ay, o->ay = -o->by, o->cy += o->by * h1, o->by = t;
+    gfi->left = screen_height - (gfi->top + gfi->height);
+    gfi->top = left;
+  } else {
+    int w1 = gfi->width - 1;
+    t = o->bx, o->bx = -o->ax, o->cx += o->ax * w1, o->ax = t;
+    t = o->by, o->by = -o->ay, o->cy += o->ay * w1, o->ay = t;
+    gfi->left = gfi->top;
+    gfi->top = screen_width - (left + gfi->width);
+  }
+  t = gfi->width, gfi->width = gfi->height, gfi->height = t;
+}
+
+static void
+orientation_gather(uint8_t *dst, const Gt_Orientation *o,
+		   const int *xsrc, int width, const int *ysrc, int height)
+{
+  /* dst(x,y) = oriented(xsrc[x], ysrc[y]). The orientation is linear, so
+     the source offset splits into a column term and a row term. */
+  const uint8_t *base = Gif_ImagePixels(o->source);
+  long stride = o->source->stride;
+  long xstep = o->ay * stride + o->ax;
+  long ystep = o->by * stride + o->bx;
+  long origin = o->cy * stride + o->cx;
+  long *colofs = Gif_NewArray(long, width);
+  int x, y;
+
+  for (x = 0; x < width; x++)
+    colofs[x] = xsrc[x] * xstep;
+  for (y = 0; y < height; y++) {
+    const uint8_t *row = base + (origin + ysrc[y] * ystep);
+    for (x = 0; x < width; x++)
+      *dst++ = row[colofs[x]];
+  }
+
+  Gif_DeleteArray(colofs);
+}
+
+static void
+finish_orientation(Gif_Image *gfi, Gt_Orientation *o)
+{
+  uint8_t *new_data = Gif_NewArray(uint8_t, gfi->width * gfi->height);
+  uint8_t *index_map = o->source->index_map;
+  int *src = Gif_NewArray(int, gfi->width > gfi->height ? gfi->width : gfi->height);
+  int i;
+
+  for (i = 0; i < gfi->width || i < gfi->height; i++)
+    src[i] = i;
+  orientation_gather(new_data, o, src, gfi->width, src, gfi->height);
+  Gif_DeleteArray(src);
+
+  o->source->index_map = 0;
+  if (gfi->user_data == o)
+    gfi->user_data = 0, gfi->free_user_data = 0;
+  delete_orientation(o);
+  Gif_SetUncompressedImage(gfi, new_data, Gif_DeleteArrayFunc, 0);
+  gfi->index_map = index_map;
+}
+
+int
+orient_image(Gif_Image *gfi, int screen_width, int screen_height,
+	     int flip_horizontal, int flip_vertical, int rotation, int defer)
+{
+  Gt_Orientation *o;
+  Gif_Image *src;
+
+  if (!Gif_ImageContiguous(gfi) || gfi->user_data)
+    return 0;
+
+  /* move the unoriented pixels to a source image */
+  o = Gif_New(Gt_Orientation);
+  o->ax = 1, o->bx = 0, o->cx = 0;
+  o->ay = 0, o->by = 1, o->cy = 0;
+  o->source = src = Gif_NewImage();
+  src->width = gfi->width;
+  src->height = gfi->height;
+  src->img = gfi->img;
+  src->image_data = gfi->image_data;
+  src->free_image_data = gfi->free_image_data;
+  src->image_data_owner = gfi->image_data_owner;
+  src->stride = gfi->stride;
+  src->index_map = gfi->index_map;
+  gfi->img = 0;
+  gfi->image_data = 0;
+  gfi->image_data_owner = 0;
+  gfi->stride = 0;
+  gfi->index_map = 0;
+  Gif_ReleaseUncompressedImage(gfi);
+  Gif_ReleaseCompressedImage(gfi);
+
+  /* same order as the separate transformations */
+  if (flip_horizontal)
+    orient_flip(gfi, o, screen_width, screen_height, 0);
+  if (flip_vertical)
+    orient_flip(gfi, o, screen_width, screen_height, 1);
+  if (rotation == 1 || rotation == 3)
+    orient_rotate(gfi, o, screen_width, screen_height, rotation);
+  else if (rotation == 2) {
+    orient_flip(gfi, o, screen_width, screen_height, 0);
+    orient_flip(gfi, o, screen_width, screen_height, 1);
+  }
+
+  if (defer) {
+    gfi->user_data = o;
+    gfi->free_user_data = delete_orientation;
+  } else
+    finish_orientation(gfi, o);
+  return 1;
+}
+
+
 /*****
  * scale
  **/
@@ -348,9 +573,11 @@ rotate_image(Gif_Image *gfi, int screen_width, int screen_height, int rotation)
 void
 scale_image(Gif_Stream *gfs, Gif_Image *gfi, double xfactor, double yfactor)
 {
-  uint8_t *new_data;
+  uint8_t *new_data, *index_map;
   int new_left, new_top, new_right, new_bottom, new_width, new_height;
-  int was_compressed = (gfi->img == 0);
+  Gt_Orientation *o = pending_orientation(gfi);
+  int was_compressed = (gfi->img == 0 && !o);
+  int *xsrc, *ysrc;
 
   int i, j, new_x, new_y;
   int scaled_xstep, scaled_ystep, scaled_new_x, scaled_new_y;
@@ -386,38 +613,68 @@ scale_image(Gif_Stream *gfs, Gif_Image *gfi, double xfactor, double yfactor)
     Gif_UncompressImage(gfi);
   new_data = Gif_NewArray(uint8_t, new_width * new_height);
 
+  /* Find the source column for each output column, and the source row for
+     each output row; each source pixel covers a block of output pixels. */
+  xsrc = Gif_NewArray(int, new_width);
+  ysrc = Gif_NewArray(int, new_height);
+
+  new_x = new_left;
+  scaled_new_x = scaled_xstep * gfi->left;
+  for (i = 0; i < gfi->width; i++) {
+    int x_delta;
+    scaled_new_x += scaled_xstep;
+    /* account for images which should've had 0 width but don't */
+    if (i == gfi->width - 1) scaled_new_x = SCALE(new_right);
+
+    for (x_delta = UNSCALE(scaled_new_x - SCALE(new_x));
+	 x_delta > 0 && new_x < new_right; new_x++, x_delta--)
+      xsrc[new_x - new_left] = i;
+  }
+  for (; new_x < new_right; new_x++)
+    xsrc[new_x - new_left] = gfi->width - 1;
+
   new_y = new_top;
   scaled_new_y = scaled_ystep * gfi->top;
-
   for (j = 0; j < gfi->height; j++) {
-    uint8_t *in_line = gfi->img[j];
-    uint8_t *out_data;
-    int x_delta, y_delta, yinc;
-
+    int y_delta;
     scaled_new_y += scaled_ystep;
     /* account for images which should've had 0 height but don't */
     if (j == gfi->height - 1) scaled_new_y = SCALE(new_bottom);
 
     if (scaled_new_y < SCALE(new_y + 1)) continue;
-    y_delta = UNSCALE(scaled_new_y - SCALE(new_y));
-
-    new_x = new_left;
-    scaled_new_x = scaled_xstep * gfi->left;
-    out_data = &new_data[(new_y - new_top) * new_width + (new_x - new_left)];
-
-    for (i = 0; i < gfi->width; i++) {
-      scaled_new_x += scaled_xstep;
-      /* account for images which should've had 0 width but don't */
-      if (i == gfi->width - 1) scaled_new_x = SCALE(new_right);
-
-      x_delta = UNSCALE(scaled_new_x - SCALE(new_x));
-
-      for (; x_delta > 0; new_x++, x_delta--, out_data++)
-	for (yinc = 0; yinc < y_delta; yinc++)
-	  out_data[yinc * new_width] = in_line[i];
+    for (y_delta = UNSCALE(scaled_new_y - SCALE(new_y));
+	 y_delta > 0 && new_y < new_bottom; new_y++, y_delta--)
+      ysrc[new_y - new_top] = j;
+  }
+  for (; new_y < new_bottom; new_y++)
+    ysrc[new_y - new_top] = gfi->height - 1;
+
+  /* Gather the output pixels, through the pending orientation if any. */
+  if (gfi->width == 0 || gfi->height == 0)
+    memset(new_data, 0, new_width * new_height);
+  else if (o)
+    orientation_gather(new_data, o, xsrc, new_width, ysrc, new_height);
+  else {
+    uint8_t *out_data = new_data;
+    for (j = 0; j < new_height; j++) {
+      const uint8_t *in_line = gfi->img[ysrc[j]];
+      for (i = 0; i < new_width; i++)
+	*out_data++ = in_line[xsrc[i]];
     }
-
-    new_y += y_delta;
+  }
+  Gif_DeleteArray(xsrc);
+  Gif_DeleteArray(ysrc);
+
+  /* an index map commutes with geometry; keep it */
+  if (o) {
+    index_map = o->source->index_map;
+    o->source->index_map = 0;
+    gfi->user_data = 0;
+    gfi->free_user_data = 0;
+    delete_orientation(o);
+  } else {
+    index_map = gfi->index_map;
+    gfi->index_map = 0;
   }
 
   Gif_ReleaseUncompressedImage(gfi);
@@ -427,26 +684,54 @@ scale_image(Gif_Stream *gfs, Gif_Image *gfi, double xfactor, double yfactor)
   gfi->left = UNSCALE(scaled_xstep * gfi->left);
   gfi->top = UNSCALE(scaled_ystep * gfi->top);
   Gif_SetUncompressedImage(gfi, new_data, Gif_DeleteArrayFunc, 0);
+  gfi->index_map = index_map;
   if (was_compressed) {
     Gif_FullCompressImage(gfs, gfi, &gif_write_info);
     Gif_ReleaseUncompressedImage(gfi);
   }
 }
 
+static void
+finish_orientations(Gif_Stream *gfs)
+{
+  int i;
+  for (i = 0; i < gfs->nimages; i++) {
+    Gt_Orientation *o = pending_orientation(gfs->images[i]);
+    if (o)
+      finish_orientation(gfs->images[i], o);
+  }
+}
+
+typedef struct Gt_ResizeStage {
+  Gif_Stream *gfs;
+  double xfactor, yfactor;
+} Gt_ResizeStage;
+
+static int
+scale_frame_task(int frame, void *thunk)
+{
+  Gt_ResizeStage *rs = (Gt_ResizeStage *)thunk;
+  scale_image(rs->gfs, rs->gfs->images[frame], rs->xfactor, rs->yfactor);
+  return 1;
+}
+
 void
 resize_stream(Gif_Stream *gfs, int new_width, int new_height, int fit)
 {
   double xfactor, yfactor;
+  Gt_ResizeStage rs;
+  Gif_FrameTask *task;
   int i;
 
   Gif_CalculateScreenSize(gfs, 0);
   xfactor = (double) new_width / gfs->screen_width;
   yfactor = (double) new_height / gfs->screen_height;
 
-  if (new_width <= 0 && new_height <= 0)
+  if (new_width <= 0 && new_height <= 0) {
     /* do nothing */
+    finish_orientations(gfs);
     return;
-  else if (new_width <= 0) {
+  } else if (new_width <= 0) {
     xfactor = yfactor;
     new_width = (int) (gfs->screen_width * xfactor + 0.5);
   } else if (new_height <= 0) {
@@ -454,10 +739,11 @@ resize_stream(Gif_Stream *gfs, int new_width, int new_height, int fit)
     new_height = (int) (gfs->screen_height * yfactor + 0.5);
   }
 
-  if (fit && new_width >= gfs->screen_width && new_height >= gfs->screen_height)
+  if (fit && new_width >= gfs->screen_width && new_height >= gfs->screen_height) {
     /* do nothing */
+    finish_orientations(gfs);
     return;
-  else if (fit && xfactor < yfactor) {
+  } else if (fit && xfactor < yfactor) {
     yfactor = xfactor;
     new_height = (int) (gfs->screen_height * yfactor + 0.5);
   } else if (fit && yfactor < xfactor) {
@@ -465,8 +751,27 @@ resize_stream(Gif_Stream *gfs, int new_width, int new_height, int fit)
     new_width = (int) (gfs->screen_width * xfactor + 0.5);
   }
 
-  for (i = 0; i < gfs->nimages; i++)
-    scale_image(gfs, gfs->images[i], xfactor, yfactor);
+  /* Each frame scales on its own, so frames run as a frame task and are
+     collected in order for progress reports */
+  rs.gfs = gfs;
+  rs.xfactor = xfactor;
+  rs.yfactor = yfactor;
+  task = Gif_NewFrameTask(gfs->nimages, gif_write_info.threads, 0,
+			  scale_frame_task, &rs);
+  for (i = 0; i < gfs->nimages; i++) {
+    if (check_progress("resize", i, gfs->nimages)) {
+      if (task)
+	Gif_CancelFrameTask(task);
+      Gif_DeleteFrameTask(task);
+      return;
+    }
+    if (task)
+      Gif_WaitFrameTask(task, i);
+    else
+      scale_frame_task(i, &rs);
+  }
+  Gif_DeleteFrameTask(task);
+  check_progress("resize", gfs->nimages, gfs->nimages);
 
   gfs->screen_width = new_width;
   gfs->screen_height = new_height;
@@ -0,0 +1,42 @@
+#! /bin/sh
+# Interrupt a long optimization once it has saved a checkpoint, resume it
+# with --resume, and check that the result matches an uninterrupted run.
+
+srcdir=${srcdir:-.}
+GIFSICLE=${GIFSICLE:-./src/gifsicle}
+tmp=checkpoint.tmp.$$
+trap 'rm -rf $tmp' 0 1 2 15
+mkdir $tmp || exit 1
+
+fail () {
+    echo "checkpoint.sh: $*" 1>&2
+    exit 1
+}
+
+# sixty large frames, so the job runs long enough to be interrupted
+logo=$srcdir/logo.gif
+$GIFSICLE -U --scale 8 $logo --flip-horizontal $logo --flip-vertical $logo \
+    --rotate-180 $logo --no-flip --no-rotate $logo > $tmp/in.gif \
+    || fail "cannot build input"
+$GIFSICLE -O3 $tmp/in.gif > $tmp/expected.gif || fail "cannot optimize input"
+
+$GIFSICLE -O3 --checkpoint $tmp/ck --checkpoint-interval 0 $tmp/in.gif \
+    > $tmp/killed.gif &
+pid=$!
+while test ! -f $tmp/ck && kill -0 $pid 2>/dev/null; do
+    sleep 0.01 2>/dev/null
+done
+kill -9 $pid 2>/dev/null
+if wait $pid; then
+    echo "checkpoint.sh: job finished before it could be interrupted" 1>&2
+    exit 77
+fi
+test -f $tmp/ck || fail "no checkpoint after interrupt"
+
+$GIFSICLE -O3 --checkpoint $tmp/ck --resume $tmp/in.gif \
+    > $tmp/resumed.gif 2> $tmp/resumed.err || fail "resumed run failed"
+test -s $tmp/resumed.err && fail "resumed run complained: `cat $tmp/resumed.err`"
+cmp -s $tmp/expected.gif $tmp/resumed.gif \
+    || fail "resumed output differs from uninterrupted output"
+test -f $tmp/ck && fail "checkpoint left behind after success"
+exit 0